@@ -17,7 +17,12 @@
 
 #include "DivQuantHeader.h"
 
+#include "DivQuantThreadPool.h"
+
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
 
 #include "assert.h"
 
@@ -29,11 +34,313 @@ using namespace std;
 
 //#define VERBOSE
 
+// Clusters with at least this many points are split with multiple threads
+// when options->num_threads is larger than 1 and thread_min_points is 0.
+#define DEFAULT_THREAD_MIN_POINTS ( 1 << 16 )
+
+// Comparison used to maintain a max heap of cluster indexes ordered by
+// TSE. Equal TSE values are ordered so that the lower cluster index is
+// on top, this matches the result of a linear scan over the TSE array.
+
+struct DivQuantTseLess
+{
+  const double *tse;
+  
+  bool operator()(const int a, const int b) const {
+    if ( tse[a] != tse[b] ) {
+      return tse[a] < tse[b];
+    }
+    return a > b;
+  }
+};
+
+// Storage of the points being clustered. The clustering logic reads and
+// moves points only by way of these methods, so the same templates work
+// with packed pixels and with separate R, G, B planes. A value of either
+// type is a pointer (or pointers) to the first point, so it is passed
+// around by value like a plain pointer.
+
+// Points stored as packed 0x00RRGGBB pixels
+
+struct DivQuantPackedPoints
+{
+  uint32_t *pixels;
+  
+  uint32_t red(const int i) const {
+    return (pixels[i] >> 16) & 0xFF;
+  }
+  
+  uint32_t green(const int i) const {
+    return (pixels[i] >> 8) & 0xFF;
+  }
+  
+  uint32_t blue(const int i) const {
+    return pixels[i] & 0xFF;
+  }
+  
+  // The points starting at point i
+  
+  DivQuantPackedPoints offset(const int i) const {
+    DivQuantPackedPoints points = { pixels + i };
+    return points;
+  }
+  
+  bool same(const DivQuantPackedPoints & other) const {
+    return pixels == other.pixels;
+  }
+  
+  void swap(const int i1, const int i2) const {
+    uint32_t tmp_pixel = pixels[i1];
+    pixels[i1] = pixels[i2];
+    pixels[i2] = tmp_pixel;
+  }
+  
+  // Copy n points starting at point src_i of src to point i
+  
+  void copy(const int i, const DivQuantPackedPoints & src, const int src_i, const int n) const {
+    memcpy(&pixels[i], &src.pixels[src_i], n * sizeof(uint32_t));
+  }
+  
+  void clear(const int n) const {
+    memset(pixels, 0, n * sizeof(uint32_t));
+  }
+  
+  static DivQuantPackedPoints alloc(const int n) {
+    DivQuantPackedPoints points = { new uint32_t[n] };
+    return points;
+  }
+  
+  void release() const {
+    delete [] pixels;
+  }
+  
+  // Local k-means sums over the first n points, see DivQuantLkmSums
+  
+  void lkm_sums(const int simd_level, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, uint64_t *sums) const {
+    DivQuantLkmSums(simd_level, pixels, n, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+  
+  int lkm_weighted_sums(const int simd_level, const double *weights, const int *point_index, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, double *sums) const {
+    return DivQuantLkmWeightedSums(simd_level, pixels, weights, point_index, n, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+  
+  // The integer sums of pixel count weights are exact in double sums
+  
+  int lkm_weighted_sums(const int simd_level, const uint32_t *counts, const int *point_index, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, double *sums) const {
+    uint64_t count_sums[4] = { 0, 0, 0, 0 };
+    int count = DivQuantLkmCountSums(simd_level, pixels, counts, point_index, n, lhs, rhs_red, rhs_green, rhs_blue, count_sums);
+    for ( int i = 0; i < 4; i++ ) {
+      sums[i] += count_sums[i];
+    }
+    return count;
+  }
+};
+
+// Points with at most 5 bits per component (num_bits <= 5) packed 5-5-5
+// in 16 bits, R in bits 10-14, G in bits 5-9 and B in bits 0-4. Each scan
+// of a cluster reads half as many bytes as with DivQuantPackedPoints.
+
+struct DivQuantPacked16Points
+{
+  uint16_t *pixels;
+  
+  uint32_t red(const int i) const {
+    return (pixels[i] >> 10) & 0x1F;
+  }
+  
+  uint32_t green(const int i) const {
+    return (pixels[i] >> 5) & 0x1F;
+  }
+  
+  uint32_t blue(const int i) const {
+    return pixels[i] & 0x1F;
+  }
+  
+  DivQuantPacked16Points offset(const int i) const {
+    DivQuantPacked16Points points = { pixels + i };
+    return points;
+  }
+  
+  bool same(const DivQuantPacked16Points & other) const {
+    return pixels == other.pixels;
+  }
+  
+  void swap(const int i1, const int i2) const {
+    uint16_t tmp_pixel = pixels[i1];
+    pixels[i1] = pixels[i2];
+    pixels[i2] = tmp_pixel;
+  }
+  
+  void copy(const int i, const DivQuantPacked16Points & src, const int src_i, const int n) const {
+    memcpy(&pixels[i], &src.pixels[src_i], n * sizeof(uint16_t));
+  }
+  
+  void clear(const int n) const {
+    memset(pixels, 0, n * sizeof(uint16_t));
+  }
+  
+  static DivQuantPacked16Points alloc(const int n) {
+    DivQuantPacked16Points points = { new uint16_t[n] };
+    return points;
+  }
+  
+  void release() const {
+    delete [] pixels;
+  }
+  
+  // Pack n 24 bit pixels with components less than 32 starting at point i
+  
+  void pack(const int i, const uint32_t *src, const int n) const {
+    for ( int ip = 0; ip < n; ip++ ) {
+      uint32_t pixel = src[ip];
+      pixels[i + ip] = (uint16_t) (((pixel >> 6) & 0x7C00) | ((pixel >> 3) & 0x03E0) | (pixel & 0x1F));
+    }
+  }
+  
+  void lkm_sums(const int simd_level, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, uint64_t *sums) const {
+    DivQuantLkmSums16(simd_level, pixels, n, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+  
+  int lkm_weighted_sums(const int simd_level, const double *weights, const int *point_index, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, double *sums) const {
+    return DivQuantLkmWeightedSums16(simd_level, pixels, weights, point_index, n, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+  
+  int lkm_weighted_sums(const int simd_level, const uint32_t *counts, const int *point_index, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, double *sums) const {
+    uint64_t count_sums[4] = { 0, 0, 0, 0 };
+    int count = DivQuantLkmCountSums16(simd_level, pixels, counts, point_index, n, lhs, rhs_red, rhs_green, rhs_blue, count_sums);
+    for ( int i = 0; i < 4; i++ ) {
+      sums[i] += count_sums[i];
+    }
+    return count;
+  }
+};
+
+// Points stored as separate R, G, B planes. The components of each point
+// are bytes at the same offset in each plane, so loops over a range of
+// points read 3 sequential byte streams that map directly to SIMD loads.
+
+struct DivQuantPlanarPoints
+{
+  uint8_t *red_plane;
+  uint8_t *green_plane;
+  uint8_t *blue_plane;
+  
+  uint32_t red(const int i) const {
+    return red_plane[i];
+  }
+  
+  uint32_t green(const int i) const {
+    return green_plane[i];
+  }
+  
+  uint32_t blue(const int i) const {
+    return blue_plane[i];
+  }
+  
+  DivQuantPlanarPoints offset(const int i) const {
+    DivQuantPlanarPoints points = { red_plane + i, green_plane + i, blue_plane + i };
+    return points;
+  }
+  
+  bool same(const DivQuantPlanarPoints & other) const {
+    return red_plane == other.red_plane && green_plane == other.green_plane && blue_plane == other.blue_plane;
+  }
+  
+  void swap(const int i1, const int i2) const {
+    uint8_t tmp_red = red_plane[i1];
+    uint8_t tmp_green = green_plane[i1];
+    uint8_t tmp_blue = blue_plane[i1];
+    red_plane[i1] = red_plane[i2];
+    green_plane[i1] = green_plane[i2];
+    blue_plane[i1] = blue_plane[i2];
+    red_plane[i2] = tmp_red;
+    green_plane[i2] = tmp_green;
+    blue_plane[i2] = tmp_blue;
+  }
+  
+  void copy(const int i, const DivQuantPlanarPoints & src, const int src_i, const int n) const {
+    memcpy(&red_plane[i], &src.red_plane[src_i], n);
+    memcpy(&green_plane[i], &src.green_plane[src_i], n);
+    memcpy(&blue_plane[i], &src.blue_plane[src_i], n);
+  }
+  
+  void clear(const int n) const {
+    memset(red_plane, 0, n);
+    memset(green_plane, 0, n);
+    memset(blue_plane, 0, n);
+  }
+  
+  // The 3 planes are allocated as a single block
+  
+  static DivQuantPlanarPoints alloc(const int n) {
+    uint8_t *planes = new uint8_t[3 * (size_t) n];
+    DivQuantPlanarPoints points = { planes, planes + n, planes + 2 * (size_t) n };
+    return points;
+  }
+  
+  void release() const {
+    delete [] red_plane;
+  }
+  
+  void lkm_sums(const int simd_level, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, uint64_t *sums) const {
+    DivQuantLkmSumsPlanar(simd_level, red_plane, green_plane, blue_plane, n, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+  
+  int lkm_weighted_sums(const int simd_level, const double *weights, const int *point_index, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, double *sums) const {
+    return DivQuantLkmWeightedSumsPlanar(simd_level, red_plane, green_plane, blue_plane, weights, point_index, n, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+  
+  int lkm_weighted_sums(const int simd_level, const uint32_t *counts, const int *point_index, const int n, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue, double *sums) const {
+    uint64_t count_sums[4] = { 0, 0, 0, 0 };
+    int count = DivQuantLkmCountSumsPlanar(simd_level, red_plane, green_plane, blue_plane, counts, point_index, n, lhs, rhs_red, rhs_green, rhs_blue, count_sums);
+    for ( int i = 0; i < 4; i++ ) {
+      sums[i] += count_sums[i];
+    }
+    return count;
+  }
+};
+
+// The weights of the points are either doubles that add up to 1.0 or
+// uint32_t pixel counts. With counts the sums over the points of a cluster
+// are integers (exact in a double below 2^53) that do not depend on the
+// order they are added in. These sums are normalized with data_weight, 1.0
+// divided by the total count, for each cluster as in the uniform weight case.
+
+template <typename WT>
+static inline constexpr
+bool
+DivQuantCountWeights()
+{
+  return std::is_integral<WT>::value;
+}
+
+// Swap 2 points (and the associated weights) in a cluster range
+
+template <bool UW, typename PT, typename WT>
+static inline
+void
+DivQuantSwapPoints(
+                   const PT & points,
+                   WT *weights,
+                   const int i1,
+                   const int i2)
+{
+  points.swap(i1, i2);
+  
+  if (!UW) {
+    WT tmp_weight = weights[i1];
+    weights[i1] = weights[i2];
+    weights[i2] = tmp_weight;
+  }
+}
+
 // UW  : true if a uniform weight applies to each pixel evenly
-// MT  : type of the member attribute, either uint8_t uint32_t
+// MT  : type of the member attribute, either uint8_t uint16_t uint32_t
 // KM  : true if 1 or more kmeans iterations will be applied
+// PT  : type of the point storage, DivQuantPackedPoints, DivQuantPacked16Points or DivQuantPlanarPoints
+// WT  : type of the weights, double or uint32_t pixel counts
 
-template <bool UW, typename MT, bool KM>
+template <bool UW, typename MT, bool KM, typename PT, typename WT>
 
 #if defined(__LP64__) && __LP64__
 // nop, 64 bit hardware has many more registers to make use of.
@@ -48,109 +355,2426 @@ __attribute__ ((noinline))
 void
 DivQuantClusterInitMeanAndVar(
                 const int num_points,
-                const uint32_t *data,
+                const PT & data,
                 const double data_weight,
-                double *weightsPtr,
+                WT *weightsPtr,
                 Pixel_Double *total_mean,
                 Pixel_Double *total_var)
 {
   double mean_red = 0.0, mean_green = 0.0, mean_blue = 0.0;
   double var_red = 0.0, var_green = 0.0, var_blue = 0.0;
   
-  for ( int ip = 0; ip < num_points; ip++ )
+  for ( int ip = 0; ip < num_points; )
   {
-    uint32_t pixel = data[ip];
-    uint32_t B = pixel & 0xFF;
-    uint32_t G = (pixel >> 8) & 0xFF;
-    uint32_t R = (pixel >> 16) & 0xFF;
+    // In the uniform weight case the sums over a block of 0xFFFF points fit
+    // in 32 bits, so the inner loop has no conversions and can be vectorized.
+    
+    uint32_t sum_red = 0, sum_green = 0, sum_blue = 0;
+    uint32_t sum_sqr_red = 0, sum_sqr_green = 0, sum_sqr_blue = 0;
+    
+    int maxLoopOffset = 0xFFFF;
+    int numLeft = (num_points - ip);
+    if (numLeft < maxLoopOffset) {
+      maxLoopOffset = numLeft;
+    }
+    maxLoopOffset += ip;
+    
+    for ( ; ip < maxLoopOffset; ip++ ) {
+      uint32_t R = data.red(ip);
+      uint32_t G = data.green(ip);
+      uint32_t B = data.blue(ip);
+      
+      if (UW) {
+        sum_red += R;
+        sum_green += G;
+        sum_blue += B;
+        
+        sum_sqr_red += ( R * R );
+        sum_sqr_green += ( G * G );
+        sum_sqr_blue += ( B * B );
+      } else {
+        // non-uniform weights
+        
+        double tmp_weight = weightsPtr[ip];
+        
+        mean_red += tmp_weight * R;
+        mean_green += tmp_weight * G;
+        mean_blue += tmp_weight * B;
+        
+        var_red += tmp_weight * ( R * R );
+        var_green += tmp_weight * ( G * G );
+        var_blue += tmp_weight * ( B * B );
+      }
+    }
     
     if (UW) {
-      mean_red += R;
-      mean_green += G;
-      mean_blue += B;
+      mean_red += sum_red;
+      mean_green += sum_green;
+      mean_blue += sum_blue;
       
-      var_red += ( R * R );
-      var_green += ( G * G );
-      var_blue += ( B * B );
-    } else {
-      // non-uniform weights
+      var_red += sum_sqr_red;
+      var_green += sum_sqr_green;
+      var_blue += sum_sqr_blue;
+    }
+  }
+  
+  if (UW || DivQuantCountWeights<WT>()) {
+    // In uniform weight and count cases do the multiply outside the loop
+    
+    mean_red *= data_weight;
+    mean_green *= data_weight;
+    mean_blue *= data_weight;
+    
+    var_red *= data_weight;
+    var_green *= data_weight;
+    var_blue *= data_weight;
+  }
+  
+  var_red -= SQR ( mean_red );
+  var_green -= SQR ( mean_green );
+  var_blue -= SQR ( mean_blue );
+  
+  // Copy data to user supplied pointers
+  
+  total_mean->red = mean_red;
+  total_mean->green = mean_green;
+  total_mean->blue = mean_blue;
+  
+  total_var->red = var_red;
+  total_var->green = var_green;
+  total_var->blue = var_blue;
+  
+#ifdef VERBOSE
+  if ( 1 )
+  {
+    printf ( "new Global mean (R G B) (%0.2f %0.2f %0.2f)\n", total_mean->red, total_mean->green, total_mean->blue );
+    printf ( "new Global var  (R G B) (%0.2f %0.2f %0.2f)\n", total_var->red, total_var->green, total_var->blue );
+  }
+#endif
+}
+
+// Sums accumulated over a range of the points in the cluster being split.
+// The sums only include the points that are assigned to the new cluster C2,
+// except for old_count which is the number of points assigned to C1.
+
+typedef struct
+{
+  Pixel_Double sum; /* (weighted) sum of each component */
+  Pixel_Double sum_sqr; /* (weighted) sum of each squared component */
+  double weight; /* sum of the weights (non-uniform weights only) */
+  int size; /* number of points */
+  int old_count; /* number of points in C1 */
+  double mse; /* MSE of both clusters (VERBOSE only) */
+} Split_Sums;
+
+static inline
+void
+DivQuantResetSums(Split_Sums *sums)
+{
+  memset(sums, 0, sizeof(Split_Sums));
+}
+
+static inline
+void
+DivQuantAddSums(Split_Sums *sums, const Split_Sums *range_sums)
+{
+  sums->sum.red += range_sums->sum.red;
+  sums->sum.green += range_sums->sum.green;
+  sums->sum.blue += range_sums->sum.blue;
+  
+  sums->sum_sqr.red += range_sums->sum_sqr.red;
+  sums->sum_sqr.green += range_sums->sum_sqr.green;
+  sums->sum_sqr.blue += range_sums->sum_sqr.blue;
+  
+  sums->weight += range_sums->weight;
+  sums->size += range_sums->size;
+  sums->old_count += range_sums->old_count;
+  sums->mse += range_sums->mse;
+}
+
+// STEP 3 for the points in [begin, end) of the cluster being split. Points
+// with a projection larger than cut_pos are assigned to C2. When save_member
+// is true the assignment is final and the membership of each point is saved,
+// in the inplace case the points that stay in C1 are moved to the front
+// of [begin, end) instead.
+//
+// AXIS is the cutting axis, so the component is selected at compile time.
+// The components are integers, so a component is larger than cut_pos
+// exactly when it is larger than cut_threshold = floor(cut_pos) and the
+// test is done in integer math.
+
+template <bool UW, typename MT, typename PT, typename WT, int AXIS>
+static
+void
+DivQuantSplitRange(
+                   const PT & tmp_data,
+                   WT *tmp_weights,
+                   const int *point_index,
+                   MT *member,
+                   const int begin,
+                   const int end,
+                   const int cut_threshold,
+                   const bool save_member,
+                   const int new_index,
+                   const bool inplace,
+                   Split_Sums *sums)
+{
+  uint32_t proj_val; /* projection of a data point on the cutting axis */
+  double tmp_weight = 0.0; /* weight of a particular pixel */
+  int old_count = 0;
+  
+  if (UW && !save_member) {
+    // Only the sums of C2 are needed, so the points are added with a mask
+    // instead of a branch and the loop can be vectorized.
+    
+    for ( int ip = begin; ip < end; )
+    {
+      uint32_t new_mean_red = 0;
+      uint32_t new_mean_green = 0;
+      uint32_t new_mean_blue = 0;
+      uint32_t new_size = 0;
+      
+      int maxLoopOffset = 0xFFFF;
+      int numLeft = (end - ip);
+      if (numLeft < maxLoopOffset) {
+        maxLoopOffset = numLeft;
+      }
+      maxLoopOffset += ip;
+      
+      for ( ; ip < maxLoopOffset; ip++ ) {
+        uint32_t R = tmp_data.red(ip);
+        uint32_t G = tmp_data.green(ip);
+        uint32_t B = tmp_data.blue(ip);
+        
+        proj_val = ( AXIS == 0 ) ? R : ( ( AXIS == 1 ) ? G : B );
+        
+        uint32_t is_new = ( (int) proj_val > cut_threshold );
+        uint32_t mask = 0 - is_new;
+        
+        new_mean_red += R & mask;
+        new_mean_green += G & mask;
+        new_mean_blue += B & mask;
+        new_size += is_new;
+      }
+      
+      sums->sum.red += new_mean_red;
+      sums->sum.green += new_mean_green;
+      sums->sum.blue += new_mean_blue;
+      sums->size += new_size;
+    }
+    
+    sums->old_count = 0;
+    return;
+  }
+  
+  for ( int ip = begin; ip < end; )
+  {
+    uint32_t new_mean_red = 0;
+    uint32_t new_mean_green = 0;
+    uint32_t new_mean_blue = 0;
+    
+    uint32_t new_var_red = 0;
+    uint32_t new_var_green = 0;
+    uint32_t new_var_blue = 0;
+    
+    int maxLoopOffset = 0xFFFF;
+    int numLeft = (end - ip);
+    if (numLeft < maxLoopOffset) {
+      maxLoopOffset = numLeft;
+    }
+    maxLoopOffset += ip;
+    
+    for ( ; ip < maxLoopOffset; ip++ ) {
+      
+      uint32_t R = tmp_data.red(ip);
+      uint32_t G = tmp_data.green(ip);
+      uint32_t B = tmp_data.blue(ip);
+      
+#ifdef VERBOSE
+      printf ( "pixel (R G B) (%d %d %d)\n", R, G, B );
+#endif
       
-      double tmp_weight = weightsPtr[ip];
+      proj_val = ( AXIS == 0 ) ? R : ( ( AXIS == 1 ) ? G : B );
       
-      mean_red += tmp_weight * R;
-      mean_green += tmp_weight * G;
-      mean_blue += tmp_weight * B;
+#ifdef VERBOSE
+      printf ( "proj_val %d and cut_threshold %d\n", proj_val, cut_threshold);
+#endif
+      
+      if ( (int) proj_val > cut_threshold )
+      {
+#ifdef VERBOSE
+        printf ( "Cut GT   : %d < %d\n", cut_threshold, proj_val);
+#endif
+        
+        int pointindex = ip;
+        if (point_index) {
+          pointindex = point_index[ip];
+        }
+        
+        if (UW) {
+          new_mean_red += R;
+          new_mean_green += G;
+          new_mean_blue += B;
+        } else {
+          // non-uniform weights
+          
+          tmp_weight = tmp_weights[pointindex];
+          
+          sums->sum.red += tmp_weight * R;
+          sums->sum.green += tmp_weight * G;
+          sums->sum.blue += tmp_weight * B;
+        }
+        
+        // Update the point membership and variance of the new cluster
+        if ( save_member )
+        {
+          if (!inplace) {
+            member[pointindex] = new_index;
+#ifdef VERBOSE
+            fprintf(stdout, "write member[%d] = %d (ip = %d)\n", pointindex, member[pointindex], ip);
+#endif
+          }
+          
+          if (UW) {
+            new_var_red += ( R * R );
+            new_var_green += ( G * G );
+            new_var_blue += ( B * B );
+          } else {
+            // non-uniform weights
+            
+            // tmp_weight already set above in loop
+            
+            sums->sum_sqr.red += tmp_weight * ( R * R );
+            sums->sum_sqr.green += tmp_weight * ( G * G );
+            sums->sum_sqr.blue += tmp_weight * ( B * B );
+          }
+        }
+        
+        // Update the weight/size of the new cluster
+        
+        if (UW) {
+        } else {
+          sums->weight += tmp_weight;
+        }
+        sums->size++;
+      } else {
+#ifdef VERBOSE
+        printf ( "Cut LTEQ : %d >= %d\n", cut_threshold, proj_val);
+#endif
+        
+        if ( inplace && save_member )
+        {
+          // Point stays in C1
+          DivQuantSwapPoints<UW, PT, WT>(tmp_data, tmp_weights, begin + old_count, ip);
+          old_count++;
+        }
+      }
       
-      var_red += tmp_weight * ( R * R );
-      var_green += tmp_weight * ( G * G );
-      var_blue += tmp_weight * ( B * B );
+    } // end foreach point inner loop
+    
+    if (UW) {
+      sums->sum.red += new_mean_red;
+      sums->sum.green += new_mean_green;
+      sums->sum.blue += new_mean_blue;
+      
+      sums->sum_sqr.red += new_var_red;
+      sums->sum_sqr.green += new_var_green;
+      sums->sum_sqr.blue += new_var_blue;
+    }
+    
+  } // end foreach point outer loop
+  
+  sums->old_count = old_count;
+}
+
+// Accumulate the points in [begin, end) of the cluster being split into 256
+// bins indexed by the component on the cutting axis. Each bin holds the sums
+// of all 3 components (and their squares) of the points in it, so the sums
+// of the points on either side of any cut along the axis are prefix sums.
+
+template <bool UW, typename PT, typename WT>
+static
+void
+DivQuantHistogramRange(
+                       const PT & tmp_data,
+                       const WT *tmp_weights,
+                       const int *point_index,
+                       const int begin,
+                       const int end,
+                       const int cut_axis,
+                       Split_Sums *bins)
+{
+  if (UW) {
+    // Integer sums, the sums of up to 2^31 points fit in 64 bits. The
+    // sums of a bin share one cache line and consecutive points (often in
+    // the same bin) are added to 2 copies of the bins in turn, so the adds
+    // to the same bin do not wait on each other.
+    
+    struct Bin_Sums {
+      uint64_t count, sum[3], sum_sqr[3], pad;
+    };
+    
+    Bin_Sums bin_sums[2][256];
+    memset(bin_sums, 0, sizeof(bin_sums));
+    
+    for ( int ip = begin; ip < end; ip++ ) {
+      uint32_t R = tmp_data.red(ip);
+      uint32_t G = tmp_data.green(ip);
+      uint32_t B = tmp_data.blue(ip);
+      
+      uint32_t bin = ( ( cut_axis == 0 ) ? R :
+                      ( ( cut_axis == 1 ) ? G : B ) );
+      
+      Bin_Sums *b = &bin_sums[ip & 0x1][bin];
+      
+      b->count++;
+      
+      b->sum[0] += R;
+      b->sum[1] += G;
+      b->sum[2] += B;
+      
+      b->sum_sqr[0] += ( R * R );
+      b->sum_sqr[1] += ( G * G );
+      b->sum_sqr[2] += ( B * B );
+    }
+    
+    for ( int bin = 0; bin < 256; bin++ ) {
+      const Bin_Sums *b0 = &bin_sums[0][bin];
+      const Bin_Sums *b1 = &bin_sums[1][bin];
+      
+      bins[bin].sum.red += b0->sum[0] + b1->sum[0];
+      bins[bin].sum.green += b0->sum[1] + b1->sum[1];
+      bins[bin].sum.blue += b0->sum[2] + b1->sum[2];
+      
+      bins[bin].sum_sqr.red += b0->sum_sqr[0] + b1->sum_sqr[0];
+      bins[bin].sum_sqr.green += b0->sum_sqr[1] + b1->sum_sqr[1];
+      bins[bin].sum_sqr.blue += b0->sum_sqr[2] + b1->sum_sqr[2];
+      
+      bins[bin].size += (int) ( b0->count + b1->count );
+    }
+  } else {
+    for ( int ip = begin; ip < end; ip++ ) {
+      uint32_t R = tmp_data.red(ip);
+      uint32_t G = tmp_data.green(ip);
+      uint32_t B = tmp_data.blue(ip);
+      
+      int pointindex = ip;
+      if (point_index) {
+        pointindex = point_index[ip];
+      }
+      
+      double tmp_weight = tmp_weights[pointindex];
+      
+      uint32_t bin = ( ( cut_axis == 0 ) ? R :
+                      ( ( cut_axis == 1 ) ? G : B ) );
+      
+      Split_Sums *b = &bins[bin];
+      
+      b->sum.red += tmp_weight * R;
+      b->sum.green += tmp_weight * G;
+      b->sum.blue += tmp_weight * B;
+      
+      b->sum_sqr.red += tmp_weight * ( R * R );
+      b->sum_sqr.green += tmp_weight * ( G * G );
+      b->sum_sqr.blue += tmp_weight * ( B * B );
+      
+      b->weight += tmp_weight;
+      b->size++;
+    }
+  }
+}
+
+// Squared error of the points that add up to sums, the uniform weight
+// sums are not scaled so this is in units of data_weight in that case.
+
+template <bool UW>
+static inline
+double
+DivQuantSumsSqrError(const Split_Sums *sums)
+{
+  const double w = UW ? (double) sums->size : sums->weight;
+  
+  return ( sums->sum_sqr.red - SQR ( sums->sum.red ) / w ) +
+  ( sums->sum_sqr.green - SQR ( sums->sum.green ) / w ) +
+  ( sums->sum_sqr.blue - SQR ( sums->sum.blue ) / w );
+}
+
+// STEP 2 with a histogram of the cluster being split. Instead of the mean,
+// the cut is placed between the 2 bins on the cutting axis that minimize
+// the sum of the squared errors of C1 and C2. On return cut_pos is the
+// component value of the last bin in C1 and c2_sums holds the sums of the
+// points in C2, the same sums DivQuantSplitRange would return for this
+// cut with save_member set to false. Returns false when all the points are
+// in a single bin, the cut at the mean is then used instead.
+
+template <bool UW, typename PT, typename WT>
+static
+bool
+DivQuantHistogramCut(
+                     const PT & tmp_data,
+                     const WT *tmp_weights,
+                     const int *point_index,
+                     const int num_points,
+                     const int cut_axis,
+                     DivQuantThreadPool *pool,
+                     const int num_chunks,
+                     int *cut_pos,
+                     Split_Sums *c2_sums)
+{
+  std::vector<Split_Sums> bins(256 * (num_chunks > 1 ? num_chunks : 1));
+  
+  for ( Split_Sums & bin : bins ) {
+    DivQuantResetSums(&bin);
+  }
+  
+  if ( num_chunks <= 1 )
+  {
+    DivQuantHistogramRange<UW, PT, WT>(tmp_data, tmp_weights, point_index, 0, num_points, cut_axis, &bins[0]);
+  }
+  else
+  {
+    pool->parallel_for(num_chunks, [&](int ci) {
+      int begin = (int) (((int64_t) num_points * ci) / num_chunks);
+      int end = (int) (((int64_t) num_points * (ci + 1)) / num_chunks);
+      DivQuantHistogramRange<UW, PT, WT>(tmp_data, tmp_weights, point_index, begin, end, cut_axis, &bins[256 * ci]);
+    });
+    
+    // Combine in chunk order so the result does not depend on timing
+    
+    for ( int ci = 1; ci < num_chunks; ci++ ) {
+      for ( int bin = 0; bin < 256; bin++ ) {
+        DivQuantAddSums(&bins[bin], &bins[256 * ci + bin]);
+      }
+    }
+  }
+  
+  Split_Sums total;
+  DivQuantResetSums(&total);
+  
+  for ( int bin = 0; bin < 256; bin++ ) {
+    DivQuantAddSums(&total, &bins[bin]);
+  }
+  
+  // C1 is made up of the bins [0, cut] and C2 of the bins (cut, 255]
+  
+  Split_Sums c1;
+  DivQuantResetSums(&c1);
+  
+  int best_cut = -1;
+  double best_err = 0.0;
+  
+  for ( int cut = 0; cut < 255; cut++ ) {
+    DivQuantAddSums(&c1, &bins[cut]);
+    
+    if ( bins[cut].size == 0 ) {
+      // Same split as the previous cut
+      continue;
+    }
+    
+    if ( c1.size == total.size ) {
+      break;
+    }
+    
+    Split_Sums c2 = total;
+    c2.sum.red -= c1.sum.red;
+    c2.sum.green -= c1.sum.green;
+    c2.sum.blue -= c1.sum.blue;
+    c2.sum_sqr.red -= c1.sum_sqr.red;
+    c2.sum_sqr.green -= c1.sum_sqr.green;
+    c2.sum_sqr.blue -= c1.sum_sqr.blue;
+    c2.weight -= c1.weight;
+    c2.size -= c1.size;
+    
+    double err = DivQuantSumsSqrError<UW>(&c1) + DivQuantSumsSqrError<UW>(&c2);
+    
+    if ( best_cut < 0 || err < best_err ) {
+      best_cut = cut;
+      best_err = err;
+    }
+  }
+  
+  if ( best_cut < 0 ) {
+    return false;
+  }
+  
+  // Sums of C2 taken directly from the bins, with the same order of
+  // additions for any cut
+  
+  DivQuantResetSums(c2_sums);
+  
+  for ( int bin = best_cut + 1; bin < 256; bin++ ) {
+    DivQuantAddSums(c2_sums, &bins[bin]);
+  }
+  
+  *cut_pos = best_cut;
+  return true;
+}
+
+// One local k-means iteration for the points in [begin, end) of the cluster
+// being split. Points on the C2 side of the hyperplane that separates the 2
+// cluster means are added to the sums. On the last iteration the variance
+// is also accumulated and the membership of each point is saved, in the
+// inplace case the points in C1 are moved to the front of [begin, end).
+// The other iterations only need the sums, these are computed with a SIMD
+// kernel when simd_level allows it.
+
+template <bool UW, typename MT, typename PT, typename WT>
+static
+void
+DivQuantLkmRange(
+                 const PT & tmp_data,
+                 WT *tmp_weights,
+                 const int *point_index,
+                 MT *member,
+                 const int begin,
+                 const int end,
+                 const double lhs,
+                 const double rhs_red,
+                 const double rhs_green,
+                 const double rhs_blue,
+                 const bool last_iter,
+                 const int old_index,
+                 const int new_index,
+                 const bool inplace,
+                 const Pixel_Double *old_mean,
+                 const int simd_level,
+                 Split_Sums *sums)
+{
+  double red, green, blue; /* R, G, B values of a particular pixel */
+  double tmp_weight = 1.0; /* weight of a particular pixel */
+  int old_count = 0;
+  
+#if !defined(VERBOSE)
+  if ( !last_iter && simd_level > DIVQUANT_SIMD_SCALAR )
+  {
+    int new_count;
+    
+    if (UW) {
+      uint64_t simd_sums[4] = { 0, 0, 0, 0 };
+      
+      tmp_data.offset(begin).lkm_sums(simd_level, end - begin, lhs, rhs_red, rhs_green, rhs_blue, simd_sums);
+      
+      sums->sum.red += simd_sums[0];
+      sums->sum.green += simd_sums[1];
+      sums->sum.blue += simd_sums[2];
+      new_count = (int) simd_sums[3];
+    } else {
+      double simd_sums[4] = { sums->sum.red, sums->sum.green, sums->sum.blue, sums->weight };
+      
+      if (point_index) {
+        new_count = tmp_data.offset(begin).lkm_weighted_sums(simd_level, tmp_weights, &point_index[begin], end - begin, lhs, rhs_red, rhs_green, rhs_blue, simd_sums);
+      } else {
+        new_count = tmp_data.offset(begin).lkm_weighted_sums(simd_level, &tmp_weights[begin], nullptr, end - begin, lhs, rhs_red, rhs_green, rhs_blue, simd_sums);
+      }
+      
+      sums->sum.red = simd_sums[0];
+      sums->sum.green = simd_sums[1];
+      sums->sum.blue = simd_sums[2];
+      sums->weight = simd_sums[3];
+    }
+    
+    sums->size += new_count;
+    sums->old_count = (end - begin) - new_count;
+    return;
+  }
+#endif // VERBOSE
+  
+  for ( int ip = begin; ip < end; )
+  {
+    int maxLoopOffset = 0xFFFF;
+    int numLeft = (end - ip);
+    if (numLeft < maxLoopOffset) {
+      maxLoopOffset = numLeft;
+    }
+    maxLoopOffset += ip;
+    
+    uint32_t new_mean_red = 0;
+    uint32_t new_mean_green = 0;
+    uint32_t new_mean_blue = 0;
+    
+    uint32_t new_var_red = 0;
+    uint32_t new_var_green = 0;
+    uint32_t new_var_blue = 0;
+    
+    for ( ; ip < maxLoopOffset; ip++ ) {
+      
+      uint32_t R = tmp_data.red(ip);
+      uint32_t G = tmp_data.green(ip);
+      uint32_t B = tmp_data.blue(ip);
+      
+      red = R;
+      green = G;
+      blue = B;
+      
+      int pointindex = ip;
+      if (point_index) {
+        pointindex = point_index[ip];
+      }
+      if (UW) {
+      } else {
+        tmp_weight = tmp_weights[pointindex];
+      }
+      
+      if ( lhs < ( (rhs_red * red) + (rhs_green * green) + (rhs_blue * blue) ) )
+      {
+#ifdef VERBOSE
+        // Update the MSE of the old cluster
+        sums->mse += tmp_weight *
+        ( SQR ( red - old_mean->red ) +
+         SQR ( green - old_mean->green ) +
+         SQR ( blue - old_mean->blue ) );
+#endif
+        
+        if ( last_iter )
+        {
+          if (inplace) {
+            // Move the point to the front of the range
+            DivQuantSwapPoints<UW, PT, WT>(tmp_data, tmp_weights, begin + old_count, ip);
+          } else {
+            // Save the membership of the point
+            member[pointindex] = old_index;
+#ifdef VERBOSE
+            fprintf(stdout, "write member[%d] = %d (ip = %d)\n", pointindex, member[pointindex], ip);
+#endif
+          }
+        }
+        
+        old_count++;
+      }
+      else
+      {
+#ifdef VERBOSE
+        // Update the MSE of the new cluster
+        sums->mse += tmp_weight *
+        ( SQR ( red - old_mean->red + rhs_red ) +
+         SQR ( green - old_mean->green + rhs_green ) +
+         SQR ( blue - old_mean->blue + rhs_blue ) );
+#endif
+        
+        if ( !last_iter )
+        {
+          // Update only mean
+          
+          if (UW) {
+            new_mean_red += R;
+            new_mean_green += G;
+            new_mean_blue += B;
+          } else {
+            sums->sum.red += tmp_weight * red;
+            sums->sum.green += tmp_weight * green;
+            sums->sum.blue += tmp_weight * blue;
+          }
+        }
+        else
+        {
+          // Update mean and variance
+          
+          if (UW) {
+            new_mean_red += R;
+            new_mean_green += G;
+            new_mean_blue += B;
+          } else {
+            sums->sum.red += tmp_weight * red;
+            sums->sum.green += tmp_weight * green;
+            sums->sum.blue += tmp_weight * blue;
+          }
+          
+          if (UW) {
+            new_var_red += ( R * R );
+            new_var_green += ( G * G );
+            new_var_blue += ( B * B );
+          } else {
+            sums->sum_sqr.red += tmp_weight * ( R * R );
+            sums->sum_sqr.green += tmp_weight * ( G * G );
+            sums->sum_sqr.blue += tmp_weight * ( B * B );
+          }
+          
+          // Save the membership of the point
+          if (!inplace) {
+            member[pointindex] = new_index;
+#ifdef VERBOSE
+            fprintf(stdout, "write member[%d] = %d (ip = %d)\n", pointindex, member[pointindex], ip);
+#endif
+          }
+        }
+        
+        // Update the weight/size of the new cluster
+        
+        if (UW) {
+        } else {
+          sums->weight += tmp_weight;
+        }
+        sums->size++;
+      }
+    } // end foreach point inner loop
+    
+    if (UW) {
+      sums->sum.red += new_mean_red;
+      sums->sum.green += new_mean_green;
+      sums->sum.blue += new_mean_blue;
+      
+      sums->sum_sqr.red += new_var_red;
+      sums->sum_sqr.green += new_var_green;
+      sums->sum_sqr.blue += new_var_blue;
+    }
+    
+  } // end foreach point outer loop
+  
+  sums->old_count = old_count;
+}
+
+// Fixed point LKM hyperplane. Each coefficient is scaled by 2^shift and
+// rounded, where shift is as large as possible while the dot product of
+// any pixel with the coefficients still fits in 32 bits.
+
+typedef struct
+{
+  int32_t lhs;
+  int32_t rhs_red;
+  int32_t rhs_green;
+  int32_t rhs_blue;
+} Lkm_Fixed;
+
+static inline
+void
+DivQuantLkmFixedCoefficients(
+                             const double lhs,
+                             const double rhs_red,
+                             const double rhs_green,
+                             const double rhs_blue,
+                             Lkm_Fixed *coef)
+{
+  double max_abs = MAX_RGB * ( fabs ( rhs_red ) + fabs ( rhs_green ) + fabs ( rhs_blue ) );
+  if ( max_abs < fabs ( lhs ) ) {
+    max_abs = fabs ( lhs );
+  }
+  
+  if ( !( max_abs < DBL_MAX ) )
+  {
+    // The mean of an empty cluster is NaN, every double test is false
+    // so all points are assigned to C2
+    coef->lhs = INT32_MAX;
+    coef->rhs_red = coef->rhs_green = coef->rhs_blue = 0;
+    return;
+  }
+  
+  // max_abs < 2^exponent, so the scaled values are smaller than 2^30
+  // which leaves room for the rounding of each coefficient
+  
+  int exponent = 0;
+  frexp ( max_abs, &exponent );
+  
+  int shift = 30 - exponent;
+  if ( shift > 30 ) {
+    shift = 30;
+  }
+  
+  const double scale = ldexp ( 1.0, shift );
+  
+  coef->lhs = (int32_t) lrint ( lhs * scale );
+  coef->rhs_red = (int32_t) lrint ( rhs_red * scale );
+  coef->rhs_green = (int32_t) lrint ( rhs_green * scale );
+  coef->rhs_blue = (int32_t) lrint ( rhs_blue * scale );
+}
+
+// Fixed point version of DivQuantLkmRange, the hyperplane test is integer
+// math. The uniform weight sums are accumulated in 64 bits, so the points
+// are not processed in blocks of 0xFFFF. The weighted sums are the same
+// double sums as in DivQuantLkmRange.
+
+template <bool UW, typename MT, typename PT, typename WT>
+static
+void
+DivQuantLkmRangeFixed(
+                      const PT & tmp_data,
+                      WT *tmp_weights,
+                      const int *point_index,
+                      MT *member,
+                      const int begin,
+                      const int end,
+                      const Lkm_Fixed *coef,
+                      const bool last_iter,
+                      const int old_index,
+                      const int new_index,
+                      const bool inplace,
+                      Split_Sums *sums)
+{
+  const int32_t lhs = coef->lhs;
+  const int32_t rhs_red = coef->rhs_red;
+  const int32_t rhs_green = coef->rhs_green;
+  const int32_t rhs_blue = coef->rhs_blue;
+  
+  uint64_t new_mean_red = 0, new_mean_green = 0, new_mean_blue = 0;
+  uint64_t new_var_red = 0, new_var_green = 0, new_var_blue = 0;
+  int new_count = 0;
+  int old_count = 0;
+  
+  if ( UW && !last_iter )
+  {
+    // Only the sums of C2 are needed, the branch free loop can be vectorized
+    
+    for ( int ip = begin; ip < end; ip++ ) {
+      uint32_t R = tmp_data.red(ip);
+      uint32_t G = tmp_data.green(ip);
+      uint32_t B = tmp_data.blue(ip);
+      
+      int32_t dot = (rhs_red * (int32_t) R) + (rhs_green * (int32_t) G) + (rhs_blue * (int32_t) B);
+      uint32_t new_mask = ( lhs < dot ) ? 0 : 0xFFFFFFFF;
+      
+      new_mean_red += R & new_mask;
+      new_mean_green += G & new_mask;
+      new_mean_blue += B & new_mask;
+      new_count += new_mask & 0x1;
+    }
+    
+    old_count = (end - begin) - new_count;
+  }
+  else
+  {
+    for ( int ip = begin; ip < end; ip++ ) {
+      uint32_t R = tmp_data.red(ip);
+      uint32_t G = tmp_data.green(ip);
+      uint32_t B = tmp_data.blue(ip);
+      
+      int pointindex = ip;
+      if (point_index) {
+        pointindex = point_index[ip];
+      }
+      
+      int32_t dot = (rhs_red * (int32_t) R) + (rhs_green * (int32_t) G) + (rhs_blue * (int32_t) B);
+      
+      if ( lhs < dot )
+      {
+        if ( last_iter )
+        {
+          if (inplace) {
+            // Move the point to the front of the range
+            DivQuantSwapPoints<UW, PT, WT>(tmp_data, tmp_weights, begin + old_count, ip);
+          } else {
+            // Save the membership of the point
+            member[pointindex] = old_index;
+          }
+        }
+        
+        old_count++;
+      }
+      else
+      {
+        if (UW) {
+          new_mean_red += R;
+          new_mean_green += G;
+          new_mean_blue += B;
+        } else {
+          double tmp_weight = tmp_weights[pointindex];
+          
+          sums->sum.red += tmp_weight * R;
+          sums->sum.green += tmp_weight * G;
+          sums->sum.blue += tmp_weight * B;
+          sums->weight += tmp_weight;
+          
+          if ( last_iter ) {
+            sums->sum_sqr.red += tmp_weight * ( R * R );
+            sums->sum_sqr.green += tmp_weight * ( G * G );
+            sums->sum_sqr.blue += tmp_weight * ( B * B );
+          }
+        }
+        
+        if ( last_iter )
+        {
+          if (UW) {
+            new_var_red += ( R * R );
+            new_var_green += ( G * G );
+            new_var_blue += ( B * B );
+          }
+          
+          // Save the membership of the point
+          if (!inplace) {
+            member[pointindex] = new_index;
+          }
+        }
+        
+        new_count++;
+      }
+    }
+  }
+  
+  if (UW) {
+    sums->sum.red += new_mean_red;
+    sums->sum.green += new_mean_green;
+    sums->sum.blue += new_mean_blue;
+    
+    sums->sum_sqr.red += new_var_red;
+    sums->sum_sqr.green += new_var_green;
+    sums->sum_sqr.blue += new_var_blue;
+  }
+  
+  sums->size += new_count;
+  sums->old_count = old_count;
+}
+
+// Local k-means with band pruning. The hyperplane test of a point is the
+// sign of its margin, the value of ( rhs . x ) - lhs. From one iteration to
+// the next the margin of any point in the bounding box of the cluster changes
+// by at most DivQuantLkmPlaneMovement, so a point with a margin larger than
+// the movement since its margin was calculated stays on the same side. A full
+// pass over the cluster calculates the margin of each point, the points with
+// a margin no larger than the band width are saved in the band and the sums
+// of the other C2 points are saved. Until the hyperplane has moved by more
+// than the band width, an iteration only tests the points in the band again.
+
+typedef struct
+{
+  double lhs; /* hyperplane the band was built from */
+  double rhs_red;
+  double rhs_green;
+  double rhs_blue;
+  double width; /* max margin of a point in the band */
+  bool valid;
+  Pixel_Int box_min; /* bounding box of the cluster */
+  Pixel_Int box_max;
+  int *index; /* the band of a range of points starts at its begin offset */
+  double *margin; /* margin of each point in the band */
+  std::vector<int> count; /* number of points in the band of each range */
+  std::vector<Split_Sums> fixed_sums; /* C2 sums of the points not in the band of each range */
+  std::vector<Pixel_Int> range_min; /* bounding box of each range */
+  std::vector<Pixel_Int> range_max;
+} Lkm_Band;
+
+// Max change of ( rhs . x ) - lhs for any x in the box [box_min, box_max]
+// when the hyperplane changes from (lhs1, rhs1) to (lhs2, rhs2).
+
+static inline
+double
+DivQuantLkmPlaneMovement(
+                         const Pixel_Int *box_min,
+                         const Pixel_Int *box_max,
+                         const double lhs1,
+                         const double rhs_red1,
+                         const double rhs_green1,
+                         const double rhs_blue1,
+                         const double lhs2,
+                         const double rhs_red2,
+                         const double rhs_green2,
+                         const double rhs_blue2)
+{
+  const double d_red = rhs_red2 - rhs_red1;
+  const double d_green = rhs_green2 - rhs_green1;
+  const double d_blue = rhs_blue2 - rhs_blue1;
+  const double d_lhs = lhs2 - lhs1;
+  
+  // The extremes of a linear function over a box are at its corners
+  
+  double max_change = ( ( 0.0 < d_red ) ? d_red * box_max->red : d_red * box_min->red ) +
+  ( ( 0.0 < d_green ) ? d_green * box_max->green : d_green * box_min->green ) +
+  ( ( 0.0 < d_blue ) ? d_blue * box_max->blue : d_blue * box_min->blue ) - d_lhs;
+  
+  double min_change = ( ( 0.0 < d_red ) ? d_red * box_min->red : d_red * box_max->red ) +
+  ( ( 0.0 < d_green ) ? d_green * box_min->green : d_green * box_max->green ) +
+  ( ( 0.0 < d_blue ) ? d_blue * box_min->blue : d_blue * box_max->blue ) - d_lhs;
+  
+  // Allow for the rounding of the margin of each point
+  double slack = 1.0e-9 * ( fabs ( lhs2 ) + MAX_RGB * ( fabs ( rhs_red2 ) + fabs ( rhs_green2 ) + fabs ( rhs_blue2 ) ) );
+  
+  return fmax ( fabs ( max_change ), fabs ( min_change ) ) + slack;
+}
+
+// Add a point to C2 sums, the uniform weight sums are not scaled
+
+template <bool UW>
+static inline
+void
+DivQuantLkmAddPoint(
+                    Split_Sums *sums,
+                    const uint32_t R,
+                    const uint32_t G,
+                    const uint32_t B,
+                    const double tmp_weight)
+{
+  if (UW) {
+    sums->sum.red += R;
+    sums->sum.green += G;
+    sums->sum.blue += B;
+  } else {
+    sums->sum.red += tmp_weight * R;
+    sums->sum.green += tmp_weight * G;
+    sums->sum.blue += tmp_weight * B;
+    sums->weight += tmp_weight;
+  }
+  sums->size++;
+}
+
+// Bounding box of the points in [begin, end), saved for the range ci
+
+template <typename PT>
+static
+void
+DivQuantLkmBandBox(
+                   const PT & tmp_data,
+                   const int ci,
+                   const int begin,
+                   const int end,
+                   Lkm_Band *band)
+{
+  uint32_t min_red = MAX_RGB, min_green = MAX_RGB, min_blue = MAX_RGB;
+  uint32_t max_red = 0, max_green = 0, max_blue = 0;
+  
+  for ( int ip = begin; ip < end; ip++ ) {
+    uint32_t R = tmp_data.red(ip);
+    uint32_t G = tmp_data.green(ip);
+    uint32_t B = tmp_data.blue(ip);
+    
+    min_red = min(min_red, R);
+    min_green = min(min_green, G);
+    min_blue = min(min_blue, B);
+    max_red = max(max_red, R);
+    max_green = max(max_green, G);
+    max_blue = max(max_blue, B);
+  }
+  
+  band->range_min[ci].red = min_red;
+  band->range_min[ci].green = min_green;
+  band->range_min[ci].blue = min_blue;
+  band->range_max[ci].red = max_red;
+  band->range_max[ci].green = max_green;
+  band->range_max[ci].blue = max_blue;
+}
+
+// One local k-means iteration (not the last) for the points in [begin, end)
+// that also builds the band of this range. The test of each point is the
+// same as in DivQuantLkmRange.
+
+template <bool UW, typename PT, typename WT>
+static
+void
+DivQuantLkmBandBuild(
+                     const PT & tmp_data,
+                     const WT *tmp_weights,
+                     const int *point_index,
+                     const int ci,
+                     const int begin,
+                     const int end,
+                     Lkm_Band *band,
+                     Split_Sums *sums)
+{
+  const double lhs = band->lhs;
+  const double rhs_red = band->rhs_red;
+  const double rhs_green = band->rhs_green;
+  const double rhs_blue = band->rhs_blue;
+  const double width = band->width;
+  
+  int *band_index = band->index + begin;
+  double *band_margin = band->margin + begin;
+  int band_count = 0;
+  
+  Split_Sums fixed_sums;
+  Split_Sums band_sums;
+  DivQuantResetSums(&fixed_sums);
+  DivQuantResetSums(&band_sums);
+  
+  double tmp_weight = 1.0;
+  
+  for ( int ip = begin; ip < end; ip++ ) {
+    uint32_t R = tmp_data.red(ip);
+    uint32_t G = tmp_data.green(ip);
+    uint32_t B = tmp_data.blue(ip);
+    
+    if (!UW) {
+      tmp_weight = tmp_weights[point_index ? point_index[ip] : ip];
+    }
+    
+    double dot = (rhs_red * (double) R) + (rhs_green * (double) G) + (rhs_blue * (double) B);
+    double margin = dot - lhs;
+    
+    if ( fabs ( margin ) <= width )
+    {
+      band_index[band_count] = ip;
+      band_margin[band_count] = margin;
+      band_count++;
+      
+      if ( !( lhs < dot ) ) {
+        DivQuantLkmAddPoint<UW>(&band_sums, R, G, B, tmp_weight);
+      }
+    }
+    else if ( !( lhs < dot ) )
+    {
+      DivQuantLkmAddPoint<UW>(&fixed_sums, R, G, B, tmp_weight);
+    }
+  }
+  
+  band->count[ci] = band_count;
+  band->fixed_sums[ci] = fixed_sums;
+  
+  DivQuantAddSums(sums, &fixed_sums);
+  DivQuantAddSums(sums, &band_sums);
+  sums->old_count = (end - begin) - sums->size;
+}
+
+// One local k-means iteration (not the last) that only tests the points in
+// the band of the range ci, the other points are on the same side as when
+// the band was built.
+
+template <bool UW, typename PT, typename WT>
+static
+void
+DivQuantLkmBandRange(
+                     const PT & tmp_data,
+                     const WT *tmp_weights,
+                     const int *point_index,
+                     const int ci,
+                     const int begin,
+                     const int end,
+                     const double lhs,
+                     const double rhs_red,
+                     const double rhs_green,
+                     const double rhs_blue,
+                     const Lkm_Band *band,
+                     Split_Sums *sums)
+{
+  const int *band_index = band->index + begin;
+  const int band_count = band->count[ci];
+  
+  Split_Sums band_sums;
+  DivQuantResetSums(&band_sums);
+  
+  double tmp_weight = 1.0;
+  
+  for ( int i = 0; i < band_count; i++ ) {
+    const int ip = band_index[i];
+    
+    uint32_t R = tmp_data.red(ip);
+    uint32_t G = tmp_data.green(ip);
+    uint32_t B = tmp_data.blue(ip);
+    
+    if (!UW) {
+      tmp_weight = tmp_weights[point_index ? point_index[ip] : ip];
+    }
+    
+    double dot = (rhs_red * (double) R) + (rhs_green * (double) G) + (rhs_blue * (double) B);
+    
+    if ( !( lhs < dot ) ) {
+      DivQuantLkmAddPoint<UW>(&band_sums, R, G, B, tmp_weight);
+    }
+  }
+  
+  DivQuantAddSums(sums, &band->fixed_sums[ci]);
+  DivQuantAddSums(sums, &band_sums);
+  sums->old_count = (end - begin) - sums->size;
+}
+
+// Sampled local k-means. The iterations before the last one of a large
+// cluster only move the means, so they are run on a sample of the points of
+// the cluster, copied once. A point is in the sample when a hash of its
+// color is below a threshold that selects about sample_size points, so the
+// sample does not depend on the order of the points in the cluster (which
+// differs with the inplace partition logic and the number of threads). Each
+// sample point stands for the points around it, so the means of C1 and C2
+// are the weighted means of the sample points on each side of the
+// hyperplane. The last iteration tests every point with the means found on
+// the sample.
+
+template <typename PT, typename WT>
+struct Lkm_Sample
+{
+  PT points;
+  std::vector<WT> weights;
+  int size;
+  double total[4]; /* sums of the weighted R, G, B of the sample and of the weights */
+};
+
+template <bool UW, typename PT, typename WT>
+static
+void
+DivQuantLkmSampleBuild(
+                       const PT & tmp_data,
+                       const WT *tmp_weights,
+                       const int *point_index,
+                       const int num_points,
+                       const int sample_size,
+                       Lkm_Sample<PT, WT> *sample)
+{
+  // The top 24 bits of the hash are compared with the threshold
+  const uint32_t threshold = (uint32_t) (((uint64_t) sample_size << 24) / num_points);
+  
+  std::vector<int> sample_index;
+  sample_index.reserve(sample_size + sample_size / 4);
+  
+  for ( int ip = 0; ip < num_points; ip++ ) {
+    uint32_t color = (tmp_data.red(ip) << 16) | (tmp_data.green(ip) << 8) | tmp_data.blue(ip);
+    
+    if ( ((color * 2654435761U) >> 8) < threshold ) {
+      sample_index.push_back(ip);
+    }
+  }
+  
+  sample->size = (int) sample_index.size();
+  sample->points = PT::alloc(sample->size > 0 ? sample->size : 1);
+  
+  if (!UW) {
+    sample->weights.resize(sample->size);
+  }
+  
+  for ( int i = 0; i < 4; i++ ) {
+    sample->total[i] = 0.0;
+  }
+  
+  for ( int is = 0; is < sample->size; is++ ) {
+    const int ip = sample_index[is];
+    
+    sample->points.copy(is, tmp_data, ip, 1);
+    
+    double tmp_weight = 1.0;
+    
+    if (!UW) {
+      sample->weights[is] = tmp_weights[point_index ? point_index[ip] : ip];
+      tmp_weight = sample->weights[is];
+    }
+    
+    sample->total[0] += tmp_weight * tmp_data.red(ip);
+    sample->total[1] += tmp_weight * tmp_data.green(ip);
+    sample->total[2] += tmp_weight * tmp_data.blue(ip);
+    sample->total[3] += tmp_weight;
+  }
+}
+
+// One local k-means iteration over the sample. Returns false when all the
+// sample points are on one side of the hyperplane, the means are then not
+// changed.
+
+template <bool UW, typename PT, typename WT>
+static
+bool
+DivQuantLkmSampleMeans(
+                       const Lkm_Sample<PT, WT> *sample,
+                       const double lhs,
+                       const double rhs_red,
+                       const double rhs_green,
+                       const double rhs_blue,
+                       const int simd_level,
+                       int *new_size,
+                       Pixel_Double *old_mean,
+                       Pixel_Double *new_mean)
+{
+  double sums[4] = { 0.0, 0.0, 0.0, 0.0 };
+  
+  if (UW) {
+    uint64_t int_sums[4] = { 0, 0, 0, 0 };
+    sample->points.lkm_sums(simd_level, sample->size, lhs, rhs_red, rhs_green, rhs_blue, int_sums);
+    
+    for ( int i = 0; i < 4; i++ ) {
+      sums[i] = (double) int_sums[i];
+    }
+    *new_size = (int) int_sums[3];
+  } else {
+    *new_size = sample->points.lkm_weighted_sums(simd_level, sample->weights.data(), nullptr, sample->size, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+  
+  const double new_weight = sums[3];
+  const double old_weight = sample->total[3] - new_weight;
+  
+  if ( new_weight <= 0.0 || old_weight <= 0.0 ) {
+    return false;
+  }
+  
+  new_mean->red = sums[0] / new_weight;
+  new_mean->green = sums[1] / new_weight;
+  new_mean->blue = sums[2] / new_weight;
+  
+  old_mean->red = ( sample->total[0] - sums[0] ) / old_weight;
+  old_mean->green = ( sample->total[1] - sums[1] ) / old_weight;
+  old_mean->blue = ( sample->total[2] - sums[2] ) / old_weight;
+  
+  return true;
+}
+
+// True when no component of the means has moved by more than tol
+
+static inline
+bool
+DivQuantLkmMeansConverged(
+                          const Pixel_Double *old_mean,
+                          const Pixel_Double *new_mean,
+                          const Pixel_Double *prev_old_mean,
+                          const Pixel_Double *prev_new_mean,
+                          const double tol)
+{
+  return fabs ( new_mean->red - prev_new_mean->red ) <= tol &&
+  fabs ( new_mean->green - prev_new_mean->green ) <= tol &&
+  fabs ( new_mean->blue - prev_new_mean->blue ) <= tol &&
+  fabs ( old_mean->red - prev_old_mean->red ) <= tol &&
+  fabs ( old_mean->green - prev_old_mean->green ) <= tol &&
+  fabs ( old_mean->blue - prev_old_mean->blue ) <= tol;
+}
+
+// Invoke kernel(begin, end, sums) over the num_points points of the cluster
+// being split. When num_chunks is larger than 1 the points are divided into
+// num_chunks equally sized ranges that are processed by the thread pool and
+// the sums of each range are then combined in range order. The result
+// depends only on num_chunks and not on the order the ranges complete in.
+// DivQuantChunkSums also passes the index of the range to the kernel as
+// kernel(ci, begin, end, sums), for kernels that keep state for each range.
+
+template <typename F>
+static
+void
+DivQuantChunkSums(
+                  DivQuantThreadPool *pool,
+                  const int num_points,
+                  const int num_chunks,
+                  Split_Sums *chunk_sums,
+                  Split_Sums *sums,
+                  const F & kernel)
+{
+  DivQuantResetSums(sums);
+  
+  if ( num_chunks <= 1 )
+  {
+    kernel(0, 0, num_points, sums);
+    return;
+  }
+  
+  pool->parallel_for(num_chunks, [&](int ci) {
+    int begin = (int) (((int64_t) num_points * ci) / num_chunks);
+    int end = (int) (((int64_t) num_points * (ci + 1)) / num_chunks);
+    DivQuantResetSums(&chunk_sums[ci]);
+    kernel(ci, begin, end, &chunk_sums[ci]);
+  });
+  
+  for ( int ci = 0; ci < num_chunks; ci++ )
+  {
+    DivQuantAddSums(sums, &chunk_sums[ci]);
+  }
+}
+
+template <typename F>
+static inline
+void
+DivQuantRangeSums(
+                  DivQuantThreadPool *pool,
+                  const int num_points,
+                  const int num_chunks,
+                  Split_Sums *chunk_sums,
+                  Split_Sums *sums,
+                  const F & kernel)
+{
+  DivQuantChunkSums(pool, num_points, num_chunks, chunk_sums, sums,
+                    [&](int ci, int begin, int end, Split_Sums *range_sums) {
+                      kernel(begin, end, range_sums);
+                    });
+}
+
+// After each range of a cluster has been partitioned in place by a parallel
+// pass, the C1 points are at the front of each range. Gather the C1 points
+// of all ranges (in range order) at the front of the cluster followed by
+// the C2 points of all ranges by way of the scratch buffers.
+
+template <bool UW, typename PT, typename WT>
+static
+void
+DivQuantMergeRangePartitions(
+                             DivQuantThreadPool *pool,
+                             const PT & tmp_data,
+                             WT *tmp_weights,
+                             const int num_points,
+                             const int num_chunks,
+                             const Split_Sums *chunk_sums,
+                             const PT & scratch_data,
+                             WT *scratch_weights)
+{
+  std::vector<int> old_offset(num_chunks);
+  std::vector<int> new_offset(num_chunks);
+  
+  int total_old = 0;
+  for ( int ci = 0; ci < num_chunks; ci++ )
+  {
+    old_offset[ci] = total_old;
+    total_old += chunk_sums[ci].old_count;
+  }
+  
+  int total_new = total_old;
+  for ( int ci = 0; ci < num_chunks; ci++ )
+  {
+    int begin = (int) (((int64_t) num_points * ci) / num_chunks);
+    int end = (int) (((int64_t) num_points * (ci + 1)) / num_chunks);
+    new_offset[ci] = total_new;
+    total_new += (end - begin) - chunk_sums[ci].old_count;
+  }
+  
+#if defined(DEBUG)
+  assert(total_new == num_points);
+#endif // DEBUG
+  
+  pool->parallel_for(num_chunks, [&](int ci) {
+    int begin = (int) (((int64_t) num_points * ci) / num_chunks);
+    int end = (int) (((int64_t) num_points * (ci + 1)) / num_chunks);
+    int num_old = chunk_sums[ci].old_count;
+    int num_new = (end - begin) - num_old;
+    
+    scratch_data.copy(old_offset[ci], tmp_data, begin, num_old);
+    scratch_data.copy(new_offset[ci], tmp_data, begin + num_old, num_new);
+    
+    if (!UW) {
+      memcpy(&scratch_weights[old_offset[ci]], &tmp_weights[begin], num_old * sizeof(WT));
+      memcpy(&scratch_weights[new_offset[ci]], &tmp_weights[begin + num_old], num_new * sizeof(WT));
+    }
+  });
+  
+  pool->parallel_for(num_chunks, [&](int ci) {
+    int begin = (int) (((int64_t) num_points * ci) / num_chunks);
+    int end = (int) (((int64_t) num_points * (ci + 1)) / num_chunks);
+    
+    tmp_data.copy(begin, scratch_data, begin, end - begin);
+    
+    if (!UW) {
+      memcpy(&tmp_weights[begin], &scratch_weights[begin], (end - begin) * sizeof(WT));
+    }
+  });
+}
+
+// Settings that select how each cluster is split, these are the same for
+// every split.
+
+typedef struct
+{
+  int simd_level; /* kernels used for the local k-means iterations */
+  bool fixed_lkm; /* fixed point local k-means hyperplane test */
+  bool histogram_split; /* cut position used by STEP 2 */
+  bool lkm_converge; /* stop local k-means once the means stop moving */
+  bool lkm_band; /* only test the points near the hyperplane again */
+  double lkm_tolerance; /* max movement of a mean component when converged */
+  int lkm_sample_size; /* points in the sample of a large cluster, 0 means no sample */
+} Split_Config;
+
+// Statistics of the 2 clusters C1 and C2 that a cluster C is split into
+
+typedef struct
+{
+  Pixel_Double old_mean; /* componentwise mean of C1 */
+  Pixel_Double new_mean; /* componentwise mean of C2 */
+  Pixel_Double old_var; /* componentwise variance of C1 */
+  Pixel_Double new_var; /* componentwise variance of C2 */
+  double old_weight; /* weight of C1 */
+  double new_weight; /* weight of C2 */
+  int new_size; /* size of C2 */
+  int lkm_iters; /* number of local k-means iterations run */
+} Split_Result;
+
+// Split the cluster C made up of the tmp_num_points points in tmp_data into
+// C1 and C2 (STEPS 1 to 3 followed by local k-means) and calculate the
+// statistics of C1 and C2. The result depends only on the points of C and
+// on the weight, mean and variance of C, so in the inplace case clusters
+// stored in disjoint ranges can be split in any order. Note that the
+// variance of C1 and C2 is calculated even when it will not be used.
+
+template <bool UW, typename MT, bool KM, typename PT, typename WT>
+static
+void
+DivQuantSplitCluster(
+                     const PT & tmp_data,
+                     WT *tmp_weights,
+                     const int *point_index,
+                     MT *member,
+                     const int tmp_num_points,
+                     const double data_weight,
+                     const int max_iters,
+                     const int old_index,
+                     const int new_index,
+                     const bool inplace,
+                     DivQuantThreadPool *pool,
+                     const int num_chunks,
+                     Split_Sums *chunk_sums,
+                     const PT & scratch_data,
+                     WT *scratch_weights,
+                     const double total_weight,
+                     const Pixel_Double *total_mean,
+                     const Pixel_Double *total_var,
+                     const Split_Config *config,
+                     Split_Result *result)
+{
+  int it;
+  int cut_axis; /* index of the cutting axis */
+  int new_size = 0; /* size of C2 */
+  int apply_lkm; /* indicates whether or not LKM is to be applied */
+  int max_iters_m1; /* MAX_ITERS - 1 */
+  double max_val;
+  double cut_pos; /* cutting position */
+  double old_weight; /* weight of C1 */
+  double new_weight; /* weight of C2 */
+  double lhs;
+#ifdef VERBOSE
+  double mse;
+#endif
+  Split_Sums sums; /* sums for the cluster being split */
+  
+  Pixel_Double *old_mean = &result->old_mean;
+  Pixel_Double *new_mean = &result->new_mean;
+  Pixel_Double *old_var = &result->old_var;
+  Pixel_Double *new_var = &result->new_var;
+  
+  memset(result, 0, sizeof(Split_Result));
+  
+  apply_lkm = 0 < max_iters ? 1 : 0;
+  max_iters_m1 = max_iters - 1;
+  
+  /* Determine the axis with the greatest variance */
+  
+  max_val = total_var->red;
+  cut_axis = 0;
+  cut_pos = total_mean->red;
+  
+  if ( max_val < total_var->green )
+  {
+    max_val = total_var->green;
+    cut_axis = 1;
+    cut_pos = total_mean->green;
+  }
+  
+  if ( max_val < total_var->blue )
+  {
+    cut_axis = 2;
+    cut_pos = total_mean->blue;
+  }
+  
+#ifdef VERBOSE
+  if ( cut_axis == 0 ) {
+    printf ( "Cut on Red %10.8f\n", cut_pos);
+  } else if ( cut_axis == 1 ) {
+    printf ( "Cut on Green %10.8f\n", cut_pos);
+  } else if ( cut_axis == 2 ) {
+    printf ( "Cut on Blue %10.8f\n", cut_pos);
+  } else {
+    assert(0);
+  }
+#endif
+  
+  // Reset the statistics of the new cluster
+  RESET_PIXEL ( new_mean );
+  
+  if ( !KM && !apply_lkm )
+  {
+    RESET_PIXEL ( new_var );
+  }
+  
+  // STEP 3: SPLIT THE CLUSTER OLD_INDEX
+  
+  // The membership of each point is final after the split only when
+  // no local k-means iterations follow. In the inplace case, points
+  // that remain in C1 are moved to the front of the range.
+  const bool split_member = ( !KM && !apply_lkm );
+  
+  // With a histogram the sums of C2 are known for any cut, so the points
+  // only need to be scanned again to save the membership of each point.
+  bool have_sums = false;
+  
+  if ( config->histogram_split )
+  {
+    int hist_cut_pos;
+    
+    if ( DivQuantHistogramCut<UW, PT, WT>(tmp_data, tmp_weights, point_index, tmp_num_points, cut_axis, pool, num_chunks, &hist_cut_pos, &sums) )
+    {
+#ifdef VERBOSE
+      printf ( "Histogram cut %d instead of %10.8f\n", hist_cut_pos, cut_pos);
+#endif
+      
+      cut_pos = hist_cut_pos;
+      have_sums = !split_member;
+    }
+  }
+  
+  if ( !have_sums )
+  {
+    const int cut_threshold = (int) floor ( cut_pos );
+    
+    DivQuantRangeSums(pool, tmp_num_points, num_chunks, chunk_sums, &sums,
+                      [&](int begin, int end, Split_Sums *range_sums) {
+                        if ( cut_axis == 0 ) {
+                          DivQuantSplitRange<UW, MT, PT, WT, 0>(tmp_data, tmp_weights, point_index, member, begin, end, cut_threshold, split_member, new_index, inplace, range_sums);
+                        } else if ( cut_axis == 1 ) {
+                          DivQuantSplitRange<UW, MT, PT, WT, 1>(tmp_data, tmp_weights, point_index, member, begin, end, cut_threshold, split_member, new_index, inplace, range_sums);
+                        } else {
+                          DivQuantSplitRange<UW, MT, PT, WT, 2>(tmp_data, tmp_weights, point_index, member, begin, end, cut_threshold, split_member, new_index, inplace, range_sums);
+                        }
+                      });
+    
+    if ( inplace && split_member && num_chunks > 1 )
+    {
+      DivQuantMergeRangePartitions<UW, PT, WT>(pool, tmp_data, tmp_weights, tmp_num_points, num_chunks, chunk_sums, scratch_data, scratch_weights);
+    }
+  }
+  
+  new_mean->red = sums.sum.red;
+  new_mean->green = sums.sum.green;
+  new_mean->blue = sums.sum.blue;
+  
+  if ( split_member )
+  {
+    new_size = sums.size;
+    
+    new_var->red = sums.sum_sqr.red;
+    new_var->green = sums.sum_sqr.green;
+    new_var->blue = sums.sum_sqr.blue;
+  }
+  
+  if (UW || DivQuantCountWeights<WT>()) {
+    new_mean->red *= data_weight;
+    new_mean->green *= data_weight;
+    new_mean->blue *= data_weight;
+    
+    new_weight = (UW ? sums.size : sums.weight) * data_weight;
+    
+    if ( !KM && !apply_lkm ) {
+      new_var->red *= data_weight;
+      new_var->green *= data_weight;
+      new_var->blue *= data_weight;
+    }
+  } else {
+    new_weight = sums.weight;
+  }
+  
+  // Calculate the weight of the old cluster
+  old_weight = total_weight - new_weight;
+  
+  // Calculate the mean of the new cluster
+  new_mean->red /= new_weight;
+  new_mean->green /= new_weight;
+  new_mean->blue /= new_weight;
+  
+#ifdef VERBOSE
+  printf ( "total_weight %8.2f : new_weight %8.2f  : old_weight %8.2f\n", total_weight, new_weight, old_weight);
+#endif
+  
+#ifdef VERBOSE
+  printf ( "New mean : R G B : %0.2f %0.2f %0.2f\n", new_mean->red, new_mean->green, new_mean->blue);
+#endif
+  
+  /* Calculate the mean of the old cluster using the 'combined mean' formula */
+  old_mean->red = ( total_weight * total_mean->red - new_weight * new_mean->red ) / old_weight;
+  old_mean->green = ( total_weight * total_mean->green - new_weight * new_mean->green ) / old_weight;
+  old_mean->blue = ( total_weight * total_mean->blue - new_weight * new_mean->blue ) / old_weight;
+  
+#ifdef VERBOSE
+  printf ( "Old mean : R G B : %0.2f %0.2f %0.2f\n", old_mean->red, old_mean->green, old_mean->blue);
+#endif
+  
+  /* LOCAL K-MEANS BEGIN */
+  
+#ifdef VERBOSE
+  if ( apply_lkm )
+  {
+    printf ( "Global Iteration %d\n", new_index - 1 );
+  }
+#endif
+  
+  // When the size of C2 and both means are the same after an iteration as
+  // they were before it, the next iteration assigns each point to the same
+  // side and so would every iteration after it. That next iteration is
+  // then run as the last iteration, it saves the membership of each point
+  // and calculates the variance.
+  
+  bool converged = false;
+  int prev_size = sums.size; /* size of C2 before the iteration */
+  Pixel_Double prev_old_mean; /* means before the iteration */
+  Pixel_Double prev_new_mean;
+  
+  // The first iteration and the last iteration test every point. The band
+  // is built by the second iteration with a width of twice the movement of
+  // the hyperplane in the first iteration, since the hyperplane usually moves
+  // less with each iteration. The movement is bounded over the bounding box
+  // of the cluster, found by a pass before the first iteration. When the
+  // hyperplane has moved by more than the width of the band since it was
+  // built, the band is built again.
+  
+  // The iterations before the last one run on a sample of a cluster with
+  // more than twice lkm_sample_size points.
+  
+  const bool use_sample = config->lkm_sample_size > 0 && !config->fixed_lkm && max_iters > 1 && tmp_num_points > 2 * config->lkm_sample_size;
+  
+  Lkm_Sample<PT, WT> sample;
+  
+  if ( use_sample )
+  {
+    DivQuantLkmSampleBuild<UW, PT, WT>(tmp_data, tmp_weights, point_index, tmp_num_points, config->lkm_sample_size, &sample);
+  }
+  
+  const bool use_band = config->lkm_band && !config->fixed_lkm && max_iters > 2 && !use_sample;
+  
+  Lkm_Band band;
+  std::vector<int> band_index;
+  std::vector<double> band_margin;
+  band.valid = false;
+  
+  if ( use_band )
+  {
+    band_index.resize(tmp_num_points);
+    band_margin.resize(tmp_num_points);
+    band.index = band_index.data();
+    band.margin = band_margin.data();
+    band.count.resize(num_chunks);
+    band.fixed_sums.resize(num_chunks);
+    band.range_min.resize(num_chunks);
+    band.range_max.resize(num_chunks);
+    
+    Split_Sums box_sums;
+    DivQuantChunkSums(pool, tmp_num_points, num_chunks, chunk_sums, &box_sums,
+                      [&](int ci, int begin, int end, Split_Sums *range_sums) {
+                        DivQuantLkmBandBox<PT>(tmp_data, ci, begin, end, &band);
+                      });
+    
+    band.box_min = band.range_min[0];
+    band.box_max = band.range_max[0];
+    
+    for ( int ci = 1; ci < num_chunks; ci++ ) {
+      band.box_min.red = min(band.box_min.red, band.range_min[ci].red);
+      band.box_min.green = min(band.box_min.green, band.range_min[ci].green);
+      band.box_min.blue = min(band.box_min.blue, band.range_min[ci].blue);
+      band.box_max.red = max(band.box_max.red, band.range_max[ci].red);
+      band.box_max.green = max(band.box_max.green, band.range_max[ci].green);
+      band.box_max.blue = max(band.box_max.blue, band.range_max[ci].blue);
+    }
+  }
+  
+  double prev_lhs = 0.0; /* hyperplane of the previous iteration */
+  double prev_rhs_red = 0.0;
+  double prev_rhs_green = 0.0;
+  double prev_rhs_blue = 0.0;
+  
+  for ( it = 0; it < max_iters; it++ )
+  {
+    prev_old_mean = *old_mean;
+    prev_new_mean = *new_mean;
+    
+    result->lkm_iters++;
+    
+    // Precalculations
+    lhs = 0.5 *
+    ( SQR ( old_mean->red ) - SQR ( new_mean->red ) +
+     SQR ( old_mean->green ) - SQR ( new_mean->green ) +
+     SQR ( old_mean->blue ) - SQR ( new_mean->blue ) );
+    
+    double rhs_red = old_mean->red - new_mean->red;
+    double rhs_green = old_mean->green - new_mean->green;
+    double rhs_blue = old_mean->blue - new_mean->blue;
+    
+    const bool last_iter = ( it == max_iters_m1 ) || converged;
+    
+#ifdef VERBOSE
+    printf ( "Local kmeans Iteration %d\n", it );
+#endif
+    
+    if ( use_sample && !last_iter )
+    {
+      int sample_new_size = 0;
+      
+      if ( !DivQuantLkmSampleMeans<UW, PT, WT>(&sample, lhs, rhs_red, rhs_green, rhs_blue, config->simd_level, &sample_new_size, old_mean, new_mean) )
+      {
+        // Run the last iteration with the means as they are
+        converged = true;
+        continue;
+      }
+      
+      if ( config->lkm_converge && sample_new_size == prev_size )
+      {
+        converged = DivQuantLkmMeansConverged(old_mean, new_mean, &prev_old_mean, &prev_new_mean, config->lkm_tolerance);
+      }
+      
+      prev_size = sample_new_size;
+      continue;
+    }
+    
+    if ( config->fixed_lkm )
+    {
+      Lkm_Fixed coef;
+      DivQuantLkmFixedCoefficients(lhs, rhs_red, rhs_green, rhs_blue, &coef);
+      
+      DivQuantRangeSums(pool, tmp_num_points, num_chunks, chunk_sums, &sums,
+                        [&](int begin, int end, Split_Sums *range_sums) {
+                          DivQuantLkmRangeFixed<UW, MT, PT, WT>(tmp_data, tmp_weights, point_index, member, begin, end, &coef, last_iter, old_index, new_index, inplace, range_sums);
+                        });
+    }
+    else if ( use_band && !last_iter && it > 0 )
+    {
+      const double movement = band.valid ? DivQuantLkmPlaneMovement(&band.box_min, &band.box_max, band.lhs, band.rhs_red, band.rhs_green, band.rhs_blue, lhs, rhs_red, rhs_green, rhs_blue) : 0.0;
+      
+      if ( band.valid && movement <= band.width )
+      {
+        DivQuantChunkSums(pool, tmp_num_points, num_chunks, chunk_sums, &sums,
+                          [&](int ci, int begin, int end, Split_Sums *range_sums) {
+                            DivQuantLkmBandRange<UW, PT, WT>(tmp_data, tmp_weights, point_index, ci, begin, end, lhs, rhs_red, rhs_green, rhs_blue, &band, range_sums);
+                          });
+      }
+      else
+      {
+        band.lhs = lhs;
+        band.rhs_red = rhs_red;
+        band.rhs_green = rhs_green;
+        band.rhs_blue = rhs_blue;
+        band.width = 2.0 * DivQuantLkmPlaneMovement(&band.box_min, &band.box_max, prev_lhs, prev_rhs_red, prev_rhs_green, prev_rhs_blue, lhs, rhs_red, rhs_green, rhs_blue);
+        band.valid = true;
+        
+        DivQuantChunkSums(pool, tmp_num_points, num_chunks, chunk_sums, &sums,
+                          [&](int ci, int begin, int end, Split_Sums *range_sums) {
+                            DivQuantLkmBandBuild<UW, PT, WT>(tmp_data, tmp_weights, point_index, ci, begin, end, &band, range_sums);
+                          });
+                          
+      }
+    }
+    else
+    {
+      DivQuantRangeSums(pool, tmp_num_points, num_chunks, chunk_sums, &sums,
+                        [&](int begin, int end, Split_Sums *range_sums) {
+                          DivQuantLkmRange<UW, MT, PT, WT>(tmp_data, tmp_weights, point_index, member, begin, end, lhs, rhs_red, rhs_green, rhs_blue, last_iter, old_index, new_index, inplace, old_mean, config->simd_level, range_sums);
+                        });
+    }
+    
+    if ( inplace && last_iter && num_chunks > 1 )
+    {
+      DivQuantMergeRangePartitions<UW, PT, WT>(pool, tmp_data, tmp_weights, tmp_num_points, num_chunks, chunk_sums, scratch_data, scratch_weights);
+    }
+    
+    prev_lhs = lhs;
+    prev_rhs_red = rhs_red;
+    prev_rhs_green = rhs_green;
+    prev_rhs_blue = rhs_blue;
+    
+    // Update the statistics of the new cluster
+    new_size = sums.size;
+    
+    new_mean->red = sums.sum.red;
+    new_mean->green = sums.sum.green;
+    new_mean->blue = sums.sum.blue;
+    
+    new_var->red = sums.sum_sqr.red;
+    new_var->green = sums.sum_sqr.green;
+    new_var->blue = sums.sum_sqr.blue;
+    
+#ifdef VERBOSE
+    mse = sums.mse;
+    if (UW || DivQuantCountWeights<WT>()) {
+      mse *= data_weight;
+    }
+#endif
+    
+#ifdef VERBOSE
+    printf ( "\tLocal Iteration %d: MSE = %f\n", it, mse );
+    if ( last_iter )
+    {
+      printf ( "\n" );
+    }
+#endif
+    
+    if (UW || DivQuantCountWeights<WT>()) {
+      new_mean->red *= data_weight;
+      new_mean->green *= data_weight;
+      new_mean->blue *= data_weight;
+      
+      new_weight = (UW ? new_size : sums.weight) * data_weight;
+      
+      new_var->red *= data_weight;
+      new_var->green *= data_weight;
+      new_var->blue *= data_weight;
+    } else {
+      new_weight = sums.weight;
+    }
+    
+    // Calculate the mean of the new cluster
+    new_mean->red /= new_weight;
+    new_mean->green /= new_weight;
+    new_mean->blue /= new_weight;
+    
+    // Calculate the weight of the old cluster
+    old_weight = total_weight - new_weight;
+    
+    // Calculate the mean of the old cluster using the 'combined mean' formula
+    old_mean->red = ( total_weight * total_mean->red - new_weight * new_mean->red ) / old_weight;
+    old_mean->green = ( total_weight * total_mean->green - new_weight * new_mean->green ) / old_weight;
+    old_mean->blue = ( total_weight * total_mean->blue - new_weight * new_mean->blue ) / old_weight;
+    
+    if ( last_iter )
+    {
+      break;
+    }
+    
+    if ( config->lkm_converge && new_size == prev_size )
+    {
+      converged = DivQuantLkmMeansConverged(old_mean, new_mean, &prev_old_mean, &prev_new_mean, config->lkm_tolerance);
+
+#ifdef VERBOSE
+      if ( converged ) {
+        printf ( "Local kmeans converged after iteration %d\n", it );
+      }
+#endif
+    }
+    
+    prev_size = new_size;
+  }
+  
+  /* LOCAL K-MEANS END */
+  
+  if ( use_sample )
+  {
+    sample.points.release();
+  }
+
+#if defined(DEBUG)
+  if ( inplace && ( apply_lkm || !KM ) ) {
+    // C1 now occupies the front of the range and C2 the back
+    assert(sums.old_count == tmp_num_points - new_size);
+  }
+#endif // DEBUG
+  
+  result->new_size = new_size;
+  result->old_weight = old_weight;
+  result->new_weight = new_weight;
+  
+  /* Calculate the variance of the new cluster */
+  /* Alternative weighted variance formula: ( sum{w_i * x_i^2} / sum{w_i} ) - bar{x}^2 */
+  new_var->red = new_var->red / new_weight - SQR ( new_mean->red );
+  new_var->green = new_var->green / new_weight - SQR ( new_mean->green );
+  new_var->blue = new_var->blue / new_weight - SQR ( new_mean->blue );
+  
+  /* Calculate the variance of the old cluster using the 'combined variance' formula */
+  old_var->red = ( ( total_weight * total_var->red -
+                    new_weight * ( new_var->red + SQR ( new_mean->red - total_mean->red ) ) ) / old_weight ) -
+  SQR ( old_mean->red - total_mean->red );
+  
+  old_var->green = ( ( total_weight * total_var->green -
+                      new_weight * ( new_var->green + SQR ( new_mean->green - total_mean->green ) ) ) / old_weight ) -
+  SQR ( old_mean->green - total_mean->green );
+  
+  old_var->blue = ( ( total_weight * total_var->blue -
+                     new_weight * ( new_var->blue + SQR ( new_mean->blue - total_mean->blue ) ) ) / old_weight ) -
+  SQR ( old_mean->blue - total_mean->blue );
+}
+
+// A node of the split tree built by DivQuantSplitTasks. Each node is a
+// cluster stored as the range [begin, begin + size) of the points. When the
+// split of a node has run, the 2 clusters it was split into are its children.
+// A node only becomes one of the clusters of the result, with a cluster
+// index, once the split of its parent is committed.
+
+#define SPLIT_NODE_PENDING 0
+#define SPLIT_NODE_QUEUED 1
+#define SPLIT_NODE_RUNNING 2
+#define SPLIT_NODE_DONE 3
+
+typedef struct Split_Node
+{
+  int begin; /* offset of the first point of the cluster */
+  int size; /* number of points in the cluster */
+  int index; /* cluster index, -1 until the split of the parent is committed */
+  double weight; /* weight of the cluster */
+  double tse; /* total squared error of the cluster */
+  Pixel_Double mean;
+  Pixel_Double var;
+  std::atomic<int> state; /* one of the SPLIT_NODE_* values */
+  Split_Result result;
+  struct Split_Node *child[2]; /* C1 and C2, set before state is done */
+} Split_Node;
+
+// Max heap order of split nodes, same as DivQuantTseLess
+
+struct DivQuantNodeTseLess
+{
+  bool operator()(const Split_Node *a, const Split_Node *b) const {
+    if ( a->tse != b->tse ) {
+      return a->tse < b->tse;
+    }
+    return a->index > b->index;
+  }
+};
+
+// Order of the nodes in the work queues. The cluster index of a node is
+// set while it may be in a queue, so only the TSE is compared.
+
+struct DivQuantQueuedNodeLess
+{
+  bool operator()(const Split_Node *a, const Split_Node *b) const {
+    return a->tse < b->tse;
+  }
+};
+
+// Keeps the num_splits largest TSE values of the nodes created so far. The
+// TSE of C1 or C2 is never larger than the TSE of the cluster they were split
+// from, so the clusters split by the remaining num_splits splits are the
+// num_splits clusters with the largest TSE. A node with a TSE below the
+// smallest value kept here can not be one of them.
+
+struct DivQuantTseCutoff
+{
+  std::mutex mutex;
+  std::vector<double> min_heap;
+  int num_splits;
+  
+  // Add the TSE of a node that was just created
+  
+  void add(const double tse) {
+    std::unique_lock<std::mutex> lock(mutex);
+    
+    if ( !( DBL_MIN < tse ) ) {
+      return;
+    }
+    
+    if ( (int) min_heap.size() < num_splits ) {
+      min_heap.push_back(tse);
+      push_heap(min_heap.begin(), min_heap.end(), greater<double>());
+    } else if ( min_heap.front() < tse ) {
+      pop_heap(min_heap.begin(), min_heap.end(), greater<double>());
+      min_heap.back() = tse;
+      push_heap(min_heap.begin(), min_heap.end(), greater<double>());
+    }
+  }
+  
+  // Nodes with a TSE below this value will not be split
+  
+  double value() {
+    std::unique_lock<std::mutex> lock(mutex);
+    
+    if ( (int) min_heap.size() < num_splits ) {
+      return 0.0;
+    }
+    return min_heap.front();
+  }
+};
+
+// Do the splits first_index to num_colors-1 by splitting multiple clusters
+// at the same time. The clusters that will be split next are the ones with
+// the largest TSE, so each thread splits nodes ahead of time starting with
+// the existing clusters. When a split completes, the children that may
+// still be split are queued on the thread that split the parent and idle
+// threads steal nodes from the other threads. The result of each split is
+// then committed by the calling thread in the same order the clusters are
+// selected by the serial loop in DivQuantCluster, so the cluster indexes
+// and the result do not depend on the number of threads or their timing.
+// While the split of the selected cluster is running on another thread,
+// the calling thread runs queued splits. Nodes split ahead of time that are
+// not selected are dropped, each one is a cluster that is not split, so
+// only the order of its points is changed.
+
+template <bool UW, typename MT, bool KM, typename PT, typename WT>
+static
+void
+DivQuantSplitTasks(
+                   DivQuantThreadPool *pool,
+                   const PT & points,
+                   WT *weights,
+                   const double data_weight,
+                   const int max_iters,
+                   const Split_Config *config,
+                   int *lkm_iters,
+                   const int num_colors,
+                   const int first_index,
+                   const int first_old_index,
+                   const int *heap,
+                   const int heap_size,
+                   int *start,
+                   int *size,
+                   double *weight,
+                   double *tse,
+                   Pixel_Double *mean,
+                   Pixel_Double *var)
+{
+  const int num_threads = pool->getNumThreads();
+  
+  DivQuantNodeTseLess node_less;
+  
+  DivQuantWorkQueues<Split_Node*, DivQuantQueuedNodeLess> queues(num_threads, DivQuantQueuedNodeLess());
+  
+  // Nodes allocated by each thread
+  std::vector<std::vector<Split_Node*> > thread_nodes(num_threads);
+  
+  // Node for each cluster index
+  std::vector<Split_Node*> nodes(num_colors, nullptr);
+  
+  DivQuantTseCutoff cutoff;
+  cutoff.num_splits = num_colors - first_index;
+  
+  std::mutex done_mutex;
+  std::condition_variable done_cond;
+  
+  // Create a node for each existing cluster
+  
+  std::vector<Split_Node*> candidates;
+  
+  for ( int ic = 0; ic < first_index; ic++ )
+  {
+    Split_Node *node = new Split_Node();
+    node->begin = start[ic];
+    node->size = size[ic];
+    node->index = ic;
+    node->weight = weight[ic];
+    node->tse = tse[ic];
+    node->mean = mean[ic];
+    node->var = var[ic];
+    node->state = SPLIT_NODE_PENDING;
+    
+    thread_nodes[0].push_back(node);
+    nodes[ic] = node;
+    
+    cutoff.add(node->tse);
+    
+    if ( DBL_MIN < node->tse ) {
+      candidates.push_back(node);
+    }
+  }
+  
+  // Queue the existing clusters that may be split, spread over all threads
+  
+  const double min_tse = cutoff.value();
+  
+  for ( int i = 0; i < (int) candidates.size(); i++ )
+  {
+    Split_Node *node = candidates[i];
+    
+    if ( node->tse < min_tse ) {
+      continue;
+    }
+    
+    node->state = SPLIT_NODE_QUEUED;
+    queues.push(i % num_threads, node);
+  }
+  
+  // Split a node and queue its children
+  
+  auto run_node = [&](Split_Node *node, const int ti) {
+    Split_Result *result = &node->result;
+    
+    PT node_data = points.offset(node->begin);
+    WT *node_weights = nullptr;
+    if (!UW) {
+      node_weights = weights + node->begin;
+    }
+    
+    DivQuantSplitCluster<UW, MT, KM, PT, WT>(node_data, node_weights, nullptr, nullptr, node->size, data_weight, max_iters, 0, 0, true, nullptr, 1, nullptr, PT(), nullptr, node->weight, &node->mean, &node->var, config, result);
+    
+    const int old_size = node->size - result->new_size;
+    
+    Split_Node *old_node = new Split_Node();
+    old_node->begin = node->begin;
+    old_node->size = old_size;
+    old_node->index = -1;
+    old_node->weight = result->old_weight;
+    old_node->mean = result->old_mean;
+    old_node->var = result->old_var;
+    old_node->tse = result->old_weight * ( result->old_var.red + result->old_var.green + result->old_var.blue );
+    old_node->state = SPLIT_NODE_PENDING;
+    
+    Split_Node *new_node = new Split_Node();
+    new_node->begin = node->begin + old_size;
+    new_node->size = result->new_size;
+    new_node->index = -1;
+    new_node->weight = result->new_weight;
+    new_node->mean = result->new_mean;
+    new_node->var = result->new_var;
+    new_node->tse = result->new_weight * ( result->new_var.red + result->new_var.green + result->new_var.blue );
+    new_node->state = SPLIT_NODE_PENDING;
+    
+    thread_nodes[ti].push_back(old_node);
+    thread_nodes[ti].push_back(new_node);
+    
+    node->child[0] = old_node;
+    node->child[1] = new_node;
+    
+    cutoff.add(old_node->tse);
+    cutoff.add(new_node->tse);
+    const double child_min_tse = cutoff.value();
+    
+    {
+      std::unique_lock<std::mutex> lock(done_mutex);
+      node->state = SPLIT_NODE_DONE;
+    }
+    done_cond.notify_all();
+    
+    for ( Split_Node *child : node->child ) {
+      if ( DBL_MIN < child->tse && child_min_tse <= child->tse ) {
+        int expected = SPLIT_NODE_PENDING;
+        if ( child->state.compare_exchange_strong(expected, SPLIT_NODE_QUEUED) ) {
+          queues.push(ti, child);
+        }
+      }
+    }
+  };
+  
+  // Run the split of a node on the calling thread unless another thread
+  // already started it, returns true if the split was run.
+  
+  auto claim_node = [&](Split_Node *node, const int ti) {
+    int expected = SPLIT_NODE_PENDING;
+    if ( node->state.compare_exchange_strong(expected, SPLIT_NODE_RUNNING) ) {
+      run_node(node, ti);
+      return true;
+    }
+    expected = SPLIT_NODE_QUEUED;
+    if ( node->state.compare_exchange_strong(expected, SPLIT_NODE_RUNNING) ) {
+      run_node(node, ti);
+      return true;
+    }
+    return false;
+  };
+  
+  auto commit_splits = [&]() {
+    std::vector<Split_Node*> node_heap;
+    
+    for ( int i = 0; i < heap_size; i++ ) {
+      node_heap.push_back(nodes[heap[i]]);
+    }
+    make_heap(node_heap.begin(), node_heap.end(), node_less);
+    
+    int old_index = first_old_index;
+    Split_Node *node = nodes[old_index];
+    
+    for ( int new_index = first_index; new_index < num_colors; new_index++ )
+    {
+      if ( new_index > first_index )
+      {
+        /* Select the cluster with the maximum TSE like STEP 4 */
+        
+        if ( !node_heap.empty() )
+        {
+          pop_heap(node_heap.begin(), node_heap.end(), node_less);
+          node = node_heap.back();
+          node_heap.pop_back();
+        }
+        else
+        {
+          /* When no cluster can be selected OLD_INDEX is left as is */
+          node = nodes[old_index];
+        }
+        
+        old_index = node->index;
+      }
+      
+      // Wait for the split of the node, other nodes are split while waiting
+      
+      while ( node->state != SPLIT_NODE_DONE ) {
+        if ( claim_node(node, 0) ) {
+          break;
+        }
+        
+        Split_Node *other;
+        if ( queues.pop(0, other, false) ) {
+          int expected = SPLIT_NODE_QUEUED;
+          if ( other->state.compare_exchange_strong(expected, SPLIT_NODE_RUNNING) ) {
+            run_node(other, 0);
+          }
+          continue;
+        }
+        
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done_cond.wait(lock, [node]{ return node->state == SPLIT_NODE_DONE; });
+      }
+      
+      /* Commit the split, like DivQuantCluster does */
+      
+      Split_Result *result = &node->result;
+      Split_Node *old_node = node->child[0];
+      Split_Node *new_node = node->child[1];
+      
+      if ( lkm_iters != nullptr ) {
+        lkm_iters[new_index - 1] = result->lkm_iters;
+      }
+      
+      size[old_index] = old_node->size;
+      size[new_index] = new_node->size;
+      
+      mean[old_index] = result->old_mean;
+      mean[new_index] = result->new_mean;
+      
+      start[new_index] = start[old_index] + size[old_index];
+      
+      if ( new_index == num_colors - 1 ) {
+        break;
+      }
+      
+      var[old_index] = result->old_var;
+      var[new_index] = result->new_var;
+      
+      weight[old_index] = result->old_weight;
+      weight[new_index] = result->new_weight;
+      
+      tse[old_index] = old_node->tse;
+      tse[new_index] = new_node->tse;
+      
+      old_node->index = old_index;
+      new_node->index = new_index;
+      
+      nodes[old_index] = old_node;
+      nodes[new_index] = new_node;
+      
+      for ( Split_Node *child : node->child ) {
+        if ( DBL_MIN < child->tse ) {
+          node_heap.push_back(child);
+          push_heap(node_heap.begin(), node_heap.end(), node_less);
+        }
+      }
     }
-  }
-  
-  if (UW) {
-    // In uniform weight case do the multiply outside the loop
-    
-    mean_red *= data_weight;
-    mean_green *= data_weight;
-    mean_blue *= data_weight;
     
-    var_red *= data_weight;
-    var_green *= data_weight;
-    var_blue *= data_weight;
-  }
-  
-  var_red -= SQR ( mean_red );
-  var_green -= SQR ( mean_green );
-  var_blue -= SQR ( mean_blue );
+    // Splits still running on other threads are allowed to complete
+    queues.stop();
+  };
   
-  // Copy data to user supplied pointers
-  
-  total_mean->red = mean_red;
-  total_mean->green = mean_green;
-  total_mean->blue = mean_blue;
-  
-  total_var->red = var_red;
-  total_var->green = var_green;
-  total_var->blue = var_blue;
+  pool->parallel_for(num_threads, [&](int ti) {
+    if ( ti == 0 ) {
+      commit_splits();
+      return;
+    }
+    
+    Split_Node *node;
+    while ( queues.pop(ti, node, true) ) {
+      int expected = SPLIT_NODE_QUEUED;
+      if ( node->state.compare_exchange_strong(expected, SPLIT_NODE_RUNNING) ) {
+        run_node(node, ti);
+      }
+    }
+  });
   
-#ifdef VERBOSE
-  if ( 1 )
-  {
-    printf ( "new Global mean (R G B) (%0.2f %0.2f %0.2f)\n", total_mean->red, total_mean->green, total_mean->blue );
-    printf ( "new Global var  (R G B) (%0.2f %0.2f %0.2f)\n", total_var->red, total_var->green, total_var->blue );
+  for ( std::vector<Split_Node*> & allocated : thread_nodes ) {
+    for ( Split_Node *node : allocated ) {
+      delete node;
+    }
   }
-#endif
 }
 
 // This method defines a clustering approach that divides the input into
 // roughly equally sized clusters until N clusters is reached or the
 // clusters can be divided no more.
+//
+// When options->inplace_partition is set, the points are copied into
+// tmp_buffer (unless data already points at tmp_buffer) and each cluster
+// is kept as a contiguous range of that buffer. A split then partitions
+// only the range of the cluster being split, like a quicksort step, so
+// the member array and the per split rescan of all points are not needed.
+// Note that the weights in weightsPtr are reordered along with the points
+// in this mode.
+//
+// When options->split_tasks is also set, clusters too small to be split
+// with multiple threads are split at the same time by DivQuantSplitTasks.
+//
+// The points in data and tmp_buffer are stored as described by PT.
 
 // UW  : true if a uniform weight applies to each pixel evenly
-// MT  : type of the member attribute, either uint8_t uint32_t
+// MT  : type of the member attribute, either uint8_t uint16_t uint32_t
 // KM  : true if 1 or more kmeans iterations will be applied
+// PT  : type of the point storage, DivQuantPackedPoints, DivQuantPacked16Points or DivQuantPlanarPoints
+// WT  : type of the weights, double or uint32_t pixel counts
 
-template <bool UW, typename MT, bool KM>
+template <bool UW, typename MT, bool KM, typename PT, typename WT>
 void
 DivQuantCluster(
                 const int num_points,
-                const uint32_t *data,
-                uint32_t *tmp_buffer,
+                const PT & data,
+                const PT & tmp_buffer,
                 const double data_weight,
-                double *weightsPtr,
+                WT *weightsPtr,
                 const int num_bits,
                 const int max_iters,
                 uint32_t *colortablePtr,
-                uint32_t *numClustersPtr)
+                uint32_t *numClustersPtr,
+                const Quant_Options *options)
 {
-  int ic, ip, it;
+  int ic, ip;
   int colortableOffset;
-  int max_iters_m1; /* MAX_ITERS - 1 */
   int tmp_num_points; /* number of points in C */
   int old_index; /* index of C or C1 */
   int new_index; /* index of C2 */
-  int cut_axis; /* index of the cutting axis */
-  int new_size = 0; /* size of C2 */
   int count;
   int shift_amount;
   int num_empty; /* # empty clusters */
@@ -159,23 +2783,16 @@ DivQuantCluster(
   int member_size;
 #endif // DEBUG
   int *point_index;
+  int *start; /* offset of the first point of each cluster (inplace only) */
 #if defined(DEBUG)
   int size_size;
 #endif // DEBUG
   int *size;
-  int apply_lkm; /* indicates whether or not LKM is to be applied */
-  double max_val;
-  double cut_pos; /* cutting position */
-  double proj_val; /* projection of a data point on the cutting axis */
+#ifdef VERBOSE
   double red, green, blue; /* R, G, B values of a particular pixel */
   double tmp_weight; /* weight of a particular pixel */
-  double total_weight; /* weight of C */
-  double old_weight; /* weight of C1 */
-  double new_weight; /* weight of C2 */
-  double lhs;
-#ifdef VERBOSE
-  double mse;
 #endif
+  double total_weight; /* weight of C */
 #if defined(DEBUG)
   int weight_size;
 #endif // DEBUG
@@ -184,6 +2801,8 @@ DivQuantCluster(
   int tse_size;
 #endif // DEBUG
   double *tse; /* total squared error of each cluster */
+  int *heap; /* max heap of cluster indexes ordered by TSE */
+  int heap_size;
 #if defined(DEBUG)
   int mean_size;
 #endif // DEBUG
@@ -192,8 +2811,6 @@ DivQuantCluster(
   int var_size;
 #endif // DEBUG
   Pixel_Double *var; /* componentwise variance of each cluster */
-  Pixel_Double *old_mean; /* componentwise mean of C1 */
-  Pixel_Double *new_mean; /* componentwise mean of C2 */
   Pixel_Double *old_var; /* componentwise variance of C1 */
   Pixel_Double *new_var; /* componentwise variance of C2 */
   
@@ -205,12 +2822,59 @@ DivQuantCluster(
   MT *member;
   
   // Capacity in num points that can be stored in tmp_data
-  uint32_t *tmp_data; /* temporary data set (holds the cluster to be split) */
+  PT tmp_data; /* temporary data set (holds the cluster to be split) */
+  WT *tmp_weights; /* weights that correspond to tmp_data */
   int tmp_buffer_used;
   
+  const bool inplace = (options != nullptr) && options->inplace_partition;
+  
+  // The split of a large cluster can be divided among multiple threads
+  
+  const int num_threads = (options != nullptr) ? options->num_threads : 0;
+  int thread_min_points = (options != nullptr) ? options->thread_min_points : 0;
+  if (thread_min_points <= 0) {
+    thread_min_points = DEFAULT_THREAD_MIN_POINTS;
+  }
+  
+  DivQuantThreadPool *pool = nullptr;
+  Split_Result result; /* statistics of C1 and C2 */
+  Split_Sums *chunk_sums = nullptr; /* sums for each range processed by a thread */
+  PT scratch_data = PT(); /* used to merge range partitions */
+  WT *scratch_weights = nullptr;
+  
+  // Many small clusters can be split at the same time
+  
+  const bool split_tasks = inplace && (num_threads > 1) && options->split_tasks;
+  
+  // How each cluster is split
+  
+  Split_Config config;
+  config.simd_level = DivQuantSimdLevel((options != nullptr) ? options->simd : DIVQUANT_SIMD_DETECT);
+  config.fixed_lkm = (options != nullptr) && options->fixed_point_lkm;
+  config.histogram_split = (options != nullptr) && options->histogram_split;
+  config.lkm_converge = (options != nullptr) && options->lkm_converge;
+  config.lkm_tolerance = (options != nullptr) ? options->lkm_tolerance : 0.0;
+  config.lkm_band = (options != nullptr) && options->lkm_band;
+  config.lkm_sample_size = (options != nullptr) ? options->lkm_sample_size : 0;
+  
+  // Number of local k-means iterations of each split
+  int *lkm_iters = (options != nullptr) ? options->lkm_iters : nullptr;
+  
+  if (num_threads > 1 && (num_points >= thread_min_points || split_tasks)) {
+    pool = new DivQuantThreadPool(num_threads);
+    chunk_sums = new Split_Sums[num_threads];
+    
+    if (inplace) {
+      scratch_data = PT::alloc(num_points);
+      if (!UW) {
+        scratch_weights = new WT[num_points];
+      }
+    }
+  }
+  
   assert(num_points > 0);
   
-  const double *dataWeights = weightsPtr;
+  const WT *dataWeights = weightsPtr;
   if (dataWeights == nullptr) {
     assert(data_weight > 0.0);
   }
@@ -228,19 +2892,26 @@ DivQuantCluster(
   const int num_colors = *numClustersPtr;
   assert(num_colors > 0);
   
-  apply_lkm = 0 < max_iters ? 1 : 0;
-  max_iters_m1 = max_iters - 1;
-  
-  tmp_data = (uint32_t*) data;
+  tmp_data = data;
+  tmp_weights = weightsPtr;
   tmp_buffer_used = 0;
   
+  if (inplace) {
+    // Points are reordered as clusters are split, so operate on a copy
+    // of the input in tmp_buffer.
+    
+    if (!tmp_buffer.same(data)) {
+      tmp_buffer.copy(0, data, 0, num_points);
+    }
+    tmp_data = tmp_buffer;
+  }
+  
 #if defined(VERBOSE)
   for ( ip = 0; ip < num_points; ip++ )
   {
-    uint32_t pixel = data[ip];
-    uint32_t B = pixel & 0xFF;
-    uint32_t G = (pixel >> 8) & 0xFF;
-    uint32_t R = (pixel >> 16) & 0xFF;
+    uint32_t R = data.red(ip);
+    uint32_t G = data.green(ip);
+    uint32_t B = data.blue(ip);
     
     red = R;
     green = G;
@@ -269,7 +2940,10 @@ DivQuantCluster(
   false;
 #endif // __LP64__
   
-  if (is64Bit && sizeof(MT) == 1) {
+  if (inplace) {
+    // Membership is implied by the range a point is stored in
+    member = nullptr;
+  } else if (is64Bit && sizeof(MT) == 1) {
     // MT is a single byte and compiling for 64bit arch
     
     int numDoubleWords = num_points >> 3; // num_points / 8
@@ -284,6 +2958,12 @@ DivQuantCluster(
   
   point_index = nullptr;
   
+  if (inplace) {
+    start = new int[num_colors]();
+  } else {
+    start = nullptr;
+  }
+  
 #if defined(DEBUG)
   weight_size = num_colors;
 #endif // DEBUG
@@ -303,6 +2983,12 @@ DivQuantCluster(
 #endif // DEBUG
   tse = new double[num_colors]();
   
+  heap = new int[num_colors]();
+  heap_size = 0;
+  
+  DivQuantTseLess tse_less;
+  tse_less.tse = tse;
+  
 #if defined(DEBUG)
   mean_size = num_colors;
 #endif // DEBUG
@@ -320,505 +3006,95 @@ DivQuantCluster(
   memset(total_var, 0, sizeof(Pixel_Double));
   
   /* Cluster 0 is always the first cluster to be split */
-  old_index = 0;
-  
-  /* First cluster to be split contains the entire data set */
-#if defined(DEBUG)
-  assert(old_index >= 0 && old_index < weight_size);
-#endif // DEBUG
-  weight[old_index] = 1.0;
-  
-  /*
-   * # points is not the same as # pixels. Each point represents
-   * potentially multiple pixels with a specific color.
-   */
-#if defined(DEBUG)
-  assert(old_index >= 0 && old_index < size_size);
-#endif // DEBUG
-  size[old_index] = tmp_num_points = num_points;
-  
-  /* Perform ( NUM_COLORS - 1 ) splits */
-  /*
-   OLD_INDEX denotes the index of the cluster to be split.
-   When cluster OLD_INDEX is split, the indexes of the two subclusters
-   are given by OLD_INDEX and NEW_INDEX, respectively.
-   */
-  for ( new_index = 1; new_index < num_colors; new_index++ )
-  {
-    /* STEPS 1 & 2: DETERMINE THE CUTTING AXIS AND POSITION */
-    
-#if defined(DEBUG)
-    assert(old_index >= 0 && old_index < weight_size);
-#endif // DEBUG
-    total_weight = weight[old_index];
-    
-    if ( new_index == 1 )
-    {
-      DivQuantClusterInitMeanAndVar<UW, MT, KM>(num_points, data, data_weight, weightsPtr, total_mean, total_var);
-    }
-    else
-    {
-      // Cluster mean/variance has already been calculated
-#if defined(DEBUG)
-      assert(old_index >= 0 && old_index < mean_size);
-#endif // DEBUG
-      total_mean->red = mean[old_index].red;
-      total_mean->green = mean[old_index].green;
-      total_mean->blue = mean[old_index].blue;
-      
-#if defined(DEBUG)
-      assert(old_index >= 0 && old_index < var_size);
-#endif // DEBUG
-      total_var->red = var[old_index].red;
-      total_var->green = var[old_index].green;
-      total_var->blue = var[old_index].blue;
-      
-#ifdef VERBOSE
-      if ( 1 )
-      {
-        printf ( "Global mean (R G B) (%0.2f %0.2f %0.2f)\n", total_mean->red, total_mean->green, total_mean->blue );
-        printf ( "Global var  (R G B) (%0.2f %0.2f %0.2f)\n", total_var->red, total_var->green, total_var->blue );
-      }
-#endif
-      
-    }
-    
-    /* Determine the axis with the greatest variance */
-    
-    max_val = total_var->red;
-    cut_axis = 0;
-    cut_pos = total_mean->red;
-    
-    if ( max_val < total_var->green )
-    {
-      max_val = total_var->green;
-      cut_axis = 1;
-      cut_pos = total_mean->green;
-    }
-    
-    if ( max_val < total_var->blue )
-    {
-      cut_axis = 2;
-      cut_pos = total_mean->blue;
-    }
-    
-#if defined(DEBUG)
-    assert(new_index >= 0 && new_index < mean_size);
-    assert(new_index >= 0 && new_index < var_size);
-#endif // DEBUG
-    
-    new_mean = &mean[new_index];
-    new_var = &var[new_index];
-    
-#ifdef VERBOSE
-    if ( cut_axis == 0 ) {
-      printf ( "Cut on Red %10.8f\n", cut_pos);
-    } else if ( cut_axis == 1 ) {
-      printf ( "Cut on Green %10.8f\n", cut_pos);
-    } else if ( cut_axis == 2 ) {
-      printf ( "Cut on Blue %10.8f\n", cut_pos);
-    } else {
-      assert(0);
-    }
-#endif
-    
-    // Reset the statistics of the new cluster
-    new_weight = 0.0;
-    uint32_t new_weight_count = 0;
-    RESET_PIXEL ( new_mean );
-    
-    if ( !KM && !apply_lkm )
-    {
-      new_size = 0;
-      RESET_PIXEL ( new_var );
-    }
-    
-    // STEP 3: SPLIT THE CLUSTER OLD_INDEX
-    
-    for ( ip = 0; ip < tmp_num_points; )
-    {
-      uint32_t new_mean_red = 0;
-      uint32_t new_mean_green = 0;
-      uint32_t new_mean_blue = 0;
-      
-      uint32_t new_var_red = 0;
-      uint32_t new_var_green = 0;
-      uint32_t new_var_blue = 0;
-      
-      int maxLoopOffset = 0xFFFF;
-      int numLeft = (tmp_num_points - ip);
-      if (numLeft < maxLoopOffset) {
-        maxLoopOffset = numLeft;
-      }
-      maxLoopOffset += ip;
-      
-      for ( ; ip < maxLoopOffset; ip++ ) {
-        
-        uint32_t pixel = tmp_data[ip];
-        uint32_t B = pixel & 0xFF;
-        uint32_t G = (pixel >> 8) & 0xFF;
-        uint32_t R = (pixel >> 16) & 0xFF;
-        
-#ifdef VERBOSE
-        printf ( "pixel (R G B) (%d %d %d)\n", R, G, B );
-#endif
-        
-        proj_val = ( ( cut_axis == 0 ) ? R :
-                    ( ( cut_axis == 1 ) ? G : B ) );
-        
-#ifdef VERBOSE
-        printf ( "proj_val %8.2f and cut_pos %8.2f\n", proj_val, cut_pos);
-#endif
-        
-        if ( cut_pos < proj_val )
-        {
-#ifdef VERBOSE
-          printf ( "Cut GT   : %0.2f < %0.2f\n", cut_pos, proj_val);
-#endif
-          
-          if (UW) {
-            new_mean_red += R;
-            new_mean_green += G;
-            new_mean_blue += B;
-          } else {
-            // non-uniform weights
-            
-            int pointindex = ip;
-            if (point_index) {
-              pointindex = point_index[ip];
-            }
-#if defined(DEBUG)
-            assert(pointindex >= 0 && pointindex < member_size);
-#endif // DEBUG
-            tmp_weight = weightsPtr[pointindex];
-            
-            new_mean->red += tmp_weight * R;
-            new_mean->green += tmp_weight * G;
-            new_mean->blue += tmp_weight * B;
-          }
-          
-          // Update the point membership and variance/size of the new cluster
-          if ( !KM && !apply_lkm )
-          {
-            int pointindex = ip;
-            if (point_index) {
-              pointindex = point_index[ip];
-            }
-#if defined(DEBUG)
-            assert(pointindex >= 0 && pointindex < member_size);
-#endif // DEBUG
-            member[pointindex] = new_index;
-#ifdef VERBOSE
-            fprintf(stdout, "write member[%d] = %d (ip = %d)\n", pointindex, member[pointindex], ip);
-#endif
-            
-            if (UW) {
-              new_var_red += ( R * R );
-              new_var_green += ( G * G );
-              new_var_blue += ( B * B );
-            } else {
-              // non-uniform weights
-              
-              // tmp_weight already set above in loop
-              
-              new_var->red += tmp_weight * ( R * R );
-              new_var->green += tmp_weight * ( G * G );
-              new_var->blue += tmp_weight * ( B * B );
-            }
-            
-            new_size++;
-          }
-          
-          // Update the weight of the new cluster
-          
-          if (UW) {
-            new_weight_count += 1;
-          } else {
-            new_weight += tmp_weight;
-          }
-        } else {
-#ifdef VERBOSE
-          printf ( "Cut LTEQ : %0.2f >= %0.2f\n", cut_pos, proj_val);
-#endif
-        }
-        
-      } // end foreach tmp_num_points inner loop
-      
-      if (UW) {
-        new_mean->red += new_mean_red;
-        new_mean->green += new_mean_green;
-        new_mean->blue += new_mean_blue;
-        
-        if ( !KM && !apply_lkm ) {
-          new_var->red += new_var_red;
-          new_var->green += new_var_green;
-          new_var->blue += new_var_blue;
-        }
-      }
-      
-    } // end foreach tmp_num_points outer loop
-    
-    if (UW) {
-      new_mean->red *= data_weight;
-      new_mean->green *= data_weight;
-      new_mean->blue *= data_weight;
-      
-      new_weight = new_weight_count * data_weight;
-      
-      if ( !KM && !apply_lkm ) {
-        new_var->red *= data_weight;
-        new_var->green *= data_weight;
-        new_var->blue *= data_weight;
-      }
-    }
-    
-    // Calculate the weight of the old cluster
-    old_weight = total_weight - new_weight;
-    
-    // Calculate the mean of the new cluster
-    new_mean->red /= new_weight;
-    new_mean->green /= new_weight;
-    new_mean->blue /= new_weight;
-    
-#ifdef VERBOSE
-    printf ( "total_weight %8.2f : new_weight %8.2f  : old_weight %8.2f\n", total_weight, new_weight, old_weight);
-#endif
-    
-#ifdef VERBOSE
-    printf ( "New mean : R G B : %0.2f %0.2f %0.2f\n", new_mean->red, new_mean->green, new_mean->blue);
-#endif
-    
-    /* Calculate the mean of the old cluster using the 'combined mean' formula */
+  old_index = 0;
+  
+  /* First cluster to be split contains the entire data set */
 #if defined(DEBUG)
-    assert(old_index >= 0 && old_index < mean_size);
+  assert(old_index >= 0 && old_index < weight_size);
 #endif // DEBUG
-    old_mean = &mean[old_index];
-    old_mean->red = ( total_weight * total_mean->red - new_weight * new_mean->red ) / old_weight;
-    old_mean->green = ( total_weight * total_mean->green - new_weight * new_mean->green ) / old_weight;
-    old_mean->blue = ( total_weight * total_mean->blue - new_weight * new_mean->blue ) / old_weight;
-    
-#ifdef VERBOSE
-    printf ( "Old mean : R G B : %0.2f %0.2f %0.2f\n", old_mean->red, old_mean->green, old_mean->blue);
-#endif
+  weight[old_index] = 1.0;
+  
+  /*
+   * # points is not the same as # pixels. Each point represents
+   * potentially multiple pixels with a specific color.
+   */
+#if defined(DEBUG)
+  assert(old_index >= 0 && old_index < size_size);
+#endif // DEBUG
+  size[old_index] = tmp_num_points = num_points;
+  
+  /* Perform ( NUM_COLORS - 1 ) splits */
+  /*
+   OLD_INDEX denotes the index of the cluster to be split.
+   When cluster OLD_INDEX is split, the indexes of the two subclusters
+   are given by OLD_INDEX and NEW_INDEX, respectively.
+   */
+  for ( new_index = 1; new_index < num_colors; new_index++ )
+  {
+    /* STEPS 1 & 2: DETERMINE THE CUTTING AXIS AND POSITION */
     
-    /* LOCAL K-MEANS BEGIN */
+#if defined(DEBUG)
+    assert(old_index >= 0 && old_index < weight_size);
+#endif // DEBUG
+    total_weight = weight[old_index];
     
-#ifdef VERBOSE
-    if ( apply_lkm )
+    if ( new_index == 1 )
     {
-      printf ( "Global Iteration %d\n", new_index - 1 );
+      DivQuantClusterInitMeanAndVar<UW, MT, KM, PT, WT>(num_points, data, data_weight, weightsPtr, total_mean, total_var);
     }
-#endif
-    
-    for ( it = 0; it < max_iters; it++ )
+    else
     {
-      // Precalculations
-      lhs = 0.5 *
-      ( SQR ( old_mean->red ) - SQR ( new_mean->red ) +
-       SQR ( old_mean->green ) - SQR ( new_mean->green ) +
-       SQR ( old_mean->blue ) - SQR ( new_mean->blue ) );
-      
-      double rhs_red = old_mean->red - new_mean->red;
-      double rhs_green = old_mean->green - new_mean->green;
-      double rhs_blue = old_mean->blue - new_mean->blue;
-      
-      // Reset the statistics of the new cluster
-      new_weight = 0.0;
-      new_size = 0;
-      RESET_PIXEL ( new_mean );
-      RESET_PIXEL ( new_var );
-      
-#ifdef VERBOSE
-      mse = 0.0;
-#endif
-      
-#ifdef VERBOSE
-      printf ( "Local kmeans Iteration %d\n", it );
-#endif
+      // Cluster mean/variance has already been calculated
+#if defined(DEBUG)
+      assert(old_index >= 0 && old_index < mean_size);
+#endif // DEBUG
+      total_mean->red = mean[old_index].red;
+      total_mean->green = mean[old_index].green;
+      total_mean->blue = mean[old_index].blue;
       
-      for ( ip = 0; ip < tmp_num_points; )
-      {
-        int maxLoopOffset = 0xFFFF;
-        int numLeft = (tmp_num_points - ip);
-        if (numLeft < maxLoopOffset) {
-          maxLoopOffset = numLeft;
-        }
-        maxLoopOffset += ip;
-        
-        uint32_t new_mean_red = 0;
-        uint32_t new_mean_green = 0;
-        uint32_t new_mean_blue = 0;
-        
-        uint32_t new_var_red = 0;
-        uint32_t new_var_green = 0;
-        uint32_t new_var_blue = 0;
-        
-        for ( ; ip < maxLoopOffset; ip++ ) {
-          
-          uint32_t pixel = tmp_data[ip];
-          uint32_t B = pixel & 0xFF;
-          uint32_t G = (pixel >> 8) & 0xFF;
-          uint32_t R = (pixel >> 16) & 0xFF;
-          
-          red = R;
-          green = G;
-          blue = B;
-          
-          int pointindex = ip;
-          if (point_index) {
-            pointindex = point_index[ip];
-          }
 #if defined(DEBUG)
-          assert(pointindex >= 0 && pointindex < num_points);
-          assert(pointindex >= 0 && pointindex < member_size);
+      assert(old_index >= 0 && old_index < var_size);
 #endif // DEBUG
-          if (UW) {
-#ifdef VERBOSE
-            tmp_weight = data_weight;
-#endif // VERBOSE
-          } else {
-            tmp_weight = weightsPtr[pointindex];
-          }
-          
-          if ( lhs < ( (rhs_red * red) + (rhs_green * green) + (rhs_blue * blue) ) )
-          {
-#ifdef VERBOSE
-            // Update the MSE of the old cluster
-            mse += tmp_weight *
-            ( SQR ( red - old_mean->red ) +
-             SQR ( green - old_mean->green ) +
-             SQR ( blue - old_mean->blue ) );
-#endif
-            
-            if ( it == max_iters_m1 )
-            {
-              // Save the membership of the point
-              member[pointindex] = old_index;
-#ifdef VERBOSE
-              fprintf(stdout, "write member[%d] = %d (ip = %d)\n", pointindex, member[pointindex], ip);
-#endif
-            }
-          }
-          else
-          {
-#ifdef VERBOSE
-            // Update the MSE of the new cluster
-            mse += tmp_weight *
-            ( SQR ( red - old_mean->red + rhs_red ) +
-             SQR ( green - old_mean->green + rhs_green ) +
-             SQR ( blue - old_mean->blue + rhs_blue ) );
-#endif
-            
-            if ( it != max_iters_m1 )
-            {
-              // Update only mean
-              
-              if (UW) {
-                new_mean_red += R;
-                new_mean_green += G;
-                new_mean_blue += B;
-              } else {
-                new_mean->red += tmp_weight * red;
-                new_mean->green += tmp_weight * green;
-                new_mean->blue += tmp_weight * blue;
-              }
-            }
-            else
-            {
-              // Update mean and variance
-              
-              if (UW) {
-                new_mean_red += R;
-                new_mean_green += G;
-                new_mean_blue += B;
-              } else {
-                new_mean->red += tmp_weight * red;
-                new_mean->green += tmp_weight * green;
-                new_mean->blue += tmp_weight * blue;
-              }
-              
-              if (UW) {
-                new_var_red += ( R * R );
-                new_var_green += ( G * G );
-                new_var_blue += ( B * B );
-              } else {
-                new_var->red += tmp_weight * ( R * R );
-                new_var->green += tmp_weight * ( G * G );
-                new_var->blue += tmp_weight * ( B * B );
-              }
-              
-              // Save the membership of the point
-              member[pointindex] = new_index;
-#ifdef VERBOSE
-              fprintf(stdout, "write member[%d] = %d (ip = %d)\n", pointindex, member[pointindex], ip);
-#endif
-            }
-            
-            // Update the weight/size of the new cluster
-            
-            if (UW) {
-            } else {
-              new_weight += tmp_weight;
-            }
-            new_size++;
-          }
-        } // end foreach tmp_num_points inner loop
-        
-        if (UW) {
-          new_mean->red += new_mean_red;
-          new_mean->green += new_mean_green;
-          new_mean->blue += new_mean_blue;
-          
-          new_var->red += new_var_red;
-          new_var->green += new_var_green;
-          new_var->blue += new_var_blue;
-        }
-        
-      } // end foreach tmp_num_points outer loop
+      total_var->red = var[old_index].red;
+      total_var->green = var[old_index].green;
+      total_var->blue = var[old_index].blue;
       
 #ifdef VERBOSE
-      printf ( "\tLocal Iteration %d: MSE = %f\n", it, mse );
-      if ( it == max_iters_m1 )
+      if ( 1 )
       {
-        printf ( "\n" );
+        printf ( "Global mean (R G B) (%0.2f %0.2f %0.2f)\n", total_mean->red, total_mean->green, total_mean->blue );
+        printf ( "Global var  (R G B) (%0.2f %0.2f %0.2f)\n", total_var->red, total_var->green, total_var->blue );
       }
 #endif
       
-      if (UW) {
-        new_mean->red *= data_weight;
-        new_mean->green *= data_weight;
-        new_mean->blue *= data_weight;
-        
-        new_weight = new_size * data_weight;
-        
-        new_var->red *= data_weight;
-        new_var->green *= data_weight;
-        new_var->blue *= data_weight;
-      }
-      
-      // Calculate the mean of the new cluster
-      new_mean->red /= new_weight;
-      new_mean->green /= new_weight;
-      new_mean->blue /= new_weight;
-      
-      // Calculate the weight of the old cluster
-      old_weight = total_weight - new_weight;
-      
-      // Calculate the mean of the old cluster using the 'combined mean' formula
-      old_mean->red = ( total_weight * total_mean->red - new_weight * new_mean->red ) / old_weight;
-      old_mean->green = ( total_weight * total_mean->green - new_weight * new_mean->green ) / old_weight;
-      old_mean->blue = ( total_weight * total_mean->blue - new_weight * new_mean->blue ) / old_weight;
     }
     
-    /* LOCAL K-MEANS END */
+    // Large clusters are split with multiple threads
+    const int num_chunks = ( pool != nullptr && tmp_num_points >= thread_min_points ) ? pool->getNumThreads() : 1;
+    
+    DivQuantSplitCluster<UW, MT, KM, PT, WT>(tmp_data, tmp_weights, point_index, member, tmp_num_points, data_weight, max_iters, old_index, new_index, inplace, pool, num_chunks, chunk_sums, scratch_data, scratch_weights, total_weight, total_mean, total_var, &config, &result);
     
-    /* Store the updated cluster sizes */
+    if ( lkm_iters != nullptr ) {
+      lkm_iters[new_index - 1] = result.lkm_iters;
+    }
+    
+    /* Store the updated cluster sizes and means */
 #if defined(DEBUG)
     assert(old_index >= 0 && old_index < size_size);
     assert(new_index >= 0 && new_index < size_size);
+    assert(old_index >= 0 && old_index < mean_size);
+    assert(new_index >= 0 && new_index < mean_size);
 #endif // DEBUG
-    size[old_index] = tmp_num_points - new_size;
-    size[new_index] = new_size;
+    size[old_index] = tmp_num_points - result.new_size;
+    size[new_index] = result.new_size;
+    
+    mean[old_index] = result.old_mean;
+    mean[new_index] = result.new_mean;
+    
+    if (inplace) {
+      // C1 now occupies the front of the range and C2 the back
+      start[new_index] = start[old_index] + size[old_index];
+    }
     
     if ( new_index == num_colors - 1 )
     {
@@ -831,59 +3107,65 @@ DivQuantCluster(
       break;
     }
     
-    /* Calculate the variance of the new cluster */
-    /* Alternative weighted variance formula: ( sum{w_i * x_i^2} / sum{w_i} ) - bar{x}^2 */
-    new_var->red = new_var->red / new_weight - SQR ( new_mean->red );
-    new_var->green = new_var->green / new_weight - SQR ( new_mean->green );
-    new_var->blue = new_var->blue / new_weight - SQR ( new_mean->blue );
-    
-    /* Calculate the variance of the old cluster using the 'combined variance' formula */
+    /* Store the updated cluster variances */
 #if defined(DEBUG)
     assert(old_index >= 0 && old_index < var_size);
+    assert(new_index >= 0 && new_index < var_size);
 #endif // DEBUG
-    old_var = &var[old_index];
-    old_var->red = ( ( total_weight * total_var->red -
-                      new_weight * ( new_var->red + SQR ( new_mean->red - total_mean->red ) ) ) / old_weight ) -
-    SQR ( old_mean->red - total_mean->red );
+    var[old_index] = result.old_var;
+    var[new_index] = result.new_var;
     
-    old_var->green = ( ( total_weight * total_var->green -
-                        new_weight * ( new_var->green + SQR ( new_mean->green - total_mean->green ) ) ) / old_weight ) -
-    SQR ( old_mean->green - total_mean->green );
-    
-    old_var->blue = ( ( total_weight * total_var->blue -
-                       new_weight * ( new_var->blue + SQR ( new_mean->blue - total_mean->blue ) ) ) / old_weight ) -
-    SQR ( old_mean->blue - total_mean->blue );
+    old_var = &var[old_index];
+    new_var = &var[new_index];
     
     /* Store the updated cluster weights */
 #if defined(DEBUG)
     assert(old_index >= 0 && old_index < weight_size);
     assert(new_index >= 0 && new_index < weight_size);
 #endif // DEBUG
-    weight[old_index] = old_weight;
-    weight[new_index] = new_weight;
+    weight[old_index] = result.old_weight;
+    weight[new_index] = result.new_weight;
     
     /* Store the cluster TSEs */
 #if defined(DEBUG)
     assert(old_index >= 0 && old_index < tse_size);
     assert(new_index >= 0 && new_index < tse_size);
 #endif // DEBUG
-    tse[old_index] = old_weight * ( old_var->red + old_var->green + old_var->blue );
-    tse[new_index] = new_weight * ( new_var->red + new_var->green + new_var->blue );
+    tse[old_index] = result.old_weight * ( old_var->red + old_var->green + old_var->blue );
+    tse[new_index] = result.new_weight * ( new_var->red + new_var->green + new_var->blue );
     
     /* STEP 4: DETERMINE THE NEXT CLUSTER TO BE SPLIT */
     
     /* Split the cluster with the maximum TSE */
-    max_val = DBL_MIN;
-    for ( ic = 0; ic <= new_index; ic++ )
+    
+    /*
+     Only the TSE values of the 2 clusters just created have changed, so
+     these are added to a max heap and the cluster with the maximum TSE
+     is removed from the top in O(log K). A cluster with a TSE that is
+     not larger than DBL_MIN can never be selected, so it is not added.
+     When no cluster can be selected OLD_INDEX is left as is.
+     */
+    
+    if ( DBL_MIN < tse[old_index] )
+    {
+      heap[heap_size++] = old_index;
+      push_heap(heap, heap + heap_size, tse_less);
+    }
+    
+    if ( DBL_MIN < tse[new_index] )
     {
+      heap[heap_size++] = new_index;
+      push_heap(heap, heap + heap_size, tse_less);
+    }
+    
 #if defined(DEBUG)
-      assert(ic >= 0 && ic < tse_size);
+    assert(heap_size <= tse_size);
 #endif // DEBUG
-      if ( max_val < tse[ic] )
-      {
-        max_val = tse[ic];
-        old_index = ic;
-      }
+    
+    if ( heap_size > 0 )
+    {
+      pop_heap(heap, heap + heap_size, tse_less);
+      old_index = heap[--heap_size];
     }
     
 #if defined(DEBUG)
@@ -891,6 +3173,35 @@ DivQuantCluster(
 #endif // DEBUG
     tmp_num_points = size[old_index];
     
+    if (inplace) {
+      // The cluster to be split is already stored as a contiguous range
+      
+      if ( split_tasks )
+      {
+        // Once no cluster is large enough to be split with multiple threads,
+        // the remaining splits are done by splitting clusters at the same time.
+        
+        int max_size = 0;
+        for ( ic = 0; ic <= new_index; ic++ ) {
+          if ( max_size < size[ic] ) {
+            max_size = size[ic];
+          }
+        }
+        
+        if ( max_size < thread_min_points ) {
+          DivQuantSplitTasks<UW, MT, KM, PT, WT>(pool, tmp_buffer, weightsPtr, data_weight, max_iters, &config, lkm_iters, num_colors, new_index + 1, old_index, heap, heap_size, start, size, weight, tse, mean, var);
+          break;
+        }
+      }
+      
+      tmp_data = tmp_buffer.offset(start[old_index]);
+      if (!UW) {
+        tmp_weights = weightsPtr + start[old_index];
+      }
+      
+      continue;
+    }
+    
     // Allocate tmp_data and point_index only after initial division and then reuse buffers
     
     if (tmp_buffer_used == 0) {
@@ -900,7 +3211,7 @@ DivQuantCluster(
       // reused for all smaller cluster sizes.
       
 #if defined(DEBUG)
-      assert(tmp_data == data);
+      assert(tmp_data.same(data));
       assert(point_index == nullptr);
 #endif // DEBUG
       
@@ -909,9 +3220,9 @@ DivQuantCluster(
         largerSize = size[1];
       }
       
-      tmp_data = (uint32_t*) tmp_buffer;
+      tmp_data = tmp_buffer;
 #if defined(DEBUG)
-      memset(tmp_data, 0, largerSize * sizeof ( uint32_t ));
+      tmp_data.clear(largerSize);
 #endif // DEBUG
       
       tmp_buffer_used = largerSize;
@@ -920,7 +3231,7 @@ DivQuantCluster(
       point_index = new int[largerSize]();
     } else {
 #if defined(DEBUG)
-      assert(tmp_data == tmp_buffer);
+      assert(tmp_data.same(tmp_buffer));
       assert(point_index != nullptr);
       assert(tmp_buffer_used >= tmp_num_points);
 #endif // DEBUG
@@ -951,12 +3262,10 @@ DivQuantCluster(
 #endif // DEBUG
           
           if ( memberVal == old_index ) {
-            uint32_t pixel = data[ip];
-            
 #ifdef VERBOSE
-            uint32_t B = pixel & 0xFF;
-            uint32_t G = (pixel >> 8) & 0xFF;
-            uint32_t R = (pixel >> 16) & 0xFF;
+            uint32_t R = data.red(ip);
+            uint32_t G = data.green(ip);
+            uint32_t B = data.blue(ip);
             
             if (UW) {
               tmp_weight = data_weight;
@@ -968,7 +3277,7 @@ DivQuantCluster(
             fprintf(stdout, "in (copy) data[%5d] = ( %3d %3d %3d ) W = %8.8f\n", ip, R, G, B, tmp_weight);
 #endif
             
-            tmp_data[count] = pixel;
+            tmp_data.copy(count, data, ip, 1);
             point_index[count] = ip;
             count++;
           }
@@ -984,6 +3293,39 @@ DivQuantCluster(
 
       // In the case where ((num_points - ip) > 0) the loop below
       // will be executed to copy any remaining values.
+    } else if (is64Bit && sizeof(MT) == 2) {
+      // Read 4 two byte values at a time from member array. The values
+      // equal to old_index are found with SWAR operations on the word, so a
+      // word with no point in the cluster is skipped with a single test.
+      
+      const uint64_t lanes_old = 0x0001000100010001ULL * (uint16_t) old_index;
+      const uint64_t low_bits = 0x7FFF7FFF7FFF7FFFULL;
+      int numDoubleWordLoops = num_points >> 2; // num_points / 4
+      
+      for ( int i = 0; i < numDoubleWordLoops; i++) {
+        uint64_t dword;
+        memcpy(&dword, &member[i << 2], sizeof(dword));
+        
+        // The top bit of each 16 bit lane is set when the lane is old_index
+        uint64_t diff = dword ^ lanes_old;
+        uint64_t matches = ~(((diff & low_bits) + low_bits) | diff) & ~low_bits;
+        
+        while (matches != 0) {
+          ip = (i << 2) + (__builtin_ctzll(matches) >> 4);
+#if defined(DEBUG)
+          assert(ip >= 0 && ip < member_size);
+          assert(member[ip] == old_index);
+#endif // DEBUG
+          
+          tmp_data.copy(count, data, ip, 1);
+          point_index[count] = ip;
+          count++;
+          
+          matches &= matches - 1;
+        }
+      }
+      
+      ip = numDoubleWordLoops << 2;
     }
     
     // Read 1 to N values from member array one at a time
@@ -995,12 +3337,10 @@ DivQuantCluster(
 #endif // DEBUG
       if ( member[ip] == old_index )
       {
-        uint32_t pixel = data[ip];
-        
 #ifdef VERBOSE
-        uint32_t B = pixel & 0xFF;
-        uint32_t G = (pixel >> 8) & 0xFF;
-        uint32_t R = (pixel >> 16) & 0xFF;
+        uint32_t R = data.red(ip);
+        uint32_t G = data.green(ip);
+        uint32_t B = data.blue(ip);
         
         if (UW) {
           tmp_weight = data_weight;
@@ -1012,7 +3352,7 @@ DivQuantCluster(
         fprintf(stdout, "in (copy) data[%5d] = ( %3d %3d %3d ) W = %8.8f\n", ip, R, G, B, tmp_weight);
 #endif
         
-        tmp_data[count] = pixel;
+        tmp_data.copy(count, data, ip, 1);
         point_index[count] = ip;
         count++;
       }
@@ -1070,7 +3410,7 @@ DivQuantCluster(
   }
   
 #ifdef VERBOSE
-  for ( int ip = 0; ip < num_points; ip++) {
+  for ( int ip = 0; member != nullptr && ip < num_points; ip++) {
 #if defined(DEBUG)
     assert(ip >= 0 && ip < member_size);
 #endif // DEBUG
@@ -1084,9 +3424,22 @@ DivQuantCluster(
     delete [] point_index;
   }
   delete [] member;
+  if (start != nullptr) {
+    delete [] start;
+  }
   delete [] weight;
   delete [] size;
   delete [] tse;
+  delete [] heap;
+  
+  if (pool != nullptr) {
+    delete pool;
+    delete [] chunk_sums;
+  }
+  scratch_data.release();
+  if (scratch_weights != nullptr) {
+    delete [] scratch_weights;
+  }
   delete [] mean;
   delete [] var;
   
@@ -1096,6 +3449,38 @@ DivQuantCluster(
   return;
 }
 
+// Select the smallest member attribute type that can hold the index of each
+// of the *numClustersPtr clusters and cluster with it
+
+template <bool UW, typename PT, typename WT>
+static
+void
+DivQuantClusterMember(
+                      const int num_points,
+                      const PT & data,
+                      const PT & tmp_buffer,
+                      const double data_weight,
+                      WT *weightsPtr,
+                      const int num_bits,
+                      const int max_iters,
+                      uint32_t *colortablePtr,
+                      uint32_t *numClustersPtr,
+                      const Quant_Options *options)
+{
+  const uint32_t num_colors = *numClustersPtr;
+  
+  const bool wide_member = (options != nullptr) && options->wide_member;
+  
+  if (num_colors <= 256) {
+    // Each cluster index fits in one byte
+    DivQuantCluster<UW, uint8_t, true, PT, WT>(num_points, data, tmp_buffer, data_weight, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+  } else if (num_colors <= 65536 && !wide_member) {
+    DivQuantCluster<UW, uint16_t, true, PT, WT>(num_points, data, tmp_buffer, data_weight, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+  } else {
+    DivQuantCluster<UW, uint32_t, true, PT, WT>(num_points, data, tmp_buffer, data_weight, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+  }
+}
+
 void
 quant_varpart_fast (
                     const uint32_t numPixels,
@@ -1108,7 +3493,8 @@ quant_varpart_fast (
                     const int num_bits,
                     const int dec_factor,
                     const int max_iters,
-                    const int allPixelsUnique)
+                    const int allPixelsUnique,
+                    const Quant_Options *options)
 {
   int num_points;
   
@@ -1118,59 +3504,124 @@ quant_varpart_fast (
   }
   
   num_points = numPixels;
-  
-  int num_colors = *numClustersPtr;
 
   bool inputPixelsAllocated = false;
   uint32_t *inputPixels = (uint32_t*) inPixels;
   
   double weightUniform = 0.0;
   double *weightsPtr = nullptr;
+  uint32_t *countsPtr = nullptr;
+  
+  // The inplace partition logic reorders the deduplicated points
+  // in tmpPixels directly, so no copy of the points is needed.
+  const bool inplace = (options != nullptr) && options->inplace_partition;
+  
+  // The colors can be counted with multiple threads
+  const int histogram_threads = (options != nullptr && options->parallel_histogram) ? options->num_threads : 1;
+  
+  // The deduplicated colors can be weighted with their pixel counts, the
+  // counts are then scaled by 1 / num samples as each cluster is created
+  const bool integerWeights = (options != nullptr) && options->integer_weights;
+  
+  if (integerWeights) {
+    weightUniform = 1.0 / ( ceil ( numRows / ( double ) dec_factor ) * ceil ( numCols / ( double ) dec_factor ) );
+  }
   
   if ((allPixelsUnique && (num_bits == 8 && dec_factor == 1) && 1)) {
     // No duplicate pixels and no decimation or bit shifting
     weightUniform = get_double_scale(inPixels, numPixels);
   } else if (!allPixelsUnique && num_bits == 8) {
     // No cut bits, but duplicate pixels, dedup now
-    weightsPtr = calc_color_table(inPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, &num_points);
-    inputPixelsAllocated = true;
-    inputPixels = new uint32_t[num_points];
-    memcpy(inputPixels, tmpPixels, num_points * sizeof(uint32_t));
+    if (integerWeights) {
+      countsPtr = calc_color_counts(inPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, histogram_threads, &num_points);
+    } else {
+      weightsPtr = calc_color_table_threads(inPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, histogram_threads, &num_points);
+    }
+    if (inplace) {
+      inputPixels = tmpPixels;
+    } else {
+      inputPixelsAllocated = true;
+      inputPixels = new uint32_t[num_points];
+      memcpy(inputPixels, tmpPixels, num_points * sizeof(uint32_t));
+    }
+  } else if (num_bits < 8 && histogram_threads <= 1) {
+    // cut bits and count the colors in one pass over the pixels, the
+    // histogram is a direct table of 2^(3 * num_bits) counts
+    const int simd_level = DivQuantSimdLevel((options != nullptr) ? options->simd : DIVQUANT_SIMD_DETECT);
+    if (integerWeights) {
+      countsPtr = calc_cut_color_counts(inPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, num_bits, simd_level, &num_points);
+    } else {
+      weightsPtr = calc_cut_color_table(inPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, num_bits, simd_level, &num_points);
+    }
+    if (inplace) {
+      inputPixels = tmpPixels;
+    } else {
+      inputPixelsAllocated = true;
+      inputPixels = new uint32_t[num_points];
+      memcpy(inputPixels, tmpPixels, num_points * sizeof(uint32_t));
+    }
   } else {
     // cut bits with right shift and dedup to generate significantly smaller sized buffer
     cut_bits(inPixels, numPixels, tmpPixels, num_bits, num_bits, num_bits);
-    weightsPtr = calc_color_table(tmpPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, &num_points);
-    inputPixelsAllocated = true;
-    inputPixels = new uint32_t[num_points];
-    memcpy(inputPixels, tmpPixels, num_points * sizeof(uint32_t));
+    if (integerWeights) {
+      countsPtr = calc_color_counts(tmpPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, histogram_threads, &num_points);
+    } else {
+      weightsPtr = calc_color_table_threads(tmpPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, histogram_threads, &num_points);
+    }
+    if (inplace) {
+      inputPixels = tmpPixels;
+    } else {
+      inputPixelsAllocated = true;
+      inputPixels = new uint32_t[num_points];
+      memcpy(inputPixels, tmpPixels, num_points * sizeof(uint32_t));
+    }
   }
   
-  if (weightsPtr == nullptr) {
-    // Uniform weight
+  DivQuantPackedPoints points = { inputPixels };
+  DivQuantPackedPoints tmp_points = { tmpPixels };
+  
+  // With 5 bits or less per component the points can be packed in 16 bits
+  const bool compactPoints = (options != nullptr) && options->compact_points && num_bits <= 5 && (weightsPtr != nullptr || countsPtr != nullptr);
+  
+  if (compactPoints) {
+    DivQuantPacked16Points points16 = DivQuantPacked16Points::alloc(num_points);
+    points16.pack(0, inputPixels, num_points);
     
-    if (num_colors <= 256) {
-      // Uniform weight and each cluster int fits in one byte
-      
-      DivQuantCluster<true, uint8_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
+    // The inplace partition logic reorders the points directly
+    DivQuantPacked16Points tmp_points16 = inplace ? points16 : DivQuantPacked16Points::alloc(num_points);
+    
+    if (countsPtr != nullptr) {
+      DivQuantClusterMember<false, DivQuantPacked16Points, uint32_t>(num_points, points16, tmp_points16, weightUniform, countsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, options);
     } else {
-      // Uniform weight where each cluster fits in a word
-
-      DivQuantCluster<true, uint32_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
+      DivQuantClusterMember<false, DivQuantPacked16Points, double>(num_points, points16, tmp_points16, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+    }
+    
+    if (!inplace) {
+      tmp_points16.release();
     }
+    points16.release();
+  } else if (countsPtr != nullptr) {
+    // Pixel count weights
+    
+    DivQuantClusterMember<false, DivQuantPackedPoints, uint32_t>(num_points, points, tmp_points, weightUniform, countsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+  } else if (weightsPtr == nullptr) {
+    // Uniform weight
+    
+    DivQuantClusterMember<true, DivQuantPackedPoints, double>(num_points, points, tmp_points, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, options);
   } else {
     // Non-uniform weights (num clusters unrestrained)
     
-    if (num_colors <= 256) {
-      DivQuantCluster<false, uint8_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
-    } else {
-      DivQuantCluster<false, uint32_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
-    }
+    DivQuantClusterMember<false, DivQuantPackedPoints, double>(num_points, points, tmp_points, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, options);
   }
   
   if (weightsPtr != nullptr) {
     delete [] weightsPtr;
   }
   
+  if (countsPtr != nullptr) {
+    delete [] countsPtr;
+  }
+  
   if (inputPixelsAllocated) {
     delete [] inputPixels;
   }
@@ -1178,3 +3629,127 @@ quant_varpart_fast (
   return;
 }
 
+// Cluster numPoints unique 24 bit points with a weight for each point, for
+// callers that have already counted the colors (with a Shared_Histogram for
+// example). weights is either NULL when each point has the same weight or one
+// weight for each point, the weights must add up to 1.0. When
+// options->inplace_partition is set the points are reordered (along with
+// the weights) as the clusters are split, so no copy of the points is made.
+// With options->compact_points and num_bits <= 5 the points (which must then
+// have components less than 32) are clustered as a 16 bit copy.
+
+void
+quant_varpart_weighted (
+                        const uint32_t numPoints,
+                        uint32_t *points,
+                        double *weights,
+                        uint32_t *numClustersPtr,
+                        uint32_t *colortablePtr,
+                        const int num_bits,
+                        const int max_iters,
+                        const Quant_Options *options)
+{
+  if ( !validate_num_bits ( num_bits ) )
+  {
+    assert(0);
+  }
+  
+  const int num_points = numPoints;
+  
+  const bool inplace = (options != nullptr) && options->inplace_partition;
+  
+  // With 5 bits or less per component the points can be packed in 16 bits
+  const bool compactPoints = (options != nullptr) && options->compact_points && num_bits <= 5 && weights != nullptr;
+  
+  DivQuantPackedPoints packed_points = { points };
+  DivQuantPackedPoints tmp_points = packed_points;
+  
+  if (!inplace && !compactPoints) {
+    // Holds the cluster to be split, the points are not modified
+    tmp_points = DivQuantPackedPoints::alloc(num_points);
+  }
+  
+  const double weightUniform = 1.0 / num_points;
+  
+  if (compactPoints) {
+    DivQuantPacked16Points points16 = DivQuantPacked16Points::alloc(num_points);
+    points16.pack(0, points, num_points);
+    
+    DivQuantPacked16Points tmp_points16 = inplace ? points16 : DivQuantPacked16Points::alloc(num_points);
+    
+    DivQuantClusterMember<false, DivQuantPacked16Points, double>(num_points, points16, tmp_points16, 0.0, weights, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+    
+    if (inplace) {
+      // The points are reordered along with the weights
+      for ( int ip = 0; ip < num_points; ip++ ) {
+        points[ip] = (points16.red(ip) << 16) | (points16.green(ip) << 8) | points16.blue(ip);
+      }
+    } else {
+      tmp_points16.release();
+    }
+    points16.release();
+  } else if (weights == nullptr) {
+    DivQuantClusterMember<true, DivQuantPackedPoints, double>(num_points, packed_points, tmp_points, weightUniform, weights, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+  } else {
+    DivQuantClusterMember<false, DivQuantPackedPoints, double>(num_points, packed_points, tmp_points, 0.0, weights, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+  }
+  
+  if (!inplace && !compactPoints) {
+    tmp_points.release();
+  }
+  
+  return;
+}
+
+// Cluster numPoints points stored as separate R, G, B planes, for callers
+// that already have planar data (a video decoder for example). The points
+// are not deduplicated, so weights is either NULL when each point has the
+// same weight or a weight plane with one weight for each point, the
+// weights must add up to 1.0. When options->inplace_partition is set the
+// points are reordered in the planes (along with the weights) as the
+// clusters are split, so no copy of the points is made.
+
+void
+quant_varpart_planar (
+                      const uint32_t numPoints,
+                      uint8_t *redPlane,
+                      uint8_t *greenPlane,
+                      uint8_t *bluePlane,
+                      double *weights,
+                      uint32_t *numClustersPtr,
+                      uint32_t *colortablePtr,
+                      const int num_bits,
+                      const int max_iters,
+                      const Quant_Options *options)
+{
+  if ( !validate_num_bits ( num_bits ) )
+  {
+    assert(0);
+  }
+  
+  const int num_points = numPoints;
+  
+  const bool inplace = (options != nullptr) && options->inplace_partition;
+  
+  DivQuantPlanarPoints points = { redPlane, greenPlane, bluePlane };
+  DivQuantPlanarPoints tmp_points = points;
+  
+  if (!inplace) {
+    // Holds the cluster to be split, the planes are not modified
+    tmp_points = DivQuantPlanarPoints::alloc(num_points);
+  }
+  
+  const double weightUniform = 1.0 / num_points;
+  
+  if (weights == nullptr) {
+    DivQuantClusterMember<true, DivQuantPlanarPoints, double>(num_points, points, tmp_points, weightUniform, weights, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+  } else {
+    DivQuantClusterMember<false, DivQuantPlanarPoints, double>(num_points, points, tmp_points, 0.0, weights, num_bits, max_iters, colortablePtr, numClustersPtr, options);
+  }
+  
+  if (!inplace) {
+    tmp_points.release();
+  }
+  
+  return;
+}
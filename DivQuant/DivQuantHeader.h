@@ -49,6 +49,36 @@ typedef struct
  double weight;
 } Pixel_Double; /**< (Double) Pixel */
 
+// Optional settings that select alternative implementations of the
+// clustering logic. A zero filled struct selects the original behavior.
+
+typedef struct
+{
+ int inplace_partition; /* keep each cluster as a contiguous range of points */
+ int num_threads; /* threads used to split large clusters, 0 or 1 means 1 thread */
+ int thread_min_points; /* min points in a cluster split with threads, 0 means default */
+ int split_tasks; /* split clusters smaller than thread_min_points at the same time (inplace only) */
+ int simd; /* max DIVQUANT_SIMD_* level used by the kernels, 0 means detect */
+ int fixed_point_lkm; /* local k-means hyperplane test in fixed point integer math */
+ int histogram_split; /* cut at the min squared error position of a 256 bin histogram */
+ int lkm_converge; /* stop local k-means once C2 keeps its size and the means move at most lkm_tolerance */
+ double lkm_tolerance; /* max movement of each mean component, 0 stops only when the means do not change */
+ int lkm_band; /* local k-means iterations only test the points near the hyperplane again */
+ int lkm_sample_size; /* local k-means iterations before the last run on a sample of this many points of larger clusters, 0 means all points */
+ int parallel_histogram; /* count the colors of the input pixels with num_threads threads */
+ int integer_weights; /* weight the deduplicated colors with their uint32_t pixel counts instead of doubles */
+ int compact_points; /* store the points in 16 bits (5-5-5) when num_bits <= 5 */
+ int wide_member; /* use 4 byte cluster memberships for more than 256 clusters instead of 2 bytes up to 65536 */
+ int *lkm_iters; /* when not NULL, receives the local k-means iterations run by each of the num clusters - 1 splits */
+} Quant_Options;
+
+// SIMD levels, in increasing order
+
+#define DIVQUANT_SIMD_DETECT 0
+#define DIVQUANT_SIMD_SCALAR 1
+#define DIVQUANT_SIMD_SSE2 2
+#define DIVQUANT_SIMD_AVX2 3
+
 clock_t start_timer ( void );
 double stop_timer ( const clock_t );
 
@@ -60,7 +90,24 @@ get_double_scale(const uint32_t *inPixels,
 
 long timediff(clock_t t1, clock_t t2);
 
-void map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, uint32_t *outColortablePtr, int colormapSize );
+void map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *outColortablePtr, int colormapSize );
+
+// Optional settings that select alternative implementations of the color
+// mapping logic. A zero filled struct (or NULL) selects a SIMD brute force
+// search for small palettes, a k-d tree for large palettes and otherwise
+// map_colors_mps, and searches each unique color once when the pixels repeat
+// colors. Each alternative maps a pixel to the same palette entry.
+
+typedef struct
+{
+ int cell_cache; /* search the candidate entries of a lazily built 32x32x32 grid of RGB cells */
+ int kd_tree; /* 1 always and -1 never search a k-d tree of the palette, 0 selects it by the palette size and spread */
+ int simd; /* max DIVQUANT_SIMD_* level of the brute force search of small palettes, 0 means detect and DIVQUANT_SIMD_SCALAR disables it */
+ int num_threads; /* threads that map ranges of the pixels, 0 or 1 means 1 thread */
+ int memoize; /* 1 always and -1 never search each unique color once and map the pixels with a table, 0 selects it by the ratio of unique colors to pixels */
+} Map_Options;
+
+void map_colors ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int colormapSize, const Map_Options *options );
 
 double *
 calc_color_table ( const uint32_t *inPixels,
@@ -71,6 +118,68 @@ calc_color_table ( const uint32_t *inPixels,
                   const int dec_factor,
                   int *num_colors );
 
+double *
+calc_color_table_threads ( const uint32_t *inPixels,
+                          const uint32_t numPixels,
+                          uint32_t *outPixels,
+                          const uint32_t numRows,
+                          const uint32_t numCols,
+                          const int dec_factor,
+                          const int num_threads,
+                          int *num_colors );
+
+uint32_t *
+calc_color_counts ( const uint32_t *inPixels,
+                   const uint32_t numPixels,
+                   uint32_t *outPixels,
+                   const uint32_t numRows,
+                   const uint32_t numCols,
+                   const int dec_factor,
+                   const int num_threads,
+                   int *num_colors );
+
+uint32_t *
+calc_cut_color_counts ( const uint32_t *inPixels,
+                       const uint32_t numPixels,
+                       uint32_t *outPixels,
+                       const uint32_t numRows,
+                       const uint32_t numCols,
+                       const int dec_factor,
+                       const int num_bits,
+                       const int simd_level,
+                       int *num_colors );
+
+double *
+calc_cut_color_table ( const uint32_t *inPixels,
+                      const uint32_t numPixels,
+                      uint32_t *outPixels,
+                      const uint32_t numRows,
+                      const uint32_t numCols,
+                      const int dec_factor,
+                      const int num_bits,
+                      const int simd_level,
+                      int *num_colors );
+
+// A color histogram that many threads can add pixels to at the same time
+
+typedef struct Shared_Histogram Shared_Histogram;
+
+Shared_Histogram *
+shared_histogram_alloc ( const int unique_only );
+
+void
+shared_histogram_free ( Shared_Histogram *histogram );
+
+void
+shared_histogram_add ( Shared_Histogram *histogram,
+                      const uint32_t *pixels,
+                      const uint32_t numPixels );
+
+double *
+shared_histogram_color_table ( const Shared_Histogram *histogram,
+                              uint32_t *outPixels,
+                              int *num_colors );
+
 void
 cut_bits ( const uint32_t *inPixels,
           const uint32_t numPixels,
@@ -91,8 +200,161 @@ quant_varpart_fast (
                     const int num_bits,
                     const int dec_factor,
                     const int max_iters,
-                    const int allPixelsUnique);
+                    const int allPixelsUnique,
+                    const Quant_Options *options);
+
+void
+quant_varpart_weighted (
+                        const uint32_t numPoints,
+                        uint32_t *points,
+                        double *weights,
+                        uint32_t *numClustersPtr,
+                        uint32_t *colortablePtr,
+                        const int num_bits,
+                        const int max_iters,
+                        const Quant_Options *options);
+
+void
+quant_varpart_planar (
+                      const uint32_t numPoints,
+                      uint8_t *redPlane,
+                      uint8_t *greenPlane,
+                      uint8_t *bluePlane,
+                      double *weights,
+                      uint32_t *numClustersPtr,
+                      uint32_t *colortablePtr,
+                      const int num_bits,
+                      const int max_iters,
+                      const Quant_Options *options);
 
 int validate_num_bits ( const uchar );
 
+int DivQuantSimdLevel ( const int max_level );
+
+void
+DivQuantLkmSums ( const int simd_level,
+                 const uint32_t *pixels,
+                 const int num_points,
+                 const double lhs,
+                 const double rhs_red,
+                 const double rhs_green,
+                 const double rhs_blue,
+                 uint64_t *sums );
+
+int
+DivQuantLkmWeightedSums ( const int simd_level,
+                         const uint32_t *pixels,
+                         const double *weights,
+                         const int *point_index,
+                         const int num_points,
+                         const double lhs,
+                         const double rhs_red,
+                         const double rhs_green,
+                         const double rhs_blue,
+                         double *sums );
+
+void
+DivQuantLkmSumsPlanar ( const int simd_level,
+                       const uint8_t *red,
+                       const uint8_t *green,
+                       const uint8_t *blue,
+                       const int num_points,
+                       const double lhs,
+                       const double rhs_red,
+                       const double rhs_green,
+                       const double rhs_blue,
+                       uint64_t *sums );
+
+int
+DivQuantLkmWeightedSumsPlanar ( const int simd_level,
+                               const uint8_t *red,
+                               const uint8_t *green,
+                               const uint8_t *blue,
+                               const double *weights,
+                               const int *point_index,
+                               const int num_points,
+                               const double lhs,
+                               const double rhs_red,
+                               const double rhs_green,
+                               const double rhs_blue,
+                               double *sums );
+
+int
+DivQuantLkmCountSums ( const int simd_level,
+                      const uint32_t *pixels,
+                      const uint32_t *counts,
+                      const int *point_index,
+                      const int num_points,
+                      const double lhs,
+                      const double rhs_red,
+                      const double rhs_green,
+                      const double rhs_blue,
+                      uint64_t *sums );
+
+int
+DivQuantLkmCountSumsPlanar ( const int simd_level,
+                            const uint8_t *red,
+                            const uint8_t *green,
+                            const uint8_t *blue,
+                            const uint32_t *counts,
+                            const int *point_index,
+                            const int num_points,
+                            const double lhs,
+                            const double rhs_red,
+                            const double rhs_green,
+                            const double rhs_blue,
+                            uint64_t *sums );
+
+void
+DivQuantLkmSums16 ( const int simd_level,
+                   const uint16_t *pixels,
+                   const int num_points,
+                   const double lhs,
+                   const double rhs_red,
+                   const double rhs_green,
+                   const double rhs_blue,
+                   uint64_t *sums );
+
+int
+DivQuantLkmWeightedSums16 ( const int simd_level,
+                           const uint16_t *pixels,
+                           const double *weights,
+                           const int *point_index,
+                           const int num_points,
+                           const double lhs,
+                           const double rhs_red,
+                           const double rhs_green,
+                           const double rhs_blue,
+                           double *sums );
+
+int
+DivQuantLkmCountSums16 ( const int simd_level,
+                        const uint16_t *pixels,
+                        const uint32_t *counts,
+                        const int *point_index,
+                        const int num_points,
+                        const double lhs,
+                        const double rhs_red,
+                        const double rhs_green,
+                        const double rhs_blue,
+                        uint64_t *sums );
+
+void
+DivQuantCutBitsIndex ( const int simd_level,
+                      const uint32_t *pixels,
+                      const int num_pixels,
+                      const int num_bits,
+                      uint32_t *index );
+
+void
+DivQuantNearestColors ( const int simd_level,
+                       const uint32_t *pixels,
+                       const int num_pixels,
+                       const int16_t *red,
+                       const int16_t *green,
+                       const int16_t *blue,
+                       const int num_colors,
+                       const int *lut_init,
+                       uint32_t *out );
+
 #endif // DivQuantHeader_h
@@ -15,6 +15,8 @@
 
 #include "DivQuantHeader.h"
 
+#include "DivQuantThreadPool.h"
+
 #include <assert.h>
 
 #define L2_SQR( X1, Y1, Z1, X2, Y2, Z2 )\
@@ -52,32 +54,264 @@ check_mem ( const int x )
 
 /* dec_factor: decimation factor */
 
-#define HASH_SIZE 20023
+// The unique colors are counted with a direct table of 2^24 counts indexed
+// by the color when many pixels are sampled (and the memory is available),
+// otherwise with a flat open addressing hash table sized from the number of
+// sampled pixels. Both save the unique colors in the order they are first
+// seen, so the result does not depend on the table used.
 
-/* TODO: No need for the bitmasking in HASH */
+#define DIRECT_TABLE_SIZE ( 1 << 24 )
+#define DIRECT_TABLE_MIN_PIXELS ( 1 << 22 )
 
-#define HASH(R, G, B) ( ( ( ( long ) ( R ) * 33023 + \
-( long ) ( G ) * 30013 + \
-( long ) ( B ) * 27011 ) \
-& 0x7fffffff ) % HASH_SIZE )
+#define HASH_MIN_SIZE ( 1 << 12 )
 
-typedef struct Bucket_Entry* Bucket;
+typedef struct
+{
+  uint32_t color;
+  uint32_t index; /* index of the color + 1, 0 marks an empty entry */
+} Hash_Entry;
 
-struct Bucket_Entry
+static inline
+uint32_t
+hash_color ( const uint32_t color, const int hash_bits )
 {
-  int red;
-  int green;
-  int blue;
-  int value;
-  Bucket next;
-};
+  return ( color * 2654435761U ) >> ( 32 - hash_bits );
+}
+
+// Count the colors of the sampled pixels in a direct table. The unique colors
+// are written to outPixels, this is safe when outPixels is inPixels since the
+// index of a unique color is never larger than the index of the pixel it was
+// read from. Return the number of unique colors.
 
-typedef Bucket* Hash_Table;
+static
+int
+count_colors_direct ( const uint32_t *inPixels,
+                     uint32_t *outPixels,
+                     const uint32_t numRows,
+                     const uint32_t numCols,
+                     const int dec_factor,
+                     uint32_t *counts )
+{
+  int num_colors = 0;
+  
+  for ( uint32_t ir = 0; ir < numRows; ir += dec_factor )
+  {
+    const uint32_t *row = inPixels + ( ir * numCols );
+    
+    for ( uint32_t ic = 0; ic < numCols; ic += dec_factor )
+    {
+      uint32_t pixel = row[ic] & 0x00FFFFFF;
+      
+      if ( counts[pixel]++ == 0 )
+      {
+        outPixels[num_colors++] = pixel;
+      }
+    }
+  }
+  
+  return num_colors;
+}
+
+// Double the size of the hash table and insert each entry again
+
+static
+Hash_Entry *
+grow_hash_table ( Hash_Entry *hash_table, int *hash_bits )
+{
+  const uint32_t old_size = 1U << *hash_bits;
+  
+  (*hash_bits)++;
+  
+  const uint32_t size = 1U << *hash_bits;
+  const uint32_t mask = size - 1;
+  
+  Hash_Entry *new_table = ( Hash_Entry * ) calloc ( size, sizeof ( Hash_Entry ) );
+  check_mem ( new_table == NULL );
+  
+  for ( uint32_t ih = 0; ih < old_size; ih++ )
+  {
+    if ( hash_table[ih].index == 0 )
+    {
+      continue;
+    }
+    
+    uint32_t slot = hash_color ( hash_table[ih].color, *hash_bits );
+    
+    while ( new_table[slot].index != 0 )
+    {
+      slot = ( slot + 1 ) & mask;
+    }
+    
+    new_table[slot] = hash_table[ih];
+  }
+  
+  free ( hash_table );
+  
+  return new_table;
+}
+
+// Count the colors of the sampled pixels in a linear probing hash table that
+// is kept at most half full. The unique colors are written to outPixels as
+// in count_colors_direct and the count of each is written to counts.
+// Return the number of unique colors.
+
+static
+int
+count_colors_hashed ( const uint32_t *inPixels,
+                     uint32_t *outPixels,
+                     const uint32_t numRows,
+                     const uint32_t numCols,
+                     const int dec_factor,
+                     const uint32_t num_samples,
+                     uint32_t *counts )
+{
+  const uint32_t max_unique = ( num_samples < DIRECT_TABLE_SIZE ) ? num_samples : DIRECT_TABLE_SIZE;
+  
+  int hash_bits = 0;
+  
+  while ( ( 1U << hash_bits ) < HASH_MIN_SIZE || ( 1U << hash_bits ) < max_unique / 2 )
+  {
+    hash_bits++;
+  }
+  
+  Hash_Entry *hash_table = ( Hash_Entry * ) calloc ( 1U << hash_bits, sizeof ( Hash_Entry ) );
+  check_mem ( hash_table == NULL );
+  
+  uint32_t mask = ( 1U << hash_bits ) - 1;
+  int max_colors = ( 1 << hash_bits ) / 2;
+  
+  int num_colors = 0;
+  
+  for ( uint32_t ir = 0; ir < numRows; ir += dec_factor )
+  {
+    const uint32_t *row = inPixels + ( ir * numCols );
+    
+    for ( uint32_t ic = 0; ic < numCols; ic += dec_factor )
+    {
+      uint32_t pixel = row[ic] & 0x00FFFFFF;
+      uint32_t slot = hash_color ( pixel, hash_bits );
+      
+      /* Search for the color, an empty entry ends the search */
+      while ( hash_table[slot].index != 0 && hash_table[slot].color != pixel )
+      {
+        slot = ( slot + 1 ) & mask;
+      }
+      
+      if ( hash_table[slot].index != 0 )
+      {
+        /* This color exists in the hash table */
+        counts[hash_table[slot].index - 1]++;
+        continue;
+      }
+      
+      hash_table[slot].color = pixel;
+      hash_table[slot].index = num_colors + 1;
+      
+      outPixels[num_colors] = pixel;
+      counts[num_colors] = 1;
+      num_colors++;
+      
+      if ( num_colors > max_colors )
+      {
+        hash_table = grow_hash_table ( hash_table, &hash_bits );
+        mask = ( 1U << hash_bits ) - 1;
+        max_colors = ( 1 << hash_bits ) / 2;
+      }
+    }
+  }
+  
+  free ( hash_table );
+  
+  return num_colors;
+}
 
 // This method will dedup unique pixels and subsample pixels
 // based on dec_factor. When dec_factor is 1 then this method
 // would not do anything if the input is already unique, use
-// unique_colors_as_doubles() in that case.
+// unique_colors_as_doubles() in that case. outPixels can be
+// the same buffer as inPixels. Returns the count of each
+// unique color, allocated with new [].
+
+static
+uint32_t *
+count_color_table ( const uint32_t *inPixels,
+                   uint32_t *outPixels,
+                   const uint32_t numRows,
+                   const uint32_t numCols,
+                   const int dec_factor,
+                   int *num_colors )
+{
+  uint32_t *counts;
+  uint32_t *color_counts;
+  
+  const uint32_t num_samples = ( ( numRows + dec_factor - 1 ) / dec_factor ) * ( ( numCols + dec_factor - 1 ) / dec_factor );
+  
+  counts = NULL;
+  
+  if ( num_samples >= DIRECT_TABLE_MIN_PIXELS )
+  {
+    /* Fall back to the hash table when the direct table cannot be allocated */
+    counts = ( uint32_t * ) calloc ( DIRECT_TABLE_SIZE, sizeof ( uint32_t ) );
+  }
+  
+  if ( counts != NULL )
+  {
+    *num_colors = count_colors_direct ( inPixels, outPixels, numRows, numCols, dec_factor, counts );
+    
+    color_counts = new uint32_t[*num_colors];
+    check_mem ( color_counts == NULL );
+    
+    for ( int ic = 0; ic < *num_colors; ic++ )
+    {
+      color_counts[ic] = counts[outPixels[ic]];
+    }
+  }
+  else
+  {
+    const uint32_t max_unique = ( num_samples < DIRECT_TABLE_SIZE ) ? num_samples : DIRECT_TABLE_SIZE;
+    
+    counts = ( uint32_t * ) malloc ( max_unique * sizeof ( uint32_t ) );
+    check_mem ( counts == NULL );
+    
+    *num_colors = count_colors_hashed ( inPixels, outPixels, numRows, numCols, dec_factor, num_samples, counts );
+    
+    color_counts = new uint32_t[*num_colors];
+    check_mem ( color_counts == NULL );
+    
+    memcpy ( color_counts, counts, *num_colors * sizeof ( uint32_t ) );
+  }
+  
+  // printf ( "# colors = %d\n", *num_colors );
+  
+  free ( counts );
+  
+  return color_counts;
+}
+
+// Convert the counts of the sampled pixels to color probabilities
+
+static
+double *
+counts_to_weights ( const uint32_t *counts,
+                   const uint32_t numRows,
+                   const uint32_t numCols,
+                   const int dec_factor,
+                   const int num_colors )
+{
+  /* Normalization factor to obtain color frequencies to color probabilities */
+  /* norm_factor = ( dec_factor * dec_factor ) / ( double ) num_pixels; */
+  const double norm_factor =  1.0 / ( ceil ( numRows / ( double ) dec_factor ) * ceil ( numCols / ( double ) dec_factor ) );
+  
+  double *weights = new double[num_colors];
+  check_mem ( weights == NULL );
+  
+  for ( int ic = 0; ic < num_colors; ic++ )
+  {
+    weights[ic] = norm_factor * counts[ic];
+  }
+  
+  return weights;
+}
 
 double *
 calc_color_table ( const uint32_t *inPixels,
@@ -88,18 +322,6 @@ calc_color_table ( const uint32_t *inPixels,
                   const int dec_factor,
                   int *num_colors )
 {
-  int ih;
-  int ir, ic;
-  int hash;
-  int index;
-  int red, green, blue;
-  double norm_factor;
-  Bucket bucket;
-  Bucket temp_bucket;
-  Hash_Table hash_table;
-  double *weights;
-  uint32_t pixel;
-  
   if ( dec_factor <= 0 )
   {
     fprintf ( stderr, "Decimation factor ( %d ) should be positive !\n", dec_factor );
@@ -107,97 +329,595 @@ calc_color_table ( const uint32_t *inPixels,
     return NULL;
   }
   
-  hash_table = ( Hash_Table ) malloc ( HASH_SIZE * sizeof ( Bucket ) );
-  check_mem ( hash_table == NULL );
+  uint32_t *counts = count_color_table ( inPixels, outPixels, numRows, numCols, dec_factor, num_colors );
   
-  for ( ih = 0; ih < HASH_SIZE; ih++ )
+  double *weights = counts_to_weights ( counts, numRows, numCols, dec_factor, *num_colors );
+  
+  delete [] counts;
+  
+  return weights;
+}
+
+// Reduce the sampled pixels to num_bits per component as cut_bits does and
+// count the reduced colors in the same pass, so the pixels are only read
+// once and no reduced copy of the image is written. The reduced colors are
+// packed into a 3 * num_bits bit index with a SIMD kernel one block at a
+// time and counted in a direct table of 2^(3 * num_bits) entries. The
+// reduced colors are written to outPixels in the order they are first seen,
+// the same colors in the same order as cut_bits followed by
+// calc_color_table, and the count of each color is returned, allocated with
+// new []. outPixels can be the same buffer as inPixels.
+
+#define CUT_BLOCK_SIZE 256
+
+uint32_t *
+calc_cut_color_counts ( const uint32_t *inPixels,
+                       const uint32_t numPixels,
+                       uint32_t *outPixels,
+                       const uint32_t numRows,
+                       const uint32_t numCols,
+                       const int dec_factor,
+                       const int num_bits,
+                       const int simd_level,
+                       int *num_colors )
+{
+  if ( dec_factor <= 0 )
   {
-    hash_table[ih] = NULL;
+    fprintf ( stderr, "Decimation factor ( %d ) should be positive !\n", dec_factor );
+    
+    return NULL;
   }
   
+  if ( !validate_num_bits ( num_bits ) )
+  {
+    return NULL;
+  }
+  
+  const uint32_t mask = ( 1U << num_bits ) - 1;
+  
+  uint32_t *counts = ( uint32_t * ) calloc ( 1U << ( 3 * num_bits ), sizeof ( uint32_t ) );
+  check_mem ( counts == NULL );
+  
+  uint32_t samples[CUT_BLOCK_SIZE];
+  uint32_t index[CUT_BLOCK_SIZE];
+  
   *num_colors = 0;
   
-  for ( ir = 0; ir < numRows; ir += dec_factor )
+  for ( uint32_t ir = 0; ir < numRows; ir += dec_factor )
   {
-    for ( ic = 0; ic < numCols; ic += dec_factor )
+    const uint32_t *row = inPixels + ( ir * numCols );
+    
+    for ( uint32_t ic = 0; ic < numCols; ic += CUT_BLOCK_SIZE * dec_factor )
     {
-      pixel = inPixels[ic + (ir * numRows)];
-      blue = pixel & 0xFF;
-      green = (pixel >> 8) & 0xFF;
-      red = (pixel >> 16) & 0xFF;
+      const uint32_t *block = row + ic;
+      int block_size;
+      
+      if ( dec_factor == 1 )
+      {
+        block_size = ( numCols - ic < CUT_BLOCK_SIZE ) ? ( numCols - ic ) : CUT_BLOCK_SIZE;
+      }
+      else
+      {
+        /* Gather the sampled pixels of the block */
+        block_size = 0;
+        
+        for ( uint32_t is = ic; is < numCols && block_size < CUT_BLOCK_SIZE; is += dec_factor )
+        {
+          samples[block_size++] = row[is];
+        }
+        
+        block = samples;
+      }
       
-      /* Determine the bucket */
-      hash = HASH ( red, green, blue );
+      DivQuantCutBitsIndex ( simd_level, block, block_size, num_bits, index );
       
-      /* Search for the color in the bucket chain */
-      for ( bucket = hash_table[hash]; bucket != NULL; bucket = bucket->next )
+      /* All the pixels of the block have been read, so outPixels can be written */
+      for ( int ib = 0; ib < block_size; ib++ )
       {
-        if ( bucket->red == red && bucket->green == green && bucket->blue == blue )
+        const uint32_t color = index[ib];
+        
+        if ( counts[color]++ == 0 )
         {
-          /* This color exists in the hash table */
-          break;
+          outPixels[(*num_colors)++] = ( ( color >> ( 2 * num_bits ) ) << 16 ) | ( ( ( color >> num_bits ) & mask ) << 8 ) | ( color & mask );
         }
       }
+    }
+  }
+  
+  uint32_t *color_counts = new uint32_t[*num_colors];
+  check_mem ( color_counts == NULL );
+  
+  for ( int ic = 0; ic < *num_colors; ic++ )
+  {
+    const uint32_t pixel = outPixels[ic];
+    const uint32_t color = ( ( pixel >> 16 ) << ( 2 * num_bits ) ) | ( ( ( pixel >> 8 ) & 0xFF ) << num_bits ) | ( pixel & 0xFF );
+    
+    color_counts[ic] = counts[color];
+  }
+  
+  free ( counts );
+  
+  return color_counts;
+}
+
+double *
+calc_cut_color_table ( const uint32_t *inPixels,
+                      const uint32_t numPixels,
+                      uint32_t *outPixels,
+                      const uint32_t numRows,
+                      const uint32_t numCols,
+                      const int dec_factor,
+                      const int num_bits,
+                      const int simd_level,
+                      int *num_colors )
+{
+  uint32_t *counts = calc_cut_color_counts ( inPixels, numPixels, outPixels, numRows, numCols, dec_factor, num_bits, simd_level, num_colors );
+  
+  if ( counts == NULL )
+  {
+    return NULL;
+  }
+  
+  double *weights = counts_to_weights ( counts, numRows, numCols, dec_factor, *num_colors );
+  
+  delete [] counts;
+  
+  return weights;
+}
+
+// The parallel histogram divides the sampled rows into one band for each
+// thread. Each band counts its colors with its own hash table, the unique
+// colors of a band are in the order they are first seen in the band. The
+// band tables are then merged in parallel, each task merges the colors of
+// one hash partition over all the bands in band order. The count of a color
+// is added to its first band entry and its later band entries are marked
+// with a count of 0. Writing the band entries that are not marked in band
+// order then gives the same colors in the same order as calc_color_table.
+
+#define NUM_MERGE_PARTITIONS_PER_THREAD 4
+
+typedef struct
+{
+  uint32_t first_row; /* first row of the band in the input */
+  uint32_t num_rows;
+  uint32_t *colors; /* unique colors of the band in the order first seen */
+  uint32_t *counts;
+  int num_colors;
+  std::vector<int> partition_start; /* band entries of each partition */
+  std::vector<int> partition_index;
+  int out_offset; /* index of the first color of this band in outPixels */
+} Histogram_Band;
+
+typedef struct
+{
+  uint32_t color;
+  uint32_t *count; /* count of the first band entry, NULL marks an empty entry */
+} Merge_Entry;
+
+static inline
+int
+color_partition ( const uint32_t color, const int num_partitions )
+{
+  return (int) ( ( ( color * 2246822519U ) >> 16 ) % num_partitions );
+}
+
+// Merge the band entries of one partition
+
+static
+void
+merge_histogram_partition ( std::vector<Histogram_Band> & bands, const int partition )
+{
+  uint32_t num_entries = 0;
+  
+  for ( Histogram_Band & band : bands )
+  {
+    num_entries += band.partition_start[partition + 1] - band.partition_start[partition];
+  }
+  
+  int hash_bits = 0;
+  
+  while ( ( 1U << hash_bits ) < HASH_MIN_SIZE || ( 1U << hash_bits ) < 2 * num_entries )
+  {
+    hash_bits++;
+  }
+  
+  const uint32_t mask = ( 1U << hash_bits ) - 1;
+  
+  Merge_Entry *hash_table = ( Merge_Entry * ) calloc ( 1U << hash_bits, sizeof ( Merge_Entry ) );
+  check_mem ( hash_table == NULL );
+  
+  for ( Histogram_Band & band : bands )
+  {
+    for ( int i = band.partition_start[partition]; i < band.partition_start[partition + 1]; i++ )
+    {
+      const int index = band.partition_index[i];
+      const uint32_t color = band.colors[index];
+      uint32_t slot = hash_color ( color, hash_bits );
       
-      if ( bucket != NULL )
+      while ( hash_table[slot].count != NULL && hash_table[slot].color != color )
       {
-        /* This color exists in the hash table */
-        bucket->value++;
+        slot = ( slot + 1 ) & mask;
+      }
+      
+      if ( hash_table[slot].count != NULL )
+      {
+        /* Seen in an earlier band */
+        *hash_table[slot].count += band.counts[index];
+        band.counts[index] = 0;
       }
       else
+      {
+        hash_table[slot].color = color;
+        hash_table[slot].count = &band.counts[index];
+      }
+    }
+  }
+  
+  free ( hash_table );
+}
+
+// Count the colors of the sampled pixels with num_threads threads, the
+// unique colors are written to outPixels in the same order as
+// calc_color_table and the count of each color is returned, allocated
+// with new []. The counts add up to the number of sampled pixels.
+
+uint32_t *
+calc_color_counts ( const uint32_t *inPixels,
+                   const uint32_t numPixels,
+                   uint32_t *outPixels,
+                   const uint32_t numRows,
+                   const uint32_t numCols,
+                   const int dec_factor,
+                   const int num_threads,
+                   int *num_colors )
+{
+  if ( dec_factor <= 0 )
+  {
+    fprintf ( stderr, "Decimation factor ( %d ) should be positive !\n", dec_factor );
+    
+    return NULL;
+  }
+  
+  if ( num_threads <= 1 )
+  {
+    return count_color_table ( inPixels, outPixels, numRows, numCols, dec_factor, num_colors );
+  }
+  
+  const uint32_t num_sampled_rows = ( numRows + dec_factor - 1 ) / dec_factor;
+  const uint32_t num_sampled_cols = ( numCols + dec_factor - 1 ) / dec_factor;
+  
+  const int num_bands = (int) ( ( num_sampled_rows < (uint32_t) num_threads ) ? num_sampled_rows : num_threads );
+  
+  if ( num_bands <= 1 )
+  {
+    return count_color_table ( inPixels, outPixels, numRows, numCols, dec_factor, num_colors );
+  }
+  
+  const int num_partitions = num_threads * NUM_MERGE_PARTITIONS_PER_THREAD;
+  
+  std::vector<Histogram_Band> bands(num_bands);
+  
+  for ( int ib = 0; ib < num_bands; ib++ )
+  {
+    uint32_t first = (uint32_t) ( ( (uint64_t) num_sampled_rows * ib ) / num_bands );
+    uint32_t last = (uint32_t) ( ( (uint64_t) num_sampled_rows * ( ib + 1 ) ) / num_bands );
+    bands[ib].first_row = first * dec_factor;
+    bands[ib].num_rows = ( last - first - 1 ) * dec_factor + 1;
+  }
+  
+  DivQuantThreadPool pool(num_threads);
+  
+  // Count the colors of each band and group the band entries by partition
+  
+  pool.parallel_for(num_bands, [&](int ib) {
+    Histogram_Band & band = bands[ib];
+    
+    const uint32_t num_samples = ( ( band.num_rows + dec_factor - 1 ) / dec_factor ) * num_sampled_cols;
+    const uint32_t max_unique = ( num_samples < DIRECT_TABLE_SIZE ) ? num_samples : DIRECT_TABLE_SIZE;
+    
+    band.colors = ( uint32_t * ) malloc ( max_unique * sizeof ( uint32_t ) );
+    check_mem ( band.colors == NULL );
+    band.counts = ( uint32_t * ) malloc ( max_unique * sizeof ( uint32_t ) );
+    check_mem ( band.counts == NULL );
+    
+    band.num_colors = count_colors_hashed ( inPixels + ( band.first_row * numCols ), band.colors, band.num_rows, numCols, dec_factor, num_samples, band.counts );
+    
+    band.partition_start.assign(num_partitions + 1, 0);
+    band.partition_index.resize(band.num_colors);
+    
+    for ( int i = 0; i < band.num_colors; i++ )
+    {
+      band.partition_start[color_partition ( band.colors[i], num_partitions ) + 1]++;
+    }
+    
+    for ( int ip = 0; ip < num_partitions; ip++ )
+    {
+      band.partition_start[ip + 1] += band.partition_start[ip];
+    }
+    
+    std::vector<int> next(band.partition_start.begin(), band.partition_start.end() - 1);
+    
+    for ( int i = 0; i < band.num_colors; i++ )
+    {
+      band.partition_index[next[color_partition ( band.colors[i], num_partitions )]++] = i;
+    }
+  });
+  
+  pool.parallel_for(num_partitions, [&](int ip) {
+    merge_histogram_partition ( bands, ip );
+  });
+  
+  // The first band entry of each color has a nonzero count
+  
+  *num_colors = 0;
+  
+  for ( Histogram_Band & band : bands )
+  {
+    band.out_offset = *num_colors;
+    
+    for ( int i = 0; i < band.num_colors; i++ )
+    {
+      if ( band.counts[i] != 0 )
       {
         (*num_colors)++;
-        
-        /* Create a new bucket entry for this color */
-        bucket = ( Bucket ) malloc ( sizeof ( struct Bucket_Entry ) );
-        check_mem ( bucket == NULL );
-        
-        bucket->red = red;
-        bucket->green = green;
-        bucket->blue = blue;
-        bucket->value = 1;
-        bucket->next = hash_table[hash];
-        hash_table[hash] = bucket;
       }
     }
   }
   
-  // printf ( "# colors = %d\n", num_colors );
+  uint32_t *counts = new uint32_t[*num_colors];
+  check_mem ( counts == NULL );
   
-  weights = new double[*num_colors];
-  check_mem ( weights == NULL );
+  // All the input pixels have been read, so outPixels can now be written
+  // even when it is inPixels
   
-  /* Normalization factor to obtain color frequencies to color probabilities */
-  /* norm_factor = ( dec_factor * dec_factor ) / ( double ) num_pixels; */
-  norm_factor =  1.0 / ( ceil ( numRows / ( double ) dec_factor ) * ceil ( numCols / ( double ) dec_factor ) );
+  pool.parallel_for(num_bands, [&](int ib) {
+    Histogram_Band & band = bands[ib];
+    int out = band.out_offset;
+    
+    for ( int i = 0; i < band.num_colors; i++ )
+    {
+      if ( band.counts[i] != 0 )
+      {
+        outPixels[out] = band.colors[i];
+        counts[out] = band.counts[i];
+        out++;
+      }
+    }
+    
+    free ( band.colors );
+    free ( band.counts );
+  });
   
-  index = 0;
-  for ( hash = 0; hash < HASH_SIZE; hash++ )
+  return counts;
+}
+
+double *
+calc_color_table_threads ( const uint32_t *inPixels,
+                          const uint32_t numPixels,
+                          uint32_t *outPixels,
+                          const uint32_t numRows,
+                          const uint32_t numCols,
+                          const int dec_factor,
+                          const int num_threads,
+                          int *num_colors )
+{
+  uint32_t *counts = calc_color_counts ( inPixels, numPixels, outPixels, numRows, numCols, dec_factor, num_threads, num_colors );
+  
+  if ( counts == NULL )
   {
-    for ( bucket = hash_table[hash]; bucket != NULL; )
+    return NULL;
+  }
+  
+  double *weights = counts_to_weights ( counts, numRows, numCols, dec_factor, *num_colors );
+  
+  delete [] counts;
+  
+  return weights;
+}
+
+// A histogram of 24 bit colors that many threads can add pixels to at the
+// same time without locks. Each color has an atomic count, or only an atomic
+// presence bit when unique_only is set (2 MB instead of 64 MB). A run of the
+// same color in the pixels of one call is counted with one atomic add, so a
+// color that fills a large area does not make every thread contend for the
+// same count. The tables are allocated with calloc so that the pages of
+// colors that are never seen are not touched. The counts also have a bit for
+// each block of 2^SHARED_BLOCK_BITS colors that is set when a color of the
+// block is first counted, so blocks that were never touched are not read.
+
+#define SHARED_BLOCK_BITS 10
+#define SHARED_NUM_BLOCKS ( DIRECT_TABLE_SIZE >> SHARED_BLOCK_BITS )
+
+struct Shared_Histogram
+{
+  int unique_only;
+  std::atomic<uint32_t> *counts;
+  std::atomic<uint64_t> *present;
+  std::atomic<uint64_t> *touched; /* one bit for each block of counts */
+};
+
+static inline
+void
+set_shared_bit ( std::atomic<uint64_t> *bits, const uint32_t index )
+{
+  /* Only write the word when the bit is not set yet */
+  const uint64_t bit = 1ULL << ( index & 63 );
+  
+  if ( ( bits[index >> 6].load ( std::memory_order_relaxed ) & bit ) == 0 )
+  {
+    bits[index >> 6].fetch_or ( bit, std::memory_order_relaxed );
+  }
+}
+
+static_assert ( sizeof ( std::atomic<uint32_t> ) == sizeof ( uint32_t ), "atomic counts must have the size of a count" );
+static_assert ( sizeof ( std::atomic<uint64_t> ) == sizeof ( uint64_t ), "atomic presence words must have the size of a word" );
+
+Shared_Histogram *
+shared_histogram_alloc ( const int unique_only )
+{
+  Shared_Histogram *histogram = new Shared_Histogram;
+  check_mem ( histogram == NULL );
+  
+  histogram->unique_only = unique_only;
+  histogram->counts = NULL;
+  histogram->present = NULL;
+  histogram->touched = NULL;
+  
+  if ( unique_only )
+  {
+    histogram->present = ( std::atomic<uint64_t> * ) calloc ( DIRECT_TABLE_SIZE / 64, sizeof ( uint64_t ) );
+    check_mem ( histogram->present == NULL );
+  }
+  else
+  {
+    histogram->counts = ( std::atomic<uint32_t> * ) calloc ( DIRECT_TABLE_SIZE, sizeof ( uint32_t ) );
+    check_mem ( histogram->counts == NULL );
+    histogram->touched = ( std::atomic<uint64_t> * ) calloc ( SHARED_NUM_BLOCKS / 64, sizeof ( uint64_t ) );
+    check_mem ( histogram->touched == NULL );
+  }
+  
+  return histogram;
+}
+
+void
+shared_histogram_free ( Shared_Histogram *histogram )
+{
+  free ( histogram->counts );
+  free ( histogram->present );
+  free ( histogram->touched );
+  delete histogram;
+}
+
+// Add numPixels pixels (the alpha channel is ignored), this can be invoked
+// from any number of threads at the same time
+
+void
+shared_histogram_add ( Shared_Histogram *histogram,
+                      const uint32_t *pixels,
+                      const uint32_t numPixels )
+{
+  if ( numPixels == 0 )
+  {
+    return;
+  }
+  
+  if ( histogram->unique_only )
+  {
+    std::atomic<uint64_t> *present = histogram->present;
+    uint32_t prev_color = pixels[0] & 0x00FFFFFF;
+    
+    for ( uint32_t i = 0; i < numPixels; i++ )
     {
-      uint32_t B = bucket->blue;
-      uint32_t G = bucket->green;
-      uint32_t R = bucket->red;
-      uint32_t pixel = (R << 16) | (G << 8) | B;
-      outPixels[index] = pixel;
+      uint32_t color = pixels[i] & 0x00FFFFFF;
       
-      weights[index] = norm_factor * bucket->value;
+      if ( i > 0 && color == prev_color )
+      {
+        continue;
+      }
       
-      index++;
+      prev_color = color;
       
-      // Save the current bucket pointer
-      temp_bucket = bucket;
+      set_shared_bit ( present, color );
+    }
+  }
+  else
+  {
+    std::atomic<uint32_t> *counts = histogram->counts;
+    std::atomic<uint64_t> *touched = histogram->touched;
+    uint32_t run_color = pixels[0] & 0x00FFFFFF;
+    uint32_t run_length = 1;
+    
+    for ( uint32_t i = 1; i < numPixels; i++ )
+    {
+      uint32_t color = pixels[i] & 0x00FFFFFF;
       
-      // Advance to the next bucket
-      bucket = bucket->next;
+      if ( color == run_color )
+      {
+        run_length++;
+        continue;
+      }
       
-      // Free the current bucket
-      free ( temp_bucket );
+      if ( counts[run_color].fetch_add ( run_length, std::memory_order_relaxed ) == 0 )
+      {
+        set_shared_bit ( touched, run_color >> SHARED_BLOCK_BITS );
+      }
+      
+      run_color = color;
+      run_length = 1;
+    }
+    
+    if ( counts[run_color].fetch_add ( run_length, std::memory_order_relaxed ) == 0 )
+    {
+      set_shared_bit ( touched, run_color >> SHARED_BLOCK_BITS );
     }
   }
+}
+
+// Write the unique colors added to the histogram to outPixels in increasing
+// order and return the weight of each color (the count of the color divided
+// by the number of pixels), or NULL when the histogram is unique_only.
+// outPixels must have room for the number of pixels added or 2^24 colors,
+// whichever is smaller. All the threads adding pixels must have completed.
+
+double *
+shared_histogram_color_table ( const Shared_Histogram *histogram,
+                              uint32_t *outPixels,
+                              int *num_colors )
+{
+  *num_colors = 0;
   
-  free ( hash_table );
+  if ( histogram->unique_only )
+  {
+    const std::atomic<uint64_t> *present = histogram->present;
+    
+    for ( uint32_t iw = 0; iw < DIRECT_TABLE_SIZE / 64; iw++ )
+    {
+      uint64_t word = present[iw].load ( std::memory_order_relaxed );
+      
+      while ( word != 0 )
+      {
+        const uint32_t bit = __builtin_ctzll ( word );
+        outPixels[(*num_colors)++] = ( iw << 6 ) | bit;
+        word &= word - 1;
+      }
+    }
+    
+    return NULL;
+  }
+  
+  const std::atomic<uint32_t> *counts = histogram->counts;
+  uint64_t num_pixels = 0;
+  
+  for ( uint32_t block = 0; block < SHARED_NUM_BLOCKS; block++ )
+  {
+    if ( ( histogram->touched[block >> 6].load ( std::memory_order_relaxed ) & ( 1ULL << ( block & 63 ) ) ) == 0 )
+    {
+      continue;
+    }
+    
+    const uint32_t first = block << SHARED_BLOCK_BITS;
+    
+    for ( uint32_t color = first; color < first + ( 1 << SHARED_BLOCK_BITS ); color++ )
+    {
+      const uint32_t count = counts[color].load ( std::memory_order_relaxed );
+      
+      if ( count != 0 )
+      {
+        outPixels[(*num_colors)++] = color;
+        num_pixels += count;
+      }
+    }
+  }
+  
+  double *weights = new double[*num_colors];
+  check_mem ( weights == NULL );
+  
+  const double norm_factor = 1.0 / ( double ) num_pixels;
+  
+  for ( int ic = 0; ic < *num_colors; ic++ )
+  {
+    weights[ic] = norm_factor * counts[outPixels[ic]].load ( std::memory_order_relaxed );
+  }
   
   return weights;
 }
@@ -240,22 +960,28 @@ sort_color ( Pixel_Int *cmap, const int num_colors )
 //#define SEARCH_DEBUG
 //#define SEARCH_DEBUG_SORT
 
-void
-map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, uint32_t *outColortablePtr, int colormapSize )
+// The palette sorted by the sum of the color components and the lookup
+// tables used to start and stop the search, these are only read while the
+// pixels are mapped.
+
+typedef struct
+{
+  Pixel_Int *cmap;
+  int num_colors;
+  int *lut_init;
+  int *lut_ssd_buffer;
+  int *lut_ssd;
+} Mps_Table;
+
+static void
+mps_table_alloc ( const uint32_t *colortablePtr, int colormapSize, Mps_Table *table )
 {
   int ik, ic;
-  int index;
   int low, high;
-  int dist;
-  int min_dist;
-  int red, green, blue;
-  int sum;
   int size_lut_init = 3 * MAX_RGB + 1;
   int max_sum = 3 * MAX_RGB;
   int *lut_init;
   Pixel_Int *cmap;
-  int up, upi, down, downi;
-  uint32_t B, G, R, pixel;
   int *lut_ssd_buffer;
   int *lut_ssd;
   int size_lut_ssd;
@@ -268,7 +994,7 @@ map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outP
   
   cmap = ( Pixel_Int * ) malloc ( num_colors * sizeof ( Pixel_Int ) );
   for (int i = 0; i < num_colors; i++) {
-    uint32_t pixel = outColortablePtr[i];
+    uint32_t pixel = colortablePtr[i];
     Pixel_Int *pi = &cmap[i];
     pi->blue = pixel & 0xFF;
     pi->green = (pixel >> 8) & 0xFF;
@@ -362,27 +1088,101 @@ map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outP
     //   printf("lut_init[%3d] (high) = %d\n", ik, lut_init[ik]);
   }
   
-  for ( ic = 1; ic < num_colors - 1; ic++ )
-  {
-#if defined(DEBUG)
-    assert(((ic - 1) >= 0) && ((ic - 1) < num_colors));
-    assert((ic >= 0) && (ic < num_colors));
-    assert(((ic + 1) >= 0) && ((ic + 1) < num_colors));
-#endif // DEBUG
-    
-    low = ( int ) ( 0.5 * ( cmap[ic - 1].weight + cmap[ic].weight ) + 0.5 );  // round
-    high = ( int ) ( 0.5 * ( cmap[ic].weight + cmap[ic + 1].weight ) + 0.5 ); // round
-    
-    for ( ik = low; ik < high; ik++ )
-    {
+  for ( ic = 1; ic < num_colors - 1; ic++ )
+  {
+#if defined(DEBUG)
+    assert(((ic - 1) >= 0) && ((ic - 1) < num_colors));
+    assert((ic >= 0) && (ic < num_colors));
+    assert(((ic + 1) >= 0) && ((ic + 1) < num_colors));
+#endif // DEBUG
+    
+    low = ( int ) ( 0.5 * ( cmap[ic - 1].weight + cmap[ic].weight ) + 0.5 );  // round
+    high = ( int ) ( 0.5 * ( cmap[ic].weight + cmap[ic + 1].weight ) + 0.5 ); // round
+    
+    for ( ik = low; ik < high; ik++ )
+    {
+#if defined(DEBUG)
+      assert((ik >= 0) && (ik < size_lut_init));
+#endif // DEBUG
+      lut_init[ik] = ic;
+    }
+  }
+  
+  table->cmap = cmap;
+  table->num_colors = num_colors;
+  table->lut_init = lut_init;
+  table->lut_ssd_buffer = lut_ssd_buffer;
+  table->lut_ssd = lut_ssd;
+}
+
+static void
+mps_table_free ( Mps_Table *table )
+{
+  free ( table->lut_init );
+  free ( table->lut_ssd_buffer );
+  free ( table->cmap );
+}
+
+// The pixels are mapped in ranges of MAP_RANGE_PIXELS pixels, the ranges
+// after the first start at a 64 byte boundary of the output, so threads do
+// not write to the same cache line.
+
+#define MAP_RANGE_PIXELS ( 1 << 16 )
+#define MAP_CACHE_LINE ( 64 )
+
+// Invoke map_range ( begin, end ) for ranges that cover [0, numPixels) on
+// num_threads threads, each range holds at least range_pixels pixels.
+
+static void
+map_pixel_ranges ( uint32_t numPixels, const uint32_t *outPixelsPtr, const int num_threads, uint32_t range_pixels,
+                  const std::function<void(uint32_t, uint32_t)> & map_range )
+{
+  const uint32_t line_pixels = MAP_CACHE_LINE / sizeof ( uint32_t );
+  
+  range_pixels = ( ( range_pixels + line_pixels - 1 ) / line_pixels ) * line_pixels;
+  
+  if ( num_threads <= 1 || numPixels <= range_pixels + line_pixels ) {
+    map_range ( 0, numPixels );
+    return;
+  }
+  
+  const uint32_t head = ( uint32_t ) ( ( MAP_CACHE_LINE - ( ( uintptr_t ) outPixelsPtr % MAP_CACHE_LINE ) ) % MAP_CACHE_LINE ) / sizeof ( uint32_t );
+  const int num_ranges = ( int ) ( ( numPixels - head + range_pixels - 1 ) / range_pixels );
+  
+  DivQuantThreadPool pool ( num_threads );
+  
+  pool.parallel_for ( num_ranges, [&](int ir) {
+    const uint32_t begin = ( ir == 0 ) ? 0 : ( head + ir * range_pixels );
+    const uint32_t end = std::min ( numPixels, head + ( ir + 1 ) * range_pixels );
+    map_range ( begin, end );
+  });
+}
+
+// Map the pixels in [begin, end) with the sum sorted search of the table
+
+static void
+mps_map_range ( const Mps_Table *table, const uint32_t *inPixelsPtr, uint32_t begin, uint32_t end, uint32_t *outPixelsPtr )
+{
+  uint32_t ik;
+  int index;
+  int dist;
+  int min_dist;
+  int red, green, blue;
+  int sum;
 #if defined(DEBUG)
-      assert((ik >= 0) && (ik < size_lut_init));
+  int size_lut_init = 3 * MAX_RGB + 1;
+  int max_sum = 3 * MAX_RGB;
+  int size_lut_ssd = 2 * max_sum + 1;
 #endif // DEBUG
-      lut_init[ik] = ic;
-    }
-  }
+  int up, upi, down, downi;
+  uint32_t B, G, R, pixel;
+  
+  const Pixel_Int *cmap = table->cmap;
+  const int num_colors = table->num_colors;
+  const int *lut_init = table->lut_init;
+  const int *lut_ssd = table->lut_ssd;
   
-  for ( ik = 0; ik < numPixels; ik++ )
+  for ( ik = begin; ik < end; ik++ )
   {
     pixel = inPixelsPtr[ik];
     blue = pixel & 0xFF;
@@ -530,10 +1330,594 @@ map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outP
     printf("L2 search finished on index %3d : pixel 0x%08X : (%d %d %d) and min_dist %d\n", index, pixel, R, G, B, min_dist);
 #endif // SEARCH_DEBUG
   }
+}
+
+void
+map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *outColortablePtr, int colormapSize )
+{
+  Mps_Table table;
+  mps_table_alloc ( outColortablePtr, colormapSize, &table );
   
-  free ( lut_init );
-  free ( lut_ssd_buffer );
-  free ( cmap );
+  mps_map_range ( &table, inPixelsPtr, 0, numPixels, outPixelsPtr );
+  
+  mps_table_free ( &table );
   
   return;
 }
+
+// Map the pixels with the sum sorted search of map_colors_mps on num_threads
+// threads, the table is built once and only read by the threads.
+
+static void
+map_colors_mps_threads ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int colormapSize, const int num_threads )
+{
+  Mps_Table table;
+  mps_table_alloc ( colortablePtr, colormapSize, &table );
+  
+  map_pixel_ranges ( numPixels, outPixelsPtr, num_threads, MAP_RANGE_PIXELS, [&](uint32_t begin, uint32_t end) {
+    mps_map_range ( &table, inPixelsPtr, begin, end, outPixelsPtr );
+  });
+  
+  mps_table_free ( &table );
+}
+
+// The search of map_colors_mps visits the entries in the order start,
+// start + 1, start - 1, start + 2, start - 2 ... and only moves to a closer
+// entry, so of the entries at the min distance it returns the one that is
+// visited first.
+
+static inline int
+mps_visit_order ( const int index, const int start )
+{
+  return ( index > start ) ? ( 2 * ( index - start ) - 1 ) : ( 2 * ( start - index ) );
+}
+
+// Inverse colormap cells: the RGB cube is split into 32 x 32 x 32 cells of
+// 8 x 8 x 8 colors. The first pixel in a cell builds the list of palette
+// entries that can be the nearest entry of a color in the cell, these are
+// the entries with a min distance to the cell box that is not more than the
+// smallest max distance of any entry to the box. The list is sorted by the
+// min distance, so a pixel is done once the next min distance is more than
+// the distance to the best entry found.
+
+#define MAP_CELL_BITS 5
+#define MAP_CELL_SHIFT ( 8 - MAP_CELL_BITS )
+#define MAP_CELL_SIZE ( 1 << MAP_CELL_SHIFT )
+#define MAP_NUM_CELLS ( 1 << ( 3 * MAP_CELL_BITS ) )
+
+typedef struct
+{
+  int index;
+  int min_dist;
+} Map_Candidate;
+
+static inline
+bool asc_map_candidate(const Map_Candidate & a, const Map_Candidate & b) {
+  return ( a.min_dist < b.min_dist ) || ( a.min_dist == b.min_dist && a.index < b.index );
+}
+
+struct Map_Cells
+{
+  const Mps_Table *table;
+  std::vector<int> cell_first; // -1 until the cell is built
+  std::vector<int> cell_count;
+  std::vector<Map_Candidate> candidates;
+};
+
+static inline int
+box_min_delta ( const int value, const int low, const int high )
+{
+  return ( value < low ) ? ( low - value ) : ( ( value > high ) ? ( value - high ) : 0 );
+}
+
+static inline int
+box_max_delta ( const int value, const int low, const int high )
+{
+  return std::max ( value - low, high - value );
+}
+
+static void
+map_cells_build ( Map_Cells *cells, const int cell )
+{
+  const Pixel_Int *cmap = cells->table->cmap;
+  const int num_colors = cells->table->num_colors;
+  
+  const int mask = ( 1 << MAP_CELL_BITS ) - 1;
+  const int red0 = ( ( cell >> ( 2 * MAP_CELL_BITS ) ) & mask ) << MAP_CELL_SHIFT;
+  const int green0 = ( ( cell >> MAP_CELL_BITS ) & mask ) << MAP_CELL_SHIFT;
+  const int blue0 = ( cell & mask ) << MAP_CELL_SHIFT;
+  const int red1 = red0 + MAP_CELL_SIZE - 1;
+  const int green1 = green0 + MAP_CELL_SIZE - 1;
+  const int blue1 = blue0 + MAP_CELL_SIZE - 1;
+  
+  int min_max_dist = INT_MAX;
+  
+  for ( int ic = 0; ic < num_colors; ic++ ) {
+    const int dr = box_max_delta ( cmap[ic].red, red0, red1 );
+    const int dg = box_max_delta ( cmap[ic].green, green0, green1 );
+    const int db = box_max_delta ( cmap[ic].blue, blue0, blue1 );
+    min_max_dist = std::min ( min_max_dist, dr * dr + dg * dg + db * db );
+  }
+  
+  const int first = (int) cells->candidates.size();
+  
+  for ( int ic = 0; ic < num_colors; ic++ ) {
+    const int dr = box_min_delta ( cmap[ic].red, red0, red1 );
+    const int dg = box_min_delta ( cmap[ic].green, green0, green1 );
+    const int db = box_min_delta ( cmap[ic].blue, blue0, blue1 );
+    const int min_dist = dr * dr + dg * dg + db * db;
+    
+    if ( min_dist <= min_max_dist ) {
+      Map_Candidate candidate;
+      candidate.index = ic;
+      candidate.min_dist = min_dist;
+      cells->candidates.push_back ( candidate );
+    }
+  }
+  
+  std::sort ( cells->candidates.begin() + first, cells->candidates.end(), asc_map_candidate );
+  
+  cells->cell_first[cell] = first;
+  cells->cell_count[cell] = (int) cells->candidates.size() - first;
+}
+
+// Map the pixels in [begin, end) with cells that are built for this range
+
+static void
+map_cells_range ( const Mps_Table *table, const uint32_t *inPixelsPtr, uint32_t begin, uint32_t end, uint32_t *outPixelsPtr )
+{
+  const Pixel_Int *cmap = table->cmap;
+  
+  Map_Cells cells;
+  cells.table = table;
+  cells.cell_first.resize ( MAP_NUM_CELLS, -1 );
+  cells.cell_count.resize ( MAP_NUM_CELLS, 0 );
+  
+  for ( uint32_t ik = begin; ik < end; ik++ ) {
+    const uint32_t pixel = inPixelsPtr[ik];
+    const int blue = pixel & 0xFF;
+    const int green = (pixel >> 8) & 0xFF;
+    const int red = (pixel >> 16) & 0xFF;
+    
+    const int cell = ( ( red >> MAP_CELL_SHIFT ) << ( 2 * MAP_CELL_BITS ) ) | ( ( green >> MAP_CELL_SHIFT ) << MAP_CELL_BITS ) | ( blue >> MAP_CELL_SHIFT );
+    
+    if ( cells.cell_first[cell] < 0 ) {
+      map_cells_build ( &cells, cell );
+    }
+    
+    const Map_Candidate *candidates = &cells.candidates[cells.cell_first[cell]];
+    const int num_candidates = cells.cell_count[cell];
+    
+    int index = candidates[0].index;
+    int min_dist = L2_sqr_int ( red, green, blue, cmap[index].red, cmap[index].green, cmap[index].blue );
+    int start = -1;
+    
+    for ( int k = 1; k < num_candidates && candidates[k].min_dist <= min_dist; k++ ) {
+      const int ic = candidates[k].index;
+      const int dist = L2_sqr_int ( red, green, blue, cmap[ic].red, cmap[ic].green, cmap[ic].blue );
+      
+      if ( dist < min_dist ) {
+        min_dist = dist;
+        index = ic;
+      } else if ( dist == min_dist ) {
+        if ( start < 0 ) {
+          start = table->lut_init[red + green + blue];
+        }
+        if ( mps_visit_order ( ic, start ) < mps_visit_order ( index, start ) ) {
+          index = ic;
+        }
+      }
+    }
+    
+    const uint32_t B = ( uint8_t ) cmap[index].blue;
+    const uint32_t G = ( uint8_t ) cmap[index].green;
+    const uint32_t R = ( uint8_t ) cmap[index].red;
+    outPixelsPtr[ik] = (R << 16) | (G << 8) | B;
+  }
+}
+
+// Map the pixels with the lazily built inverse colormap cells, the result
+// is the same as map_colors_mps including the entry picked on a tie. With
+// threads each thread maps one range of the pixels with its own cells.
+
+static void
+map_colors_cells ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int colormapSize, const int num_threads )
+{
+  Mps_Table table;
+  mps_table_alloc ( colortablePtr, colormapSize, &table );
+  
+  const uint32_t threads = ( uint32_t ) std::max ( num_threads, 1 );
+  const uint32_t range_pixels = std::max ( ( uint32_t ) MAP_RANGE_PIXELS, ( numPixels + threads - 1 ) / threads );
+  
+  map_pixel_ranges ( numPixels, outPixelsPtr, num_threads, range_pixels, [&](uint32_t begin, uint32_t end) {
+    map_cells_range ( &table, inPixelsPtr, begin, end, outPixelsPtr );
+  });
+  
+  mps_table_free ( &table );
+}
+
+// A k-d tree of the palette for large palettes: many entries then have close
+// sums, so the sum sorted search has to compute the distance to most of them.
+// Each node splits its entries at the median of the component with the
+// largest range, and a leaf holds up to MAP_KD_LEAF_SIZE entries. The far
+// side of a node is only searched when the split plane is not further than
+// the best distance found, so entries at the same distance are all seen and
+// the tie is broken like map_colors_mps.
+
+#define MAP_KD_LEAF_SIZE 8
+
+typedef struct
+{
+  int red, green, blue;
+  int index;
+} Kd_Point;
+
+typedef struct
+{
+  int axis; // -1 for a leaf
+  int split;
+  int left, right;
+  int first, count;
+} Kd_Node;
+
+struct Map_Kd_Tree
+{
+  std::vector<Kd_Point> points;
+  std::vector<Kd_Node> nodes;
+};
+
+static inline int
+kd_component ( const Kd_Point & point, const int axis )
+{
+  return ( axis == 0 ) ? point.red : ( ( axis == 1 ) ? point.green : point.blue );
+}
+
+static int
+kd_tree_build ( Map_Kd_Tree *tree, const int first, const int count )
+{
+  const int node = (int) tree->nodes.size();
+  tree->nodes.push_back ( Kd_Node() );
+  
+  Kd_Node leaf;
+  leaf.axis = -1;
+  leaf.split = 0;
+  leaf.left = leaf.right = -1;
+  leaf.first = first;
+  leaf.count = count;
+  
+  if ( count <= MAP_KD_LEAF_SIZE ) {
+    tree->nodes[node] = leaf;
+    return node;
+  }
+  
+  int low[3] = { MAX_RGB, MAX_RGB, MAX_RGB };
+  int high[3] = { 0, 0, 0 };
+  
+  for ( int i = first; i < first + count; i++ ) {
+    for ( int axis = 0; axis < 3; axis++ ) {
+      const int value = kd_component ( tree->points[i], axis );
+      low[axis] = std::min ( low[axis], value );
+      high[axis] = std::max ( high[axis], value );
+    }
+  }
+  
+  int axis = 0;
+  for ( int ia = 1; ia < 3; ia++ ) {
+    if ( ( high[ia] - low[ia] ) > ( high[axis] - low[axis] ) ) {
+      axis = ia;
+    }
+  }
+  
+  if ( high[axis] == low[axis] ) {
+    // All the entries are the same color
+    tree->nodes[node] = leaf;
+    return node;
+  }
+  
+  const int mid = first + count / 2;
+  
+  std::nth_element ( tree->points.begin() + first, tree->points.begin() + mid, tree->points.begin() + first + count,
+                    [axis](const Kd_Point & a, const Kd_Point & b) { return kd_component ( a, axis ) < kd_component ( b, axis ); } );
+  
+  // The entries left of mid are <= split and the entries from mid on are >= split
+  
+  const int split = kd_component ( tree->points[mid], axis );
+  const int left = kd_tree_build ( tree, first, mid - first );
+  const int right = kd_tree_build ( tree, mid, first + count - mid );
+  
+  Kd_Node & inner = tree->nodes[node];
+  inner = leaf;
+  inner.axis = axis;
+  inner.split = split;
+  inner.left = left;
+  inner.right = right;
+  
+  return node;
+}
+
+static void
+kd_tree_alloc ( const Mps_Table *table, Map_Kd_Tree *tree )
+{
+  tree->points.resize ( table->num_colors );
+  
+  for ( int ic = 0; ic < table->num_colors; ic++ ) {
+    Kd_Point & point = tree->points[ic];
+    point.red = table->cmap[ic].red;
+    point.green = table->cmap[ic].green;
+    point.blue = table->cmap[ic].blue;
+    point.index = ic;
+  }
+  
+  tree->nodes.reserve ( 2 * ( table->num_colors / ( MAP_KD_LEAF_SIZE / 2 ) ) + 1 );
+  kd_tree_build ( tree, 0, table->num_colors );
+}
+
+// Find the nearest entry to ( red, green, blue ) in the subtree, *index and
+// *min_dist hold the best entry so far and start is where map_colors_mps
+// would start its search. offset holds the distance along each axis from
+// the color to the region of the subtree and region_dist is their sum of
+// squares, the far side of a node is skipped when its region is further than
+// the best distance.
+
+static void
+kd_tree_search ( const Map_Kd_Tree *tree, const int node, const int *color, const int start,
+                int *offset, const int region_dist, int *index, int *min_dist )
+{
+  const Kd_Node & kd = tree->nodes[node];
+  
+  if ( kd.axis < 0 ) {
+    for ( int i = kd.first; i < kd.first + kd.count; i++ ) {
+      const Kd_Point & point = tree->points[i];
+      const int dist = L2_sqr_int ( color[0], color[1], color[2], point.red, point.green, point.blue );
+      
+      if ( ( dist < *min_dist ) ||
+          ( dist == *min_dist && mps_visit_order ( point.index, start ) < mps_visit_order ( *index, start ) ) ) {
+        *min_dist = dist;
+        *index = point.index;
+      }
+    }
+    
+    return;
+  }
+  
+  const int delta = color[kd.axis] - kd.split;
+  const int near = ( delta < 0 ) ? kd.left : kd.right;
+  const int far = ( delta < 0 ) ? kd.right : kd.left;
+  
+  kd_tree_search ( tree, near, color, start, offset, region_dist, index, min_dist );
+  
+  const int old_offset = offset[kd.axis];
+  const int far_dist = region_dist - old_offset * old_offset + delta * delta;
+  
+  if ( far_dist <= *min_dist ) {
+    offset[kd.axis] = delta;
+    kd_tree_search ( tree, far, color, start, offset, far_dist, index, min_dist );
+    offset[kd.axis] = old_offset;
+  }
+}
+
+// Map the pixels with a k-d tree of the palette, the result is the same as
+// map_colors_mps including the entry picked on a tie.
+
+static void
+map_colors_kd_tree ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int colormapSize, const int num_threads )
+{
+  Mps_Table table;
+  mps_table_alloc ( colortablePtr, colormapSize, &table );
+  
+  const Pixel_Int *cmap = table.cmap;
+  
+  Map_Kd_Tree tree;
+  kd_tree_alloc ( &table, &tree );
+  
+  map_pixel_ranges ( numPixels, outPixelsPtr, num_threads, MAP_RANGE_PIXELS, [&](uint32_t begin, uint32_t end) {
+    for ( uint32_t ik = begin; ik < end; ik++ ) {
+      const uint32_t pixel = inPixelsPtr[ik];
+      const int blue = pixel & 0xFF;
+      const int green = (pixel >> 8) & 0xFF;
+      const int red = (pixel >> 16) & 0xFF;
+      
+      const int start = table.lut_init[red + green + blue];
+      int index = start;
+      int min_dist = L2_sqr_int ( red, green, blue, cmap[index].red, cmap[index].green, cmap[index].blue );
+      
+      const int color[3] = { red, green, blue };
+      int offset[3] = { 0, 0, 0 };
+      
+      kd_tree_search ( &tree, 0, color, start, offset, 0, &index, &min_dist );
+      
+      const uint32_t B = ( uint8_t ) cmap[index].blue;
+      const uint32_t G = ( uint8_t ) cmap[index].green;
+      const uint32_t R = ( uint8_t ) cmap[index].red;
+      outPixelsPtr[ik] = (R << 16) | (G << 8) | B;
+    }
+  });
+  
+  mps_table_free ( &table );
+}
+
+// Map the pixels with the brute force SIMD search of the entries of a small
+// palette, the result is the same as map_colors_mps including the entry
+// picked on a tie.
+
+static void
+map_colors_nearest ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int colormapSize, const int simd_level, const int num_threads )
+{
+  Mps_Table table;
+  mps_table_alloc ( colortablePtr, colormapSize, &table );
+  
+  std::vector<int16_t> red ( table.num_colors );
+  std::vector<int16_t> green ( table.num_colors );
+  std::vector<int16_t> blue ( table.num_colors );
+  
+  for ( int ic = 0; ic < table.num_colors; ic++ ) {
+    red[ic] = ( int16_t ) table.cmap[ic].red;
+    green[ic] = ( int16_t ) table.cmap[ic].green;
+    blue[ic] = ( int16_t ) table.cmap[ic].blue;
+  }
+  
+  map_pixel_ranges ( numPixels, outPixelsPtr, num_threads, MAP_RANGE_PIXELS, [&](uint32_t begin, uint32_t end) {
+    DivQuantNearestColors ( simd_level, inPixelsPtr + begin, ( int ) ( end - begin ), red.data(), green.data(), blue.data(), table.num_colors, table.lut_init, outPixelsPtr + begin );
+  });
+  
+  mps_table_free ( &table );
+}
+
+// The largest palette the brute force search is faster for than the sum
+// sorted search, it computes the distance to 8 entries at a time with AVX2
+// and to only 4 with SSE2.
+
+static int
+map_nearest_max_colors ( const int simd_level )
+{
+  if ( simd_level >= DIVQUANT_SIMD_AVX2 ) {
+    return MAX_COLORS;
+  }
+  if ( simd_level >= DIVQUANT_SIMD_SSE2 ) {
+    return 8;
+  }
+  return 0;
+}
+
+// The sum sorted search computes the distance to every entry with a sum
+// close to the sum of the pixel, so it slows down once there are many
+// entries per sum value. The k-d tree is then faster for a large palette.
+
+static int
+map_prefer_kd_tree ( const uint32_t *colortablePtr, int colormapSize )
+{
+  if ( colormapSize <= MAX_COLORS ) {
+    return 0;
+  }
+  
+  int min_sum = 3 * MAX_RGB;
+  int max_sum = 0;
+  
+  for ( int i = 0; i < colormapSize; i++ ) {
+    const uint32_t pixel = colortablePtr[i];
+    const int sum = ( pixel & 0xFF ) + ( ( pixel >> 8 ) & 0xFF ) + ( ( pixel >> 16 ) & 0xFF );
+    min_sum = std::min ( min_sum, sum );
+    max_sum = std::max ( max_sum, sum );
+  }
+  
+  return ( 2 * colormapSize ) >= ( max_sum - min_sum + 1 );
+}
+
+// Map the pixels with the search selected by the options
+
+static void
+map_colors_search ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int colormapSize, const Map_Options *options )
+{
+  const int kd_tree = ( options != NULL ) ? options->kd_tree : 0;
+  const int simd_level = DivQuantSimdLevel ( ( options != NULL ) ? options->simd : DIVQUANT_SIMD_DETECT );
+  const int num_threads = ( options != NULL ) ? options->num_threads : 1;
+  
+  if ( options != NULL && options->cell_cache ) {
+    map_colors_cells ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, num_threads );
+  } else if ( kd_tree > 0 || ( kd_tree == 0 && map_prefer_kd_tree ( colortablePtr, colormapSize ) ) ) {
+    map_colors_kd_tree ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, num_threads );
+  } else if ( colormapSize <= map_nearest_max_colors ( simd_level ) ) {
+    map_colors_nearest ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, simd_level, num_threads );
+  } else {
+    map_colors_mps_threads ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, num_threads );
+  }
+}
+
+// Memoized mapping: the unique colors of the pixels are found with a bitmap
+// of the 2^24 RGB values and each one is searched once. The palette index of
+// each unique color is then stored in a 2^24 entry table of IT, so each pixel
+// is mapped with one table lookup. Before that each palette color gets the
+// index of its first entry in the table, this finds the index of the color
+// a search returns, and a unique color that is also a palette color maps to
+// itself so it keeps that index.
+
+#define MAP_MEMO_MAX_UNIQUE_RATIO ( 0.75 )
+
+template <typename IT>
+static void
+map_colors_memo ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int colormapSize,
+                 const std::vector<uint32_t> & uniqueColors, const Map_Options *options )
+{
+  const uint32_t numUnique = ( uint32_t ) uniqueColors.size();
+  
+  std::vector<uint32_t> mappedColors ( numUnique );
+  map_colors_search ( uniqueColors.data(), numUnique, mappedColors.data(), colortablePtr, colormapSize, options );
+  
+  // Only the entries of the palette colors and the unique colors are written
+  // and read, so the table is not cleared
+  
+  IT *colorIndex = ( IT * ) malloc ( ( 1 << 24 ) * sizeof ( IT ) );
+  check_mem ( colorIndex == NULL );
+  
+  std::vector<uint32_t> colors ( colormapSize );
+  
+  for ( int i = colormapSize - 1; i >= 0; i-- ) {
+    colors[i] = colortablePtr[i] & 0x00FFFFFF;
+    colorIndex[colors[i]] = ( IT ) i;
+  }
+  
+  for ( uint32_t i = 0; i < numUnique; i++ ) {
+    colorIndex[uniqueColors[i]] = colorIndex[mappedColors[i]];
+  }
+  
+  const int num_threads = ( options != NULL ) ? options->num_threads : 1;
+  
+  map_pixel_ranges ( numPixels, outPixelsPtr, num_threads, MAP_RANGE_PIXELS, [&](uint32_t begin, uint32_t end) {
+    for ( uint32_t ik = begin; ik < end; ik++ ) {
+      outPixelsPtr[ik] = colors[colorIndex[inPixelsPtr[ik] & 0x00FFFFFF]];
+    }
+  });
+  
+  free ( colorIndex );
+}
+
+void
+map_colors ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int colormapSize, const Map_Options *options )
+{
+  const int memoize = ( options != NULL ) ? options->memoize : 0;
+  
+  if ( memoize < 0 || numPixels <= MAP_RANGE_PIXELS ) {
+    map_colors_search ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, options );
+    return;
+  }
+  
+  const uint32_t numWords = ( 1 << 24 ) / 64;
+  std::vector<uint64_t> seen ( numWords );
+  
+  for ( uint32_t i = 0; i < numPixels; i++ ) {
+    const uint32_t rgb = inPixelsPtr[i] & 0x00FFFFFF;
+    seen[rgb >> 6] |= ( 1ULL << ( rgb & 63 ) );
+  }
+  
+  uint32_t numUnique = 0;
+  
+  for ( uint32_t wi = 0; wi < numWords; wi++ ) {
+    numUnique += __builtin_popcountll ( seen[wi] );
+  }
+  
+  if ( memoize == 0 && numUnique > ( uint32_t ) ( MAP_MEMO_MAX_UNIQUE_RATIO * numPixels ) ) {
+    map_colors_search ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, options );
+    return;
+  }
+  
+  std::vector<uint32_t> uniqueColors;
+  uniqueColors.reserve ( numUnique );
+  
+  for ( uint32_t wi = 0; wi < numWords; wi++ ) {
+    uint64_t word = seen[wi];
+    while ( word != 0 ) {
+      uniqueColors.push_back ( ( wi << 6 ) | __builtin_ctzll ( word ) );
+      word &= word - 1;
+    }
+  }
+  
+  seen = std::vector<uint64_t>();
+  
+  if ( colormapSize <= 256 ) {
+    map_colors_memo<uint8_t> ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, uniqueColors, options );
+  } else if ( colormapSize <= 65536 ) {
+    map_colors_memo<uint16_t> ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, uniqueColors, options );
+  } else {
+    map_colors_memo<uint32_t> ( inPixelsPtr, numPixels, outPixelsPtr, colortablePtr, colormapSize, uniqueColors, options );
+  }
+}
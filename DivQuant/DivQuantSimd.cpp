@@ -0,0 +1,921 @@
+// SIMD versions of the inner loops of the quant logic. The SIMD kernels are
+// compiled for a specific instruction set with a function level target
+// attribute, so the rest of the library can be compiled without any special
+// flags and the kernel to use is selected at runtime. Each kernel generates
+// the same result as the scalar logic it replaces.
+
+#include "DivQuantHeader.h"
+
+#include "assert.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+# define DIVQUANT_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+// Return the largest SIMD level supported by the CPU that is not larger
+// than max_level. DIVQUANT_SIMD_DETECT means no limit.
+
+int DivQuantSimdLevel(const int max_level)
+{
+  int level = DIVQUANT_SIMD_SCALAR;
+
+#if defined(DIVQUANT_X86_SIMD)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2")) {
+    level = DIVQUANT_SIMD_SSE2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    level = DIVQUANT_SIMD_AVX2;
+  }
+#endif // DIVQUANT_X86_SIMD
+
+  if (max_level != DIVQUANT_SIMD_DETECT && max_level < level) {
+    level = max_level;
+  }
+
+  return level;
+}
+
+// Points read by the kernels, either packed pixels, 5-5-5 pixels packed in
+// 16 bits or separate R, G, B planes when both pixels pointers are NULL.
+
+typedef struct
+{
+  const uint32_t *pixels;
+  const uint8_t *red;
+  const uint8_t *green;
+  const uint8_t *blue;
+  const uint16_t *pixels16;
+} Lkm_Points;
+
+// Read the R, G, B components of the point at offset ip
+
+static inline
+void DivQuantLkmPoint(const Lkm_Points *points, const int ip, uint32_t *R, uint32_t *G, uint32_t *B)
+{
+  if (points->pixels) {
+    uint32_t pixel = points->pixels[ip];
+    *R = (pixel >> 16) & 0xFF;
+    *G = (pixel >> 8) & 0xFF;
+    *B = pixel & 0xFF;
+  } else if (points->pixels16) {
+    uint32_t pixel = points->pixels16[ip];
+    *R = (pixel >> 10) & 0x1F;
+    *G = (pixel >> 5) & 0x1F;
+    *B = pixel & 0x1F;
+  } else {
+    *R = points->red[ip];
+    *G = points->green[ip];
+    *B = points->blue[ip];
+  }
+}
+
+// Scalar LKM hyperplane test for a single pixel, returns true when the pixel
+// is closer to the mean of C1. This must match DivQuantLkmRange exactly.
+
+static inline
+bool DivQuantLkmIsOld(const uint32_t R, const uint32_t G, const uint32_t B, const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue)
+{
+  double red = R;
+  double green = G;
+  double blue = B;
+
+  return ( lhs < ( (rhs_red * red) + (rhs_green * green) + (rhs_blue * blue) ) );
+}
+
+// Add a weighted pixel to the sums, double weights are added to double
+// sums and pixel counts are added to 64 bit integer sums.
+
+static inline
+void DivQuantLkmAddWeight(const double tmp_weight, const uint32_t R, const uint32_t G, const uint32_t B, double *sums)
+{
+  double red = R;
+  double green = G;
+  double blue = B;
+
+  sums[0] += tmp_weight * red;
+  sums[1] += tmp_weight * green;
+  sums[2] += tmp_weight * blue;
+  sums[3] += tmp_weight;
+}
+
+static inline
+void DivQuantLkmAddWeight(const uint32_t tmp_count, const uint32_t R, const uint32_t G, const uint32_t B, uint64_t *sums)
+{
+  const uint64_t count = tmp_count;
+
+  sums[0] += count * R;
+  sums[1] += count * G;
+  sums[2] += count * B;
+  sums[3] += count;
+}
+
+// Accumulate the weighted sums of the C2 pixels selected by the bits in
+// new_bits, in pixel order so that each sum is the same as the scalar sum.
+
+template <typename WT, typename ST>
+static inline
+void DivQuantLkmAddWeighted(const Lkm_Points *points, const WT *weights, const int *point_index, const int offset, unsigned int new_bits, ST *sums)
+{
+  while (new_bits != 0) {
+    int ip = offset + __builtin_ctz(new_bits);
+    new_bits &= new_bits - 1;
+
+    uint32_t R, G, B;
+    DivQuantLkmPoint(points, ip, &R, &G, &B);
+
+    DivQuantLkmAddWeight(weights[point_index ? point_index[ip] : ip], R, G, B, sums);
+  }
+}
+
+// Scalar version of the uniform weight kernel, also used for the points
+// left over after the last full SIMD vector.
+
+static
+void DivQuantLkmSumsScalar(const Lkm_Points *points, const int begin, const int end,
+                           const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                           uint64_t *sums)
+{
+  for ( int ip = begin; ip < end; ip++ ) {
+    uint32_t R, G, B;
+    DivQuantLkmPoint(points, ip, &R, &G, &B);
+
+    if ( !DivQuantLkmIsOld(R, G, B, lhs, rhs_red, rhs_green, rhs_blue) ) {
+      sums[0] += R;
+      sums[1] += G;
+      sums[2] += B;
+      sums[3] += 1;
+    }
+  }
+}
+
+// Scalar version of the weighted kernel, returns the number of C2 points.
+// WT is the type of the weights and ST the type of the sums, either double
+// or uint32_t counts with uint64_t sums.
+
+template <typename WT, typename ST>
+static
+int DivQuantLkmWeightedSumsScalar(const Lkm_Points *points, const WT *weights, const int *point_index, const int begin, const int end,
+                                  const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                                  ST *sums)
+{
+  int count = 0;
+
+  for ( int ip = begin; ip < end; ip++ ) {
+    uint32_t R, G, B;
+    DivQuantLkmPoint(points, ip, &R, &G, &B);
+
+    if ( !DivQuantLkmIsOld(R, G, B, lhs, rhs_red, rhs_green, rhs_blue) ) {
+      count++;
+      DivQuantLkmAddWeighted(points, weights, point_index, ip, 0x1, sums);
+    }
+  }
+
+  return count;
+}
+
+#if defined(DIVQUANT_X86_SIMD)
+
+// SSE2 : load 4 points starting at offset ip as 32 bit R, G, B lanes
+
+__attribute__ ((target("sse2")))
+static inline
+__m128i DivQuantWidenBytesSSE2(const uint8_t *bytes)
+{
+  const __m128i zero = _mm_setzero_si128();
+
+  int32_t word;
+  memcpy(&word, bytes, sizeof(word));
+
+  __m128i v = _mm_cvtsi32_si128(word);
+  v = _mm_unpacklo_epi8(v, zero);
+  return _mm_unpacklo_epi16(v, zero);
+}
+
+__attribute__ ((target("sse2")))
+static inline
+void DivQuantLkmLoadSSE2(const Lkm_Points *points, const int ip, __m128i *red, __m128i *green, __m128i *blue)
+{
+  if (points->pixels) {
+    const __m128i byte_mask = _mm_set1_epi32(0xFF);
+    __m128i px = _mm_loadu_si128((const __m128i*) &points->pixels[ip]);
+
+    *blue = _mm_and_si128(px, byte_mask);
+    *green = _mm_and_si128(_mm_srli_epi32(px, 8), byte_mask);
+    *red = _mm_and_si128(_mm_srli_epi32(px, 16), byte_mask);
+  } else if (points->pixels16) {
+    const __m128i field_mask = _mm_set1_epi32(0x1F);
+    __m128i px = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*) &points->pixels16[ip]), _mm_setzero_si128());
+
+    *blue = _mm_and_si128(px, field_mask);
+    *green = _mm_and_si128(_mm_srli_epi32(px, 5), field_mask);
+    *red = _mm_and_si128(_mm_srli_epi32(px, 10), field_mask);
+  } else {
+    *red = DivQuantWidenBytesSSE2(&points->red[ip]);
+    *green = DivQuantWidenBytesSSE2(&points->green[ip]);
+    *blue = DivQuantWidenBytesSSE2(&points->blue[ip]);
+  }
+}
+
+// SSE2 : test 4 pixels against the LKM hyperplane, bit N of the result is set
+// when pixel N is closer to the mean of C1.
+
+__attribute__ ((target("sse2")))
+static inline
+int DivQuantLkmOldBitsSSE2(const __m128i red, const __m128i green, const __m128i blue,
+                           const __m128d lhs2, const __m128d rhs_red2, const __m128d rhs_green2, const __m128d rhs_blue2)
+{
+  __m128d r01 = _mm_cvtepi32_pd(red);
+  __m128d r23 = _mm_cvtepi32_pd(_mm_shuffle_epi32(red, _MM_SHUFFLE(1, 0, 3, 2)));
+  __m128d g01 = _mm_cvtepi32_pd(green);
+  __m128d g23 = _mm_cvtepi32_pd(_mm_shuffle_epi32(green, _MM_SHUFFLE(1, 0, 3, 2)));
+  __m128d b01 = _mm_cvtepi32_pd(blue);
+  __m128d b23 = _mm_cvtepi32_pd(_mm_shuffle_epi32(blue, _MM_SHUFFLE(1, 0, 3, 2)));
+
+  // Same order of operations as the scalar logic, no FMA
+
+  __m128d dot01 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(rhs_red2, r01), _mm_mul_pd(rhs_green2, g01)), _mm_mul_pd(rhs_blue2, b01));
+  __m128d dot23 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(rhs_red2, r23), _mm_mul_pd(rhs_green2, g23)), _mm_mul_pd(rhs_blue2, b23));
+
+  return _mm_movemask_pd(_mm_cmplt_pd(lhs2, dot01)) | (_mm_movemask_pd(_mm_cmplt_pd(lhs2, dot23)) << 2);
+}
+
+__attribute__ ((target("sse2")))
+static
+void DivQuantLkmSumsSSE2(const Lkm_Points *points, const int num_points,
+                         const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                         uint64_t *sums)
+{
+  const __m128d lhs2 = _mm_set1_pd(lhs);
+  const __m128d rhs_red2 = _mm_set1_pd(rhs_red);
+  const __m128d rhs_green2 = _mm_set1_pd(rhs_green);
+  const __m128d rhs_blue2 = _mm_set1_pd(rhs_blue);
+  const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+
+  uint64_t sum_red = 0, sum_green = 0, sum_blue = 0, count = 0;
+
+  int ip = 0;
+
+  while ( (num_points - ip) >= 4 )
+  {
+    // The 32 bit lane sums can not overflow within a block of 0xFFFF pixels
+
+    int numLeft = num_points - ip;
+    if (numLeft > 0xFFFF) {
+      numLeft = 0xFFFF;
+    }
+    const int blockEnd = ip + (numLeft & ~3);
+
+    __m128i acc_red = _mm_setzero_si128();
+    __m128i acc_green = _mm_setzero_si128();
+    __m128i acc_blue = _mm_setzero_si128();
+
+    for ( ; ip < blockEnd; ip += 4 ) {
+      __m128i red, green, blue;
+      DivQuantLkmLoadSSE2(points, ip, &red, &green, &blue);
+
+      int old_bits = DivQuantLkmOldBitsSSE2(red, green, blue, lhs2, rhs_red2, rhs_green2, rhs_blue2);
+
+      __m128i old_lanes = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(old_bits), lane_bits), lane_bits);
+
+      acc_red = _mm_add_epi32(acc_red, _mm_andnot_si128(old_lanes, red));
+      acc_green = _mm_add_epi32(acc_green, _mm_andnot_si128(old_lanes, green));
+      acc_blue = _mm_add_epi32(acc_blue, _mm_andnot_si128(old_lanes, blue));
+
+      count += 4 - __builtin_popcount(old_bits);
+    }
+
+    uint32_t lanes[4];
+
+    _mm_storeu_si128((__m128i*) lanes, acc_red);
+    sum_red += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i*) lanes, acc_green);
+    sum_green += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i*) lanes, acc_blue);
+    sum_blue += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  sums[0] += sum_red;
+  sums[1] += sum_green;
+  sums[2] += sum_blue;
+  sums[3] += count;
+
+  DivQuantLkmSumsScalar(points, ip, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+template <typename WT, typename ST>
+__attribute__ ((target("sse2")))
+static
+int DivQuantLkmWeightedSumsSSE2(const Lkm_Points *points, const WT *weights, const int *point_index, const int num_points,
+                                const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                                ST *sums)
+{
+  const __m128d lhs2 = _mm_set1_pd(lhs);
+  const __m128d rhs_red2 = _mm_set1_pd(rhs_red);
+  const __m128d rhs_green2 = _mm_set1_pd(rhs_green);
+  const __m128d rhs_blue2 = _mm_set1_pd(rhs_blue);
+
+  int count = 0;
+  int ip = 0;
+
+  for ( ; (num_points - ip) >= 4; ip += 4 ) {
+    __m128i red, green, blue;
+    DivQuantLkmLoadSSE2(points, ip, &red, &green, &blue);
+
+    unsigned int new_bits = ~DivQuantLkmOldBitsSSE2(red, green, blue, lhs2, rhs_red2, rhs_green2, rhs_blue2) & 0xF;
+
+    count += __builtin_popcount(new_bits);
+    DivQuantLkmAddWeighted(points, weights, point_index, ip, new_bits, sums);
+  }
+
+  count += DivQuantLkmWeightedSumsScalar(points, weights, point_index, ip, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+
+  return count;
+}
+
+// AVX2 : load 8 points starting at offset ip as 32 bit R, G, B lanes
+
+__attribute__ ((target("avx2")))
+static inline
+void DivQuantLkmLoadAVX2(const Lkm_Points *points, const int ip, __m256i *red, __m256i *green, __m256i *blue)
+{
+  if (points->pixels) {
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    __m256i px = _mm256_loadu_si256((const __m256i*) &points->pixels[ip]);
+
+    *blue = _mm256_and_si256(px, byte_mask);
+    *green = _mm256_and_si256(_mm256_srli_epi32(px, 8), byte_mask);
+    *red = _mm256_and_si256(_mm256_srli_epi32(px, 16), byte_mask);
+  } else if (points->pixels16) {
+    const __m256i field_mask = _mm256_set1_epi32(0x1F);
+    __m256i px = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) &points->pixels16[ip]));
+
+    *blue = _mm256_and_si256(px, field_mask);
+    *green = _mm256_and_si256(_mm256_srli_epi32(px, 5), field_mask);
+    *red = _mm256_and_si256(_mm256_srli_epi32(px, 10), field_mask);
+  } else {
+    *red = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &points->red[ip]));
+    *green = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &points->green[ip]));
+    *blue = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &points->blue[ip]));
+  }
+}
+
+// AVX2 : test 8 pixels against the LKM hyperplane, bit N of the result is set
+// when pixel N is closer to the mean of C1.
+
+__attribute__ ((target("avx2")))
+static inline
+int DivQuantLkmOldBitsAVX2(const __m256i red, const __m256i green, const __m256i blue,
+                           const __m256d lhs4, const __m256d rhs_red4, const __m256d rhs_green4, const __m256d rhs_blue4)
+{
+  __m256d r03 = _mm256_cvtepi32_pd(_mm256_castsi256_si128(red));
+  __m256d r47 = _mm256_cvtepi32_pd(_mm256_extracti128_si256(red, 1));
+  __m256d g03 = _mm256_cvtepi32_pd(_mm256_castsi256_si128(green));
+  __m256d g47 = _mm256_cvtepi32_pd(_mm256_extracti128_si256(green, 1));
+  __m256d b03 = _mm256_cvtepi32_pd(_mm256_castsi256_si128(blue));
+  __m256d b47 = _mm256_cvtepi32_pd(_mm256_extracti128_si256(blue, 1));
+
+  // Same order of operations as the scalar logic, no FMA
+
+  __m256d dot03 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rhs_red4, r03), _mm256_mul_pd(rhs_green4, g03)), _mm256_mul_pd(rhs_blue4, b03));
+  __m256d dot47 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rhs_red4, r47), _mm256_mul_pd(rhs_green4, g47)), _mm256_mul_pd(rhs_blue4, b47));
+
+  return _mm256_movemask_pd(_mm256_cmp_pd(lhs4, dot03, _CMP_LT_OQ)) | (_mm256_movemask_pd(_mm256_cmp_pd(lhs4, dot47, _CMP_LT_OQ)) << 4);
+}
+
+__attribute__ ((target("avx2")))
+static
+void DivQuantLkmSumsAVX2(const Lkm_Points *points, const int num_points,
+                         const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                         uint64_t *sums)
+{
+  const __m256d lhs4 = _mm256_set1_pd(lhs);
+  const __m256d rhs_red4 = _mm256_set1_pd(rhs_red);
+  const __m256d rhs_green4 = _mm256_set1_pd(rhs_green);
+  const __m256d rhs_blue4 = _mm256_set1_pd(rhs_blue);
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+
+  uint64_t sum_red = 0, sum_green = 0, sum_blue = 0, count = 0;
+
+  int ip = 0;
+
+  while ( (num_points - ip) >= 8 )
+  {
+    // The 32 bit lane sums can not overflow within a block of 0xFFFF pixels
+
+    int numLeft = num_points - ip;
+    if (numLeft > 0xFFFF) {
+      numLeft = 0xFFFF;
+    }
+    const int blockEnd = ip + (numLeft & ~7);
+
+    __m256i acc_red = _mm256_setzero_si256();
+    __m256i acc_green = _mm256_setzero_si256();
+    __m256i acc_blue = _mm256_setzero_si256();
+
+    for ( ; ip < blockEnd; ip += 8 ) {
+      __m256i red, green, blue;
+      DivQuantLkmLoadAVX2(points, ip, &red, &green, &blue);
+
+      int old_bits = DivQuantLkmOldBitsAVX2(red, green, blue, lhs4, rhs_red4, rhs_green4, rhs_blue4);
+
+      __m256i old_lanes = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(old_bits), lane_bits), lane_bits);
+
+      acc_red = _mm256_add_epi32(acc_red, _mm256_andnot_si256(old_lanes, red));
+      acc_green = _mm256_add_epi32(acc_green, _mm256_andnot_si256(old_lanes, green));
+      acc_blue = _mm256_add_epi32(acc_blue, _mm256_andnot_si256(old_lanes, blue));
+
+      count += 8 - __builtin_popcount(old_bits);
+    }
+
+    uint32_t lanes[8];
+
+    _mm256_storeu_si256((__m256i*) lanes, acc_red);
+    for ( int i = 0; i < 8; i++ ) {
+      sum_red += lanes[i];
+    }
+    _mm256_storeu_si256((__m256i*) lanes, acc_green);
+    for ( int i = 0; i < 8; i++ ) {
+      sum_green += lanes[i];
+    }
+    _mm256_storeu_si256((__m256i*) lanes, acc_blue);
+    for ( int i = 0; i < 8; i++ ) {
+      sum_blue += lanes[i];
+    }
+  }
+
+  sums[0] += sum_red;
+  sums[1] += sum_green;
+  sums[2] += sum_blue;
+  sums[3] += count;
+
+  DivQuantLkmSumsScalar(points, ip, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+template <typename WT, typename ST>
+__attribute__ ((target("avx2")))
+static
+int DivQuantLkmWeightedSumsAVX2(const Lkm_Points *points, const WT *weights, const int *point_index, const int num_points,
+                                const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                                ST *sums)
+{
+  const __m256d lhs4 = _mm256_set1_pd(lhs);
+  const __m256d rhs_red4 = _mm256_set1_pd(rhs_red);
+  const __m256d rhs_green4 = _mm256_set1_pd(rhs_green);
+  const __m256d rhs_blue4 = _mm256_set1_pd(rhs_blue);
+
+  int count = 0;
+  int ip = 0;
+
+  for ( ; (num_points - ip) >= 8; ip += 8 ) {
+    __m256i red, green, blue;
+    DivQuantLkmLoadAVX2(points, ip, &red, &green, &blue);
+
+    unsigned int new_bits = ~DivQuantLkmOldBitsAVX2(red, green, blue, lhs4, rhs_red4, rhs_green4, rhs_blue4) & 0xFF;
+
+    count += __builtin_popcount(new_bits);
+    DivQuantLkmAddWeighted(points, weights, point_index, ip, new_bits, sums);
+  }
+
+  count += DivQuantLkmWeightedSumsScalar(points, weights, point_index, ip, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+
+  return count;
+}
+
+#endif // DIVQUANT_X86_SIMD
+
+static
+void DivQuantLkmSumsPoints(const int simd_level, const Lkm_Points *points, const int num_points,
+                           const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                           uint64_t *sums)
+{
+#if defined(DIVQUANT_X86_SIMD)
+  if (simd_level >= DIVQUANT_SIMD_AVX2) {
+    DivQuantLkmSumsAVX2(points, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+    return;
+  }
+  if (simd_level >= DIVQUANT_SIMD_SSE2) {
+    DivQuantLkmSumsSSE2(points, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+    return;
+  }
+#endif // DIVQUANT_X86_SIMD
+
+  DivQuantLkmSumsScalar(points, 0, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+template <typename WT, typename ST>
+static
+int DivQuantLkmWeightedSumsPoints(const int simd_level, const Lkm_Points *points, const WT *weights, const int *point_index, const int num_points,
+                                  const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                                  ST *sums)
+{
+#if defined(DIVQUANT_X86_SIMD)
+  if (simd_level >= DIVQUANT_SIMD_AVX2) {
+    return DivQuantLkmWeightedSumsAVX2(points, weights, point_index, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+  if (simd_level >= DIVQUANT_SIMD_SSE2) {
+    return DivQuantLkmWeightedSumsSSE2(points, weights, point_index, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+  }
+#endif // DIVQUANT_X86_SIMD
+
+  return DivQuantLkmWeightedSumsScalar(points, weights, point_index, 0, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+// Sum the R, G, B components of the pixels on the C2 side of the LKM
+// hyperplane, the sums are added to sums[0..2] and the number of these
+// pixels is added to sums[3]. Used for the uniform weight case.
+
+void DivQuantLkmSums(const int simd_level, const uint32_t *pixels, const int num_points,
+                     const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                     uint64_t *sums)
+{
+  Lkm_Points points = { pixels, nullptr, nullptr, nullptr, nullptr };
+  DivQuantLkmSumsPoints(simd_level, &points, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+// Weighted version of DivQuantLkmSums, the weight of the pixel at offset ip
+// is weights[point_index[ip]] or weights[ip] when point_index is NULL. The
+// weighted sums are added to sums[0..2] and the weights to sums[3] in pixel
+// order. Returns the number of pixels on the C2 side.
+
+int DivQuantLkmWeightedSums(const int simd_level, const uint32_t *pixels, const double *weights, const int *point_index, const int num_points,
+                            const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                            double *sums)
+{
+  Lkm_Points points = { pixels, nullptr, nullptr, nullptr, nullptr };
+  return DivQuantLkmWeightedSumsPoints(simd_level, &points, weights, point_index, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+// Planar versions of DivQuantLkmSums and DivQuantLkmWeightedSums, the
+// components of the pixel at offset ip are red[ip], green[ip] and blue[ip].
+
+void DivQuantLkmSumsPlanar(const int simd_level, const uint8_t *red, const uint8_t *green, const uint8_t *blue, const int num_points,
+                           const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                           uint64_t *sums)
+{
+  Lkm_Points points = { nullptr, red, green, blue, nullptr };
+  DivQuantLkmSumsPoints(simd_level, &points, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+int DivQuantLkmWeightedSumsPlanar(const int simd_level, const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+                                  const double *weights, const int *point_index, const int num_points,
+                                  const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                                  double *sums)
+{
+  Lkm_Points points = { nullptr, red, green, blue, nullptr };
+  return DivQuantLkmWeightedSumsPoints(simd_level, &points, weights, point_index, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+// Versions of DivQuantLkmWeightedSums and DivQuantLkmWeightedSumsPlanar
+// where the weights are pixel counts. The sums of count * component and of
+// the counts are added to the 64 bit sums[0..3].
+
+int DivQuantLkmCountSums(const int simd_level, const uint32_t *pixels, const uint32_t *counts, const int *point_index, const int num_points,
+                         const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                         uint64_t *sums)
+{
+  Lkm_Points points = { pixels, nullptr, nullptr, nullptr, nullptr };
+  return DivQuantLkmWeightedSumsPoints(simd_level, &points, counts, point_index, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+int DivQuantLkmCountSumsPlanar(const int simd_level, const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+                               const uint32_t *counts, const int *point_index, const int num_points,
+                               const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                               uint64_t *sums)
+{
+  Lkm_Points points = { nullptr, red, green, blue, nullptr };
+  return DivQuantLkmWeightedSumsPoints(simd_level, &points, counts, point_index, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+// Versions of DivQuantLkmSums, DivQuantLkmWeightedSums and
+// DivQuantLkmCountSums for 5-5-5 pixels packed in 16 bits, R in bits 10-14,
+// G in bits 5-9 and B in bits 0-4.
+
+void DivQuantLkmSums16(const int simd_level, const uint16_t *pixels, const int num_points,
+                       const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                       uint64_t *sums)
+{
+  Lkm_Points points = { nullptr, nullptr, nullptr, nullptr, pixels };
+  DivQuantLkmSumsPoints(simd_level, &points, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+int DivQuantLkmWeightedSums16(const int simd_level, const uint16_t *pixels, const double *weights, const int *point_index, const int num_points,
+                              const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                              double *sums)
+{
+  Lkm_Points points = { nullptr, nullptr, nullptr, nullptr, pixels };
+  return DivQuantLkmWeightedSumsPoints(simd_level, &points, weights, point_index, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+int DivQuantLkmCountSums16(const int simd_level, const uint16_t *pixels, const uint32_t *counts, const int *point_index, const int num_points,
+                           const double lhs, const double rhs_red, const double rhs_green, const double rhs_blue,
+                           uint64_t *sums)
+{
+  Lkm_Points points = { nullptr, nullptr, nullptr, nullptr, pixels };
+  return DivQuantLkmWeightedSumsPoints(simd_level, &points, counts, point_index, num_points, lhs, rhs_red, rhs_green, rhs_blue, sums);
+}
+
+// Reduce each pixel to num_bits per component and pack the components into
+// a 3 * num_bits bit index, ( R << ( 2 * num_bits ) ) | ( G << num_bits ) | B,
+// so that the reduced colors can be counted in a direct table.
+
+static
+void DivQuantCutBitsIndexScalar(const uint32_t *pixels, const int begin, const int end, const int num_bits, uint32_t *index)
+{
+  const uint32_t shift = 8 - num_bits;
+  const uint32_t mask = (1U << num_bits) - 1;
+
+  for ( int ip = begin; ip < end; ip++ ) {
+    uint32_t pixel = pixels[ip];
+
+    uint32_t R = (pixel >> (16 + shift)) & mask;
+    uint32_t G = (pixel >> (8 + shift)) & mask;
+    uint32_t B = (pixel >> shift) & mask;
+
+    index[ip] = (R << (2 * num_bits)) | (G << num_bits) | B;
+  }
+}
+
+#if defined(DIVQUANT_X86_SIMD)
+
+__attribute__ ((target("sse2")))
+static
+void DivQuantCutBitsIndexSSE2(const uint32_t *pixels, const int num_pixels, const int num_bits, uint32_t *index)
+{
+  const uint32_t shift = 8 - num_bits;
+
+  const __m128i mask = _mm_set1_epi32((1 << num_bits) - 1);
+  const __m128i red_shift = _mm_cvtsi32_si128(16 + shift);
+  const __m128i green_shift = _mm_cvtsi32_si128(8 + shift);
+  const __m128i blue_shift = _mm_cvtsi32_si128(shift);
+  const __m128i red_pos = _mm_cvtsi32_si128(2 * num_bits);
+  const __m128i green_pos = _mm_cvtsi32_si128(num_bits);
+
+  int ip = 0;
+
+  for ( ; (num_pixels - ip) >= 4; ip += 4 ) {
+    __m128i pixel = _mm_loadu_si128((const __m128i*) (pixels + ip));
+
+    __m128i red = _mm_and_si128(_mm_srl_epi32(pixel, red_shift), mask);
+    __m128i green = _mm_and_si128(_mm_srl_epi32(pixel, green_shift), mask);
+    __m128i blue = _mm_and_si128(_mm_srl_epi32(pixel, blue_shift), mask);
+
+    __m128i packed = _mm_or_si128(_mm_or_si128(_mm_sll_epi32(red, red_pos), _mm_sll_epi32(green, green_pos)), blue);
+
+    _mm_storeu_si128((__m128i*) (index + ip), packed);
+  }
+
+  DivQuantCutBitsIndexScalar(pixels, ip, num_pixels, num_bits, index);
+}
+
+__attribute__ ((target("avx2")))
+static
+void DivQuantCutBitsIndexAVX2(const uint32_t *pixels, const int num_pixels, const int num_bits, uint32_t *index)
+{
+  const uint32_t shift = 8 - num_bits;
+
+  const __m256i mask = _mm256_set1_epi32((1 << num_bits) - 1);
+  const __m128i red_shift = _mm_cvtsi32_si128(16 + shift);
+  const __m128i green_shift = _mm_cvtsi32_si128(8 + shift);
+  const __m128i blue_shift = _mm_cvtsi32_si128(shift);
+  const __m128i red_pos = _mm_cvtsi32_si128(2 * num_bits);
+  const __m128i green_pos = _mm_cvtsi32_si128(num_bits);
+
+  int ip = 0;
+
+  for ( ; (num_pixels - ip) >= 8; ip += 8 ) {
+    __m256i pixel = _mm256_loadu_si256((const __m256i*) (pixels + ip));
+
+    __m256i red = _mm256_and_si256(_mm256_srl_epi32(pixel, red_shift), mask);
+    __m256i green = _mm256_and_si256(_mm256_srl_epi32(pixel, green_shift), mask);
+    __m256i blue = _mm256_and_si256(_mm256_srl_epi32(pixel, blue_shift), mask);
+
+    __m256i packed = _mm256_or_si256(_mm256_or_si256(_mm256_sll_epi32(red, red_pos), _mm256_sll_epi32(green, green_pos)), blue);
+
+    _mm256_storeu_si256((__m256i*) (index + ip), packed);
+  }
+
+  DivQuantCutBitsIndexScalar(pixels, ip, num_pixels, num_bits, index);
+}
+
+#endif // DIVQUANT_X86_SIMD
+
+void DivQuantCutBitsIndex(const int simd_level, const uint32_t *pixels, const int num_pixels, const int num_bits, uint32_t *index)
+{
+#if defined(DIVQUANT_X86_SIMD)
+  if (simd_level >= DIVQUANT_SIMD_AVX2) {
+    DivQuantCutBitsIndexAVX2(pixels, num_pixels, num_bits, index);
+    return;
+  }
+  if (simd_level >= DIVQUANT_SIMD_SSE2) {
+    DivQuantCutBitsIndexSSE2(pixels, num_pixels, num_bits, index);
+    return;
+  }
+#endif // DIVQUANT_X86_SIMD
+
+  DivQuantCutBitsIndexScalar(pixels, 0, num_pixels, num_bits, index);
+}
+
+// Brute force nearest palette entry of each pixel. The palette is sorted by
+// the sum of the components and each pixel gets the entry with the smallest
+// key ( dist << 9 ) | order, where order is the position of the entry in
+// the visit order start, start + 1, start - 1, start + 2 ... of the search of
+// map_colors_mps from start = lut_init[R + G + B]. So of the entries at the
+// min distance the one that search returns is picked.
+
+#define NEAREST_MAX_COLORS 256
+#define NEAREST_ORDER_BITS 9
+#define NEAREST_PAD_VALUE 1000 // further than any color, the key still fits in 31 bits
+
+static inline
+uint32_t DivQuantNearestPixel(const int16_t *red, const int16_t *green, const int16_t *blue, const int start, const int key)
+{
+  const int order = key & ((1 << NEAREST_ORDER_BITS) - 1);
+  const int index = (order & 1) ? (start + ((order + 1) >> 1)) : (start - (order >> 1));
+
+  return ((uint32_t) red[index] << 16) | ((uint32_t) green[index] << 8) | (uint32_t) blue[index];
+}
+
+static
+void DivQuantNearestColorsScalar(const uint32_t *pixels, const int num_pixels,
+                                 const int16_t *red, const int16_t *green, const int16_t *blue, const int num_colors,
+                                 const int *lut_init, uint32_t *out)
+{
+  for ( int ip = 0; ip < num_pixels; ip++ ) {
+    const uint32_t pixel = pixels[ip];
+    const int R = (pixel >> 16) & 0xFF;
+    const int G = (pixel >> 8) & 0xFF;
+    const int B = pixel & 0xFF;
+    const int start = lut_init[R + G + B];
+
+    int min_key = INT_MAX;
+
+    for ( int ic = 0; ic < num_colors; ic++ ) {
+      const int dr = red[ic] - R;
+      const int dg = green[ic] - G;
+      const int db = blue[ic] - B;
+      const int delta = 2 * (ic - start);
+      const int order = (delta > 0) ? (delta - 1) : -delta;
+      const int key = ((dr * dr + dg * dg + db * db) << NEAREST_ORDER_BITS) | order;
+
+      min_key = std::min(min_key, key);
+    }
+
+    out[ip] = DivQuantNearestPixel(red, green, blue, start, min_key);
+  }
+}
+
+#if defined(DIVQUANT_X86_SIMD)
+
+// The palette as ( R, G ) and ( B, 0 ) pairs of 16 bit values, so that
+// _mm_madd_epi16 of the differences gives dr * dr + dg * dg and db * db in
+// 32 bit lanes. The entries past num_colors are padding.
+
+typedef struct
+{
+  int16_t red_green[2 * (NEAREST_MAX_COLORS + 8)];
+  int16_t blue_zero[2 * (NEAREST_MAX_COLORS + 8)];
+} Nearest_Pairs;
+
+static
+void DivQuantNearestPairs(const int16_t *red, const int16_t *green, const int16_t *blue, const int num_colors, Nearest_Pairs *pairs)
+{
+  for ( int ic = 0; ic < NEAREST_MAX_COLORS + 8; ic++ ) {
+    const bool valid = (ic < num_colors);
+    pairs->red_green[2 * ic] = valid ? red[ic] : NEAREST_PAD_VALUE;
+    pairs->red_green[2 * ic + 1] = valid ? green[ic] : NEAREST_PAD_VALUE;
+    pairs->blue_zero[2 * ic] = valid ? blue[ic] : NEAREST_PAD_VALUE;
+    pairs->blue_zero[2 * ic + 1] = 0;
+  }
+}
+
+__attribute__ ((target("sse2")))
+static
+void DivQuantNearestColorsSSE2(const uint32_t *pixels, const int num_pixels,
+                               const int16_t *red, const int16_t *green, const int16_t *blue, const int num_colors,
+                               const int *lut_init, uint32_t *out)
+{
+  Nearest_Pairs pairs;
+  DivQuantNearestPairs(red, green, blue, num_colors, &pairs);
+
+  const int num_blocks = (num_colors + 3) / 4;
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128i eight = _mm_set1_epi32(8);
+  const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+
+  for ( int ip = 0; ip < num_pixels; ip++ ) {
+    const uint32_t pixel = pixels[ip];
+    const int R = (pixel >> 16) & 0xFF;
+    const int G = (pixel >> 8) & 0xFF;
+    const int B = pixel & 0xFF;
+    const int start = lut_init[R + G + B];
+
+    const __m128i pixel_red_green = _mm_set1_epi32((G << 16) | R);
+    const __m128i pixel_blue = _mm_set1_epi32(B);
+
+    // delta = 2 * ( ic - start ) for the 4 entries of a block
+    __m128i delta = _mm_slli_epi32(_mm_sub_epi32(lanes, _mm_set1_epi32(start)), 1);
+    __m128i min_key = _mm_set1_epi32(INT_MAX);
+
+    for ( int block = 0; block < num_blocks; block++ ) {
+      __m128i red_green = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) (pairs.red_green + 8 * block)), pixel_red_green);
+      __m128i blue_zero = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) (pairs.blue_zero + 8 * block)), pixel_blue);
+      __m128i dist = _mm_add_epi32(_mm_madd_epi16(red_green, red_green), _mm_madd_epi16(blue_zero, blue_zero));
+
+      // order = delta - 1 when delta > 0 and -delta otherwise
+      __m128i positive = _mm_cmpgt_epi32(delta, _mm_setzero_si128());
+      __m128i sign = _mm_srai_epi32(delta, 31);
+      __m128i order = _mm_sub_epi32(_mm_sub_epi32(_mm_xor_si128(delta, sign), sign), _mm_and_si128(positive, one));
+
+      __m128i key = _mm_or_si128(_mm_slli_epi32(dist, NEAREST_ORDER_BITS), order);
+
+      __m128i less = _mm_cmplt_epi32(key, min_key);
+      min_key = _mm_or_si128(_mm_and_si128(less, key), _mm_andnot_si128(less, min_key));
+
+      delta = _mm_add_epi32(delta, eight);
+    }
+
+    int keys[4];
+    _mm_storeu_si128((__m128i*) keys, min_key);
+
+    const int key = std::min(std::min(keys[0], keys[1]), std::min(keys[2], keys[3]));
+
+    out[ip] = DivQuantNearestPixel(red, green, blue, start, key);
+  }
+}
+
+__attribute__ ((target("avx2")))
+static
+void DivQuantNearestColorsAVX2(const uint32_t *pixels, const int num_pixels,
+                               const int16_t *red, const int16_t *green, const int16_t *blue, const int num_colors,
+                               const int *lut_init, uint32_t *out)
+{
+  Nearest_Pairs pairs;
+  DivQuantNearestPairs(red, green, blue, num_colors, &pairs);
+
+  const int num_blocks = (num_colors + 7) / 8;
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i sixteen = _mm256_set1_epi32(16);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  for ( int ip = 0; ip < num_pixels; ip++ ) {
+    const uint32_t pixel = pixels[ip];
+    const int R = (pixel >> 16) & 0xFF;
+    const int G = (pixel >> 8) & 0xFF;
+    const int B = pixel & 0xFF;
+    const int start = lut_init[R + G + B];
+
+    const __m256i pixel_red_green = _mm256_set1_epi32((G << 16) | R);
+    const __m256i pixel_blue = _mm256_set1_epi32(B);
+
+    // delta = 2 * ( ic - start ) for the 8 entries of a block
+    __m256i delta = _mm256_slli_epi32(_mm256_sub_epi32(lanes, _mm256_set1_epi32(start)), 1);
+    __m256i min_key = _mm256_set1_epi32(INT_MAX);
+
+    for ( int block = 0; block < num_blocks; block++ ) {
+      __m256i red_green = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) (pairs.red_green + 16 * block)), pixel_red_green);
+      __m256i blue_zero = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) (pairs.blue_zero + 16 * block)), pixel_blue);
+      __m256i dist = _mm256_add_epi32(_mm256_madd_epi16(red_green, red_green), _mm256_madd_epi16(blue_zero, blue_zero));
+
+      // order = delta - 1 when delta > 0 and -delta otherwise
+      __m256i positive = _mm256_cmpgt_epi32(delta, _mm256_setzero_si256());
+      __m256i order = _mm256_sub_epi32(_mm256_abs_epi32(delta), _mm256_and_si256(positive, one));
+
+      __m256i key = _mm256_or_si256(_mm256_slli_epi32(dist, NEAREST_ORDER_BITS), order);
+
+      min_key = _mm256_min_epi32(min_key, key);
+
+      delta = _mm256_add_epi32(delta, sixteen);
+    }
+
+    __m128i min4 = _mm_min_epi32(_mm256_castsi256_si128(min_key), _mm256_extracti128_si256(min_key, 1));
+    min4 = _mm_min_epi32(min4, _mm_shuffle_epi32(min4, _MM_SHUFFLE(1, 0, 3, 2)));
+    min4 = _mm_min_epi32(min4, _mm_shuffle_epi32(min4, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    out[ip] = DivQuantNearestPixel(red, green, blue, start, _mm_cvtsi128_si32(min4));
+  }
+}
+
+#endif // DIVQUANT_X86_SIMD
+
+void DivQuantNearestColors(const int simd_level, const uint32_t *pixels, const int num_pixels,
+                           const int16_t *red, const int16_t *green, const int16_t *blue, const int num_colors,
+                           const int *lut_init, uint32_t *out)
+{
+  assert(num_colors > 0 && num_colors <= NEAREST_MAX_COLORS);
+
+#if defined(DIVQUANT_X86_SIMD)
+  if (simd_level >= DIVQUANT_SIMD_AVX2) {
+    DivQuantNearestColorsAVX2(pixels, num_pixels, red, green, blue, num_colors, lut_init, out);
+    return;
+  }
+  if (simd_level >= DIVQUANT_SIMD_SSE2) {
+    DivQuantNearestColorsSSE2(pixels, num_pixels, red, green, blue, num_colors, lut_init, out);
+    return;
+  }
+#endif // DIVQUANT_X86_SIMD
+
+  DivQuantNearestColorsScalar(pixels, num_pixels, red, green, blue, num_colors, lut_init, out);
+}
@@ -0,0 +1,249 @@
+// A minimal persistent thread pool used to run data parallel loops. The
+// calling thread participates in the work, so a pool created with N threads
+// starts N-1 worker threads. A set of work stealing queues is also defined
+// here for tasks that create more tasks as they run.
+
+#ifndef DivQuantThreadPool_h
+#define DivQuantThreadPool_h
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class DivQuantThreadPool
+{
+public:
+  explicit DivQuantThreadPool(int numThreads)
+  : numThreads(numThreads < 1 ? 1 : numThreads), generation(0), shutdown(false), func(nullptr), numTasks(0), numBusy(0)
+  {
+    for ( int i = 1; i < this->numThreads; i++ ) {
+      workers.push_back(std::thread(&DivQuantThreadPool::workerLoop, this));
+    }
+  }
+
+  ~DivQuantThreadPool()
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      shutdown = true;
+    }
+    wakeCond.notify_all();
+    for ( std::thread & worker : workers ) {
+      worker.join();
+    }
+  }
+
+  int getNumThreads() const
+  {
+    return numThreads;
+  }
+
+  // Invoke func(taskIndex) once for each taskIndex in [0, numTasks) and return
+  // once all the tasks have completed. Tasks are claimed in index order by
+  // whichever thread is available, so func must not depend on the thread it
+  // is invoked on. Calls to parallel_for must not be nested.
+
+  void parallel_for(const int numTasks, const std::function<void(int)> & func)
+  {
+    if (numTasks <= 0) {
+      return;
+    }
+
+    if (numThreads == 1 || numTasks == 1) {
+      for ( int i = 0; i < numTasks; i++ ) {
+        func(i);
+      }
+      return;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      this->func = &func;
+      this->numTasks = numTasks;
+      nextTask.store(0);
+      numBusy = (int) workers.size();
+      generation++;
+    }
+    wakeCond.notify_all();
+
+    runTasks(func, numTasks);
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      doneCond.wait(lock, [this]{ return numBusy == 0; });
+      this->func = nullptr;
+    }
+  }
+
+private:
+  void runTasks(const std::function<void(int)> & func, const int numTasks)
+  {
+    for ( ;; ) {
+      int taskIndex = nextTask.fetch_add(1);
+      if (taskIndex >= numTasks) {
+        break;
+      }
+      func(taskIndex);
+    }
+  }
+
+  void workerLoop()
+  {
+    uint64_t seenGeneration = 0;
+
+    for ( ;; ) {
+      const std::function<void(int)> *workerFunc;
+      int workerNumTasks;
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wakeCond.wait(lock, [this, seenGeneration]{ return shutdown || generation != seenGeneration; });
+        if (shutdown) {
+          return;
+        }
+        seenGeneration = generation;
+        workerFunc = func;
+        workerNumTasks = numTasks;
+      }
+
+      runTasks(*workerFunc, workerNumTasks);
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        numBusy--;
+        if (numBusy == 0) {
+          doneCond.notify_one();
+        }
+      }
+    }
+  }
+
+  const int numThreads;
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable wakeCond;
+  std::condition_variable doneCond;
+
+  uint64_t generation;
+  bool shutdown;
+  const std::function<void(int)> *func;
+  int numTasks;
+  int numBusy;
+  std::atomic<int> nextTask;
+
+  DivQuantThreadPool(const DivQuantThreadPool &) = delete;
+  DivQuantThreadPool & operator=(const DivQuantThreadPool &) = delete;
+};
+
+// One work queue for each thread of a pool. Each queue is a max heap
+// ordered by Less. A thread runs the largest task in its own queue first
+// and when its own queue is empty it steals the largest task from the
+// queue of another thread.
+
+template <typename T, typename Less>
+class DivQuantWorkQueues
+{
+public:
+  DivQuantWorkQueues(int numQueues, const Less & less)
+  : queues(numQueues < 1 ? 1 : numQueues), less(less), numItems(0), stopped(false)
+  {
+  }
+
+  void push(const int queueIndex, const T & item)
+  {
+    {
+      std::unique_lock<std::mutex> lock(queues[queueIndex].mutex);
+      std::vector<T> & items = queues[queueIndex].items;
+      items.push_back(item);
+      std::push_heap(items.begin(), items.end(), less);
+    }
+    numItems.fetch_add(1);
+    {
+      std::unique_lock<std::mutex> lock(waitMutex);
+    }
+    waitCond.notify_one();
+  }
+
+  // Take a task from queueIndex or steal one from another queue. When wait
+  // is true, block until a task is available or stop() has been invoked.
+  // Returns false when no task was taken.
+
+  bool pop(const int queueIndex, T & item, const bool wait)
+  {
+    for ( ;; ) {
+      if (stopped.load()) {
+        return false;
+      }
+
+      if (tryPop(queueIndex, item)) {
+        return true;
+      }
+
+      if (!wait) {
+        return false;
+      }
+
+      std::unique_lock<std::mutex> lock(waitMutex);
+      waitCond.wait(lock, [this]{ return stopped.load() || numItems.load() > 0; });
+    }
+  }
+
+  // Wake all waiting threads, pop() returns false from now on
+
+  void stop()
+  {
+    {
+      std::unique_lock<std::mutex> lock(waitMutex);
+      stopped.store(true);
+    }
+    waitCond.notify_all();
+  }
+
+private:
+  bool tryPop(const int queueIndex, T & item)
+  {
+    const int numQueues = (int) queues.size();
+
+    for ( int i = 0; i < numQueues; i++ ) {
+      const int qi = (queueIndex + i) % numQueues;
+      std::unique_lock<std::mutex> lock(queues[qi].mutex);
+      std::vector<T> & items = queues[qi].items;
+      if (items.empty()) {
+        continue;
+      }
+      std::pop_heap(items.begin(), items.end(), less);
+      item = items.back();
+      items.pop_back();
+      numItems.fetch_sub(1);
+      return true;
+    }
+
+    return false;
+  }
+
+  struct Queue
+  {
+    std::mutex mutex;
+    std::vector<T> items;
+  };
+
+  std::vector<Queue> queues;
+  const Less less;
+
+  std::mutex waitMutex;
+  std::condition_variable waitCond;
+  std::atomic<int> numItems;
+  std::atomic<bool> stopped;
+
+  DivQuantWorkQueues(const DivQuantWorkQueues &) = delete;
+  DivQuantWorkQueues & operator=(const DivQuantWorkQueues &) = delete;
+};
+
+#endif // DivQuantThreadPool_h
@@ -45,6 +45,22 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
   //  int dec_factor = 1;
   //  int num_bits = 6;
   
+  Quant_Options options;
+  memset(&options, 0, sizeof(options));
+  
+  // Split each cluster range in place instead of rescanning all points
+  options.inplace_partition = 1;
+  
+  // Split large clusters with multiple threads
+  //options.num_threads = 4;
+  
+  // Split many small clusters at the same time with num_threads threads
+  //options.split_tasks = 1;
+  
+  // Stop the local k-means iterations of a split once the means stop
+  // changing, the result is the same as running all max_iters iterations
+  options.lkm_converge = 1;
+  
   if (displayTimings) {
     t1 = clock();
   }
@@ -57,7 +73,7 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
     fprintf(stdout, "quant_varpart_fast() input pixels adler 0x%08X\n", (int)adlerSig);
   }
   
-  quant_varpart_fast( numPixels, inPixelsPtr, outPixelsPtr, 1, numPixels, numClustersPtr, outColortablePtr, num_bits, dec_factor, max_iters, allPixelsUnique);
+  quant_varpart_fast( numPixels, inPixelsPtr, outPixelsPtr, 1, numPixels, numClustersPtr, outColortablePtr, num_bits, dec_factor, max_iters, allPixelsUnique, &options);
   
   if (displayTimings) {
     t2 = clock();
@@ -134,14 +150,18 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
     }
   }
 
-  // Map input pixels through the colortable
+  // Map input pixels through the colortable, when the input is the raw image
+  // instead of the unique pixels each unique color is only searched once
+  
+  Map_Options mapOptions;
+  memset(&mapOptions, 0, sizeof(mapOptions));
   
-  map_colors_mps ( inPixelsPtr, numPixels, outPixelsPtr, outColortablePtr, act_num_colors );
+  map_colors ( inPixelsPtr, numPixels, outPixelsPtr, outColortablePtr, act_num_colors, &mapOptions );
   
   if (displayTimings) {
     t2 = clock();
     elapsed = timediff(t1, t2);
-    printf("map_colors_mps() elapsed: %ld ms aka %0.2f s\n", elapsed, elapsed/1000.0f);
+    printf("map_colors() elapsed: %ld ms aka %0.2f s\n", elapsed, elapsed/1000.0f);
   }
   
   if ((0)) {
@@ -157,3 +177,129 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
   return;
 }
 
+// Unique pixels are found with a bitmap of the 2^24 RGB values when all the pixels are
+// opaque and no counts are needed, the bitmap (2 MB) is then scanned in increasing order.
+// Otherwise the pixels are sorted with a LSD radix sort of 8 bit digits that skips a digit
+// when every pixel has the same value for it (the alpha digit of an opaque image), then
+// runs of the same pixel are combined. The radix sort uses one temporary buffer of
+// numPixels values.
+
+static
+void radix_sort_pixels ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *tmpPixelsPtr )
+{
+  uint32_t counts[4][256];
+  memset(counts, 0, sizeof(counts));
+  
+  for ( uint32_t i = 0; i < numPixels; i++ ) {
+    uint32_t pixel = inPixelsPtr[i];
+    counts[0][pixel & 0xFF]++;
+    counts[1][(pixel >> 8) & 0xFF]++;
+    counts[2][(pixel >> 16) & 0xFF]++;
+    counts[3][pixel >> 24]++;
+  }
+  
+  // The digits that need a pass, the last pass writes to outPixelsPtr
+  
+  int passes[4];
+  int numPasses = 0;
+  
+  for ( int digit = 0; digit < 4; digit++ ) {
+    uint32_t first = (inPixelsPtr[0] >> (digit * 8)) & 0xFF;
+    if (counts[digit][first] != numPixels) {
+      passes[numPasses++] = digit;
+    }
+  }
+  
+  if (numPasses == 0) {
+    memcpy(outPixelsPtr, inPixelsPtr, numPixels * sizeof(uint32_t));
+    return;
+  }
+  
+  const uint32_t *src = inPixelsPtr;
+  
+  for ( int pass = 0; pass < numPasses; pass++ ) {
+    const int shift = passes[pass] * 8;
+    
+    // With an even number of passes the first pass writes to outPixelsPtr
+    uint32_t *dst = (((numPasses - pass) % 2) == 1) ? outPixelsPtr : tmpPixelsPtr;
+    
+    uint32_t offsets[256];
+    uint32_t offset = 0;
+    
+    for ( int bucket = 0; bucket < 256; bucket++ ) {
+      offsets[bucket] = offset;
+      offset += counts[passes[pass]][bucket];
+    }
+    
+    for ( uint32_t i = 0; i < numPixels; i++ ) {
+      uint32_t pixel = src[i];
+      dst[offsets[(pixel >> shift) & 0xFF]++] = pixel;
+    }
+    
+    src = dst;
+  }
+}
+
+uint32_t unique_sorted_pixels ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *outCountsPtr )
+{
+  if (numPixels == 0) {
+    return 0;
+  }
+  
+  uint32_t alphaAnd = 0xFF000000;
+  
+  if (outCountsPtr == NULL) {
+    for ( uint32_t i = 0; i < numPixels; i++ ) {
+      alphaAnd &= inPixelsPtr[i];
+    }
+  }
+  
+  uint32_t numUnique = 0;
+  
+  if (outCountsPtr == NULL && alphaAnd == 0xFF000000) {
+    // All pixels are opaque
+    
+    const uint32_t numWords = (1 << 24) / 64;
+    vector<uint64_t> seen(numWords);
+    
+    for ( uint32_t i = 0; i < numPixels; i++ ) {
+      uint32_t rgb = inPixelsPtr[i] & 0x00FFFFFF;
+      seen[rgb >> 6] |= (1ULL << (rgb & 63));
+    }
+    
+    for ( uint32_t wi = 0; wi < numWords; wi++ ) {
+      uint64_t word = seen[wi];
+      while (word != 0) {
+        uint32_t bit = __builtin_ctzll(word);
+        outPixelsPtr[numUnique++] = 0xFF000000 | (wi << 6) | bit;
+        word &= word - 1;
+      }
+    }
+    
+    return numUnique;
+  }
+  
+  vector<uint32_t> tmpPixels(numPixels);
+  
+  radix_sort_pixels(numPixels, inPixelsPtr, outPixelsPtr, tmpPixels.data());
+  
+  // Combine runs of the same pixel in place
+  
+  uint32_t runLength = 1;
+  
+  for ( uint32_t i = 1; i <= numPixels; i++ ) {
+    if (i < numPixels && outPixelsPtr[i] == outPixelsPtr[i-1]) {
+      runLength++;
+      continue;
+    }
+    
+    outPixelsPtr[numUnique] = outPixelsPtr[i-1];
+    if (outCountsPtr != NULL) {
+      outCountsPtr[numUnique] = runLength;
+    }
+    numUnique++;
+    runLength = 1;
+  }
+  
+  return numUnique;
+}
@@ -9,6 +9,12 @@ extern "C" {
     
   void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outColorTableOffsetPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique );
   
+  // Write the unique pixels of inPixelsPtr to outPixelsPtr in increasing order and return
+  // the number of unique pixels. When outCountsPtr is not NULL the number of times each
+  // unique pixel appears is written to it. Both outputs must have room for numPixels values.
+  
+  uint32_t unique_sorted_pixels ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *outCountsPtr );
+  
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1704 @@
+// This program times specific stages of the quant logic. Each benchmark is
+// selected by name on the command line and prints one line of results for
+// each configuration. When a PNG filename is passed, the pixels of that image
+// are used as input, otherwise synthetic pixels are generated.
+//
+// usage: DivQuantBench BENCH [PNG]
+
+#include "PngContext.h"
+
+#include "DivQuantHeader.h"
+
+#include "quant_util.h"
+
+#include "CalcError.h"
+
+#include <chrono>
+#include <unordered_map>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <assert.h>
+
+using namespace std;
+
+// Wall clock time in ms, clock() cannot be used since it reports
+// the CPU time of all threads.
+
+static inline
+double bench_now_ms()
+{
+  auto now = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(now.time_since_epoch()).count();
+}
+
+// Generate numPixels unique 24 bit pixels in a pseudo random order. Multiplication
+// by an odd constant is a bijection modulo 2^24 so no pixel is repeated.
+
+static
+vector<uint32_t> bench_synthetic_unique_pixels(int numPixels)
+{
+  assert(numPixels <= (1 << 24));
+
+  vector<uint32_t> pixels(numPixels);
+
+  for ( int i = 0; i < numPixels; i++ ) {
+    pixels[i] = ((uint32_t)i * 2654435761U) & 0x00FFFFFF;
+  }
+
+  return pixels;
+}
+
+// Generate a width x height image made up of smooth gradients with a small
+// amount of noise, this has roughly as many unique colors as a photo.
+
+static
+vector<uint32_t> bench_synthetic_image(int width, int height)
+{
+  vector<uint32_t> pixels(width * height);
+
+  uint32_t seed = 1;
+
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < width; x++ ) {
+      seed = seed * 1664525U + 1013904223U;
+      uint32_t noise = seed >> 29;
+
+      uint32_t R = (x * 255) / width;
+      uint32_t G = (y * 255) / height;
+      uint32_t B = ((x + y) * 255) / (width + height);
+
+      R = min(255U, R + noise);
+      G = min(255U, G + ((noise * 3) & 0x7));
+      B = min(255U, B + ((noise * 5) & 0x7));
+
+      pixels[y * width + x] = (0xFFU << 24) | (R << 16) | (G << 8) | B;
+    }
+  }
+
+  return pixels;
+}
+
+// Return the sorted unique pixels from an image with the alpha channel ignored
+
+static
+vector<uint32_t> bench_unique_pixels(const vector<uint32_t> & pixels)
+{
+  vector<uint32_t> unique(pixels);
+
+  for ( uint32_t & pixel : unique ) {
+    pixel &= 0x00FFFFFF;
+  }
+
+  sort(begin(unique), end(unique));
+  unique.erase(std::unique(begin(unique), end(unique)), end(unique));
+
+  return unique;
+}
+
+// Cluster unique points into K clusters for increasing K. The cost of each
+// additional split (reported relative to the previous K) should not grow with K
+// since the cluster with the max TSE is found with a heap and each split only
+// touches the points in its own range.
+
+static
+void bench_split_select(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> points;
+
+  if (imagePixels.size() > 0) {
+    points = bench_unique_pixels(imagePixels);
+  } else {
+    points = bench_synthetic_unique_pixels(1 << 20);
+  }
+
+  const int numPoints = (int) points.size();
+
+  printf("split_select: %d unique points\n", numPoints);
+
+  Quant_Options options;
+  memset(&options, 0, sizeof(options));
+  options.inplace_partition = 1;
+
+  int ks[] = { 256, 1024, 4096, 16384, 65536 };
+
+  int prevK = 1;
+  double prevElapsed = 0.0;
+
+  for ( int k : ks ) {
+    if (k > numPoints) {
+      break;
+    }
+
+    vector<uint32_t> tmpPixels(numPoints);
+    vector<uint32_t> colortable(k);
+    uint32_t numClusters = k;
+
+    double t1 = bench_now_ms();
+
+    quant_varpart_fast(numPoints, points.data(), tmpPixels.data(), 1, numPoints, &numClusters, colortable.data(), 8, 1, 10, 1, &options);
+
+    double t2 = bench_now_ms();
+    double elapsed = t2 - t1;
+
+    double usPerSplit = ((elapsed - prevElapsed) * 1000.0) / (k - prevK);
+
+    printf("K %6d : %9.2f ms : %7.2f us per additional split : %d clusters\n", k, elapsed, usPerSplit, (int)numClusters);
+
+    prevK = k;
+    prevElapsed = elapsed;
+  }
+}
+
+// Cluster a large number of unique points into 256 clusters with an
+// increasing number of threads. The first splits process nearly all of the
+// points, so these splits are divided among the threads.
+
+static
+void bench_split_threads(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> points;
+
+  if (imagePixels.size() > 0) {
+    points = bench_unique_pixels(imagePixels);
+  } else {
+    points = bench_synthetic_unique_pixels(1 << 22);
+  }
+
+  const int numPoints = (int) points.size();
+  const int maxThreads = (int) thread::hardware_concurrency();
+
+  printf("split_threads: %d unique points, %d hardware threads\n", numPoints, maxThreads);
+
+  double singleElapsed = 0.0;
+
+  for ( int numThreads = 1; numThreads <= 32; numThreads *= 2 ) {
+    if (numThreads > 1 && numThreads > maxThreads) {
+      break;
+    }
+
+    Quant_Options options;
+    memset(&options, 0, sizeof(options));
+    options.inplace_partition = 1;
+    options.num_threads = numThreads;
+
+    vector<uint32_t> tmpPixels(numPoints);
+    vector<uint32_t> colortable(256);
+    uint32_t numClusters = 256;
+
+    double t1 = bench_now_ms();
+
+    quant_varpart_fast(numPoints, points.data(), tmpPixels.data(), 1, numPoints, &numClusters, colortable.data(), 8, 1, 10, 1, &options);
+
+    double t2 = bench_now_ms();
+    double elapsed = t2 - t1;
+
+    if (numThreads == 1) {
+      singleElapsed = elapsed;
+    }
+
+    printf("threads %2d : %9.2f ms : speedup %5.2f\n", numThreads, elapsed, singleElapsed / elapsed);
+  }
+}
+
+// Cluster unique points into K clusters for K of at least 256 with an
+// increasing number of threads, with and without splitting multiple small
+// clusters at the same time. Each result is compared to the colortable
+// generated with 1 thread since the split order must not change.
+
+static
+void bench_split_tasks(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> points;
+
+  if (imagePixels.size() > 0) {
+    points = bench_unique_pixels(imagePixels);
+  } else {
+    points = bench_synthetic_unique_pixels(1 << 22);
+  }
+
+  const int numPoints = (int) points.size();
+  const int maxThreads = (int) thread::hardware_concurrency();
+
+  printf("split_tasks: %d unique points, %d hardware threads\n", numPoints, maxThreads);
+
+  int ks[] = { 256, 1024, 4096 };
+
+  for ( int k : ks ) {
+    if (k > numPoints) {
+      break;
+    }
+
+    vector<uint32_t> serialColortable;
+    double singleElapsed = 0.0;
+
+    for ( int numThreads = 1; numThreads <= 32; numThreads *= 2 ) {
+      if (numThreads > 1 && numThreads > maxThreads) {
+        break;
+      }
+
+      for ( int splitTasks = 0; splitTasks < 2; splitTasks++ ) {
+        if (numThreads == 1 && splitTasks) {
+          continue;
+        }
+
+        Quant_Options options;
+        memset(&options, 0, sizeof(options));
+        options.inplace_partition = 1;
+        options.num_threads = numThreads;
+        options.split_tasks = splitTasks;
+
+        vector<uint32_t> tmpPixels(numPoints);
+        vector<uint32_t> colortable(k);
+        uint32_t numClusters = k;
+
+        double t1 = bench_now_ms();
+
+        quant_varpart_fast(numPoints, points.data(), tmpPixels.data(), 1, numPoints, &numClusters, colortable.data(), 8, 1, 10, 1, &options);
+
+        double t2 = bench_now_ms();
+        double elapsed = t2 - t1;
+
+        if (numThreads == 1) {
+          singleElapsed = elapsed;
+          serialColortable = colortable;
+        }
+
+        const char *same = (colortable == serialColortable) ? "same" : "DIFFERENT";
+
+        printf("K %5d : threads %2d : split_tasks %d : %9.2f ms : speedup %5.2f : %s\n", k, numThreads, splitTasks, elapsed, singleElapsed / elapsed, same);
+      }
+    }
+  }
+}
+
+// Cluster into 256 clusters with the local k-means kernels limited to each
+// SIMD level, both for the unique pixels (uniform weights) and for all the
+// pixels of the image (weighted by the number of times each color is used).
+
+static
+void bench_lkm(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("lkm: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  const char *levelNames[] = { "detect", "scalar", "sse2", "avx2" };
+
+  for ( int weighted = 0; weighted < 2; weighted++ ) {
+    const vector<uint32_t> & input = weighted ? pixels : points;
+    const int numPixels = (int) input.size();
+
+    vector<uint32_t> scalarColortable;
+    double scalarElapsed = 0.0;
+
+    for ( int level = DIVQUANT_SIMD_SCALAR; level <= DIVQUANT_SIMD_AVX2; level++ ) {
+      if (DivQuantSimdLevel(level) != level) {
+        printf("%s not supported\n", levelNames[level]);
+        continue;
+      }
+
+      Quant_Options options;
+      memset(&options, 0, sizeof(options));
+      options.inplace_partition = 1;
+      options.simd = level;
+
+      vector<uint32_t> tmpPixels(numPixels);
+      vector<uint32_t> colortable(256);
+      uint32_t numClusters = 256;
+
+      double t1 = bench_now_ms();
+
+      quant_varpart_fast(numPixels, input.data(), tmpPixels.data(), 1, numPixels, &numClusters, colortable.data(), 8, 1, 10, weighted ? 0 : 1, &options);
+
+      double t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      if (level == DIVQUANT_SIMD_SCALAR) {
+        scalarElapsed = elapsed;
+        scalarColortable = colortable;
+      }
+
+      const char *same = (colortable == scalarColortable) ? "same" : "DIFFERENT";
+
+      printf("%s : %-6s : %9.2f ms : speedup %5.2f : %s\n", weighted ? "weighted" : "uniform ", levelNames[level], elapsed, scalarElapsed / elapsed, same);
+    }
+  }
+}
+
+// Cluster the unique pixels into 256 clusters with the points stored as
+// packed pixels and as separate R, G, B planes, in both partition modes.
+// The planar result is compared to the packed result.
+
+static
+void bench_planar(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+  const int numPoints = (int) points.size();
+
+  printf("planar: %d unique points\n", numPoints);
+
+  for ( int inplace = 0; inplace < 2; inplace++ ) {
+    Quant_Options options;
+    memset(&options, 0, sizeof(options));
+    options.inplace_partition = inplace;
+
+    vector<uint32_t> tmpPixels(numPoints);
+    vector<uint32_t> packedColortable(256);
+    uint32_t numClusters = 256;
+
+    double t1 = bench_now_ms();
+
+    quant_varpart_fast(numPoints, points.data(), tmpPixels.data(), 1, numPoints, &numClusters, packedColortable.data(), 8, 1, 10, 1, &options);
+
+    double t2 = bench_now_ms();
+    double packedElapsed = t2 - t1;
+
+    printf("inplace %d : packed : %9.2f ms\n", inplace, packedElapsed);
+
+    vector<uint8_t> redPlane(numPoints), greenPlane(numPoints), bluePlane(numPoints);
+
+    for ( int i = 0; i < numPoints; i++ ) {
+      redPlane[i] = (points[i] >> 16) & 0xFF;
+      greenPlane[i] = (points[i] >> 8) & 0xFF;
+      bluePlane[i] = points[i] & 0xFF;
+    }
+
+    vector<uint32_t> planarColortable(256);
+    numClusters = 256;
+
+    t1 = bench_now_ms();
+
+    quant_varpart_planar(numPoints, redPlane.data(), greenPlane.data(), bluePlane.data(), nullptr, &numClusters, planarColortable.data(), 8, 10, &options);
+
+    t2 = bench_now_ms();
+    double planarElapsed = t2 - t1;
+
+    const char *same = (planarColortable == packedColortable) ? "same" : "DIFFERENT";
+
+    printf("inplace %d : planar : %9.2f ms : speedup %5.2f : %s\n", inplace, planarElapsed, packedElapsed / planarElapsed, same);
+  }
+}
+
+// Cluster into 256 clusters with the double local k-means test (with the
+// best SIMD kernels and scalar only) and with the fixed point test, for the
+// unique pixels (uniform weights) and for all the pixels of the image
+// (weighted). The quality of each result is the combined MSE of the image
+// pixels mapped to the colortable.
+
+static
+void bench_lkm_fixed(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("lkm_fixed: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  for ( int weighted = 0; weighted < 2; weighted++ ) {
+    const vector<uint32_t> & input = weighted ? pixels : points;
+    const int numPixels = (int) input.size();
+
+    double doubleElapsed = 0.0;
+    double doubleMSE = 0.0;
+
+    const char *modeNames[] = { "double", "scalar", "fixed" };
+
+    for ( int mode = 0; mode < 3; mode++ ) {
+      Quant_Options options;
+      memset(&options, 0, sizeof(options));
+      options.inplace_partition = 1;
+      options.simd = (mode == 1) ? DIVQUANT_SIMD_SCALAR : DIVQUANT_SIMD_DETECT;
+      options.fixed_point_lkm = (mode == 2);
+
+      vector<uint32_t> tmpPixels(numPixels);
+      vector<uint32_t> colortable(256);
+      uint32_t numClusters = 256;
+
+      double t1 = bench_now_ms();
+
+      quant_varpart_fast(numPixels, input.data(), tmpPixels.data(), 1, numPixels, &numClusters, colortable.data(), 8, 1, 10, weighted ? 0 : 1, &options);
+
+      double t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      vector<uint32_t> mapped(pixels.size());
+      map_colors_mps(pixels.data(), (uint32_t) pixels.size(), mapped.data(), colortable.data(), numClusters);
+
+      double mse = calc_combined_mean_sqr_error((uint32_t) pixels.size(), pixels.data(), mapped.data());
+
+      if (mode == 0) {
+        doubleElapsed = elapsed;
+        doubleMSE = mse;
+      }
+
+      printf("%s : %-6s : %9.2f ms : speedup %5.2f : MSE %8.4f (%+.4f%%)\n", weighted ? "weighted" : "uniform ", modeNames[mode], elapsed, doubleElapsed / elapsed, mse, ((mse - doubleMSE) * 100.0) / doubleMSE);
+    }
+  }
+}
+
+// Cluster into 256 clusters with the cut of each split at the mean of the
+// cutting axis and at the min squared error position found with a histogram,
+// for an increasing number of local k-means iterations. The quality of each
+// result is the combined MSE of the image pixels mapped to the colortable.
+
+static
+void bench_histogram_split(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("histogram_split: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  int iters[] = { 1, 2, 3, 5, 10 };
+
+  for ( int weighted = 0; weighted < 2; weighted++ ) {
+    const vector<uint32_t> & input = weighted ? pixels : points;
+    const int numPixels = (int) input.size();
+
+    for ( int maxIters : iters ) {
+      double meanElapsed = 0.0;
+
+      for ( int histogram = 0; histogram < 2; histogram++ ) {
+        Quant_Options options;
+        memset(&options, 0, sizeof(options));
+        options.inplace_partition = 1;
+        options.histogram_split = histogram;
+
+        vector<uint32_t> tmpPixels(numPixels);
+        vector<uint32_t> colortable(256);
+        uint32_t numClusters = 256;
+
+        double t1 = bench_now_ms();
+
+        quant_varpart_fast(numPixels, input.data(), tmpPixels.data(), 1, numPixels, &numClusters, colortable.data(), 8, 1, maxIters, weighted ? 0 : 1, &options);
+
+        double t2 = bench_now_ms();
+        double elapsed = t2 - t1;
+
+        vector<uint32_t> mapped(pixels.size());
+        map_colors_mps(pixels.data(), (uint32_t) pixels.size(), mapped.data(), colortable.data(), numClusters);
+
+        double mse = calc_combined_mean_sqr_error((uint32_t) pixels.size(), pixels.data(), mapped.data());
+
+        if (histogram == 0) {
+          meanElapsed = elapsed;
+        }
+
+        printf("%s : iters %2d : %-9s : %9.2f ms : speedup %5.2f : MSE %8.4f\n", weighted ? "weighted" : "uniform ", maxIters, histogram ? "histogram" : "mean", elapsed, meanElapsed / elapsed, mse);
+      }
+    }
+  }
+}
+
+// Cluster into 256 clusters with max_iters 10 and the local k-means
+// iterations of each split stopped once the means move less than the
+// tolerance. A tolerance of 0 gives the same colortable as running all the
+// iterations. Prints the mean number of iterations per split, the number of
+// splits that ran each number of iterations and the MSE of the image pixels
+// mapped to the colortable.
+
+static
+void bench_lkm_converge(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("lkm_converge: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  const int maxIters = 10;
+  double tolerances[] = { -1.0, 0.0, 0.01, 0.1, 0.5 };
+
+  for ( int weighted = 0; weighted < 2; weighted++ ) {
+    const vector<uint32_t> & input = weighted ? pixels : points;
+    const int numPixels = (int) input.size();
+
+    vector<uint32_t> fullColortable;
+    double fullElapsed = 0.0;
+
+    for ( double tolerance : tolerances ) {
+      vector<int> lkmIters(255);
+
+      Quant_Options options;
+      memset(&options, 0, sizeof(options));
+      options.inplace_partition = 1;
+      options.lkm_converge = (tolerance >= 0.0);
+      options.lkm_tolerance = max(tolerance, 0.0);
+      options.lkm_iters = lkmIters.data();
+
+      vector<uint32_t> tmpPixels(numPixels);
+      vector<uint32_t> colortable(256);
+      uint32_t numClusters = 256;
+
+      double t1 = bench_now_ms();
+
+      quant_varpart_fast(numPixels, input.data(), tmpPixels.data(), 1, numPixels, &numClusters, colortable.data(), 8, 1, maxIters, weighted ? 0 : 1, &options);
+
+      double t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      if (tolerance < 0.0) {
+        fullElapsed = elapsed;
+        fullColortable = colortable;
+      }
+
+      vector<uint32_t> mapped(pixels.size());
+      map_colors_mps(pixels.data(), (uint32_t) pixels.size(), mapped.data(), colortable.data(), numClusters);
+
+      double mse = calc_combined_mean_sqr_error((uint32_t) pixels.size(), pixels.data(), mapped.data());
+
+      int iterCounts[maxIters + 1] = { 0 };
+      int totalIters = 0;
+
+      for ( int iters : lkmIters ) {
+        iterCounts[iters]++;
+        totalIters += iters;
+      }
+
+      const char *same = (colortable == fullColortable) ? "same" : "DIFFERENT";
+
+      if (tolerance < 0.0) {
+        printf("%s : all iters : %9.2f ms : speedup %5.2f : %5.2f iters per split : MSE %8.4f : %s\n", weighted ? "weighted" : "uniform ", elapsed, fullElapsed / elapsed, totalIters / 255.0, mse, same);
+      } else {
+        printf("%s : tol %5.2f : %9.2f ms : speedup %5.2f : %5.2f iters per split : MSE %8.4f : %s\n", weighted ? "weighted" : "uniform ", tolerance, elapsed, fullElapsed / elapsed, totalIters / 255.0, mse, same);
+      }
+
+      printf("  splits by iters :");
+      for ( int iters = 1; iters <= maxIters; iters++ ) {
+        printf(" %d", iterCounts[iters]);
+      }
+      printf("\n");
+    }
+  }
+}
+
+// Cluster into 256 clusters with every local k-means iteration testing all
+// the points and with only the points near the hyperplane tested again, for
+// increasing max_iters. With uniform weights the band result must be the
+// same colortable, with weights the sums are added in a different order.
+
+static
+void bench_lkm_band(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("lkm_band: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  int iters[] = { 5, 10, 20 };
+
+  for ( int weighted = 0; weighted < 2; weighted++ ) {
+    const vector<uint32_t> & input = weighted ? pixels : points;
+    const int numPixels = (int) input.size();
+
+    for ( int maxIters : iters ) {
+      vector<uint32_t> fullColortable;
+      double fullElapsed = 0.0;
+
+      for ( int band = 0; band < 2; band++ ) {
+        Quant_Options options;
+        memset(&options, 0, sizeof(options));
+        options.inplace_partition = 1;
+        options.lkm_band = band;
+
+        vector<uint32_t> tmpPixels(numPixels);
+        vector<uint32_t> colortable(256);
+        uint32_t numClusters = 256;
+
+        double t1 = bench_now_ms();
+
+        quant_varpart_fast(numPixels, input.data(), tmpPixels.data(), 1, numPixels, &numClusters, colortable.data(), 8, 1, maxIters, weighted ? 0 : 1, &options);
+
+        double t2 = bench_now_ms();
+        double elapsed = t2 - t1;
+
+        if (band == 0) {
+          fullElapsed = elapsed;
+          fullColortable = colortable;
+        }
+
+        vector<uint32_t> mapped(pixels.size());
+        map_colors_mps(pixels.data(), (uint32_t) pixels.size(), mapped.data(), colortable.data(), numClusters);
+
+        double mse = calc_combined_mean_sqr_error((uint32_t) pixels.size(), pixels.data(), mapped.data());
+
+        const char *same = (colortable == fullColortable) ? "same" : "DIFFERENT";
+
+        printf("%s : iters %2d : %-4s : %9.2f ms : speedup %5.2f : MSE %8.4f : %s\n", weighted ? "weighted" : "uniform ", maxIters, band ? "band" : "full", elapsed, fullElapsed / elapsed, mse, same);
+      }
+    }
+  }
+}
+
+// Time the color histogram of calc_color_table for an image with many unique
+// colors, for the same pixels with 5 bits per channel, with decimation and
+// for a small image. The unique colors and the sum of the weights are
+// checked against a sort of the sampled pixels.
+
+static
+void bench_color_table(const vector<uint32_t> & imagePixels, int width, int height)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    width = 4096;
+    height = 2160;
+    pixels = bench_synthetic_image(width, height);
+  }
+
+  printf("color_table: %d x %d pixels\n", width, height);
+
+  struct {
+    const char *name;
+    int numBits;
+    int decFactor;
+    int small;
+  } configs[] = {
+    { "8 bits      ", 8, 1, 0 },
+    { "5 bits      ", 5, 1, 0 },
+    { "8 bits dec 2", 8, 2, 0 },
+    { "8 bits small", 8, 1, 1 },
+  };
+
+  for ( auto & config : configs ) {
+    int numCols = width;
+    int numRows = height;
+
+    if (config.small) {
+      numCols = min(width, 640);
+      numRows = min(height, 480);
+    }
+
+    vector<uint32_t> input(numRows * numCols);
+
+    for ( int row = 0; row < numRows; row++ ) {
+      for ( int col = 0; col < numCols; col++ ) {
+        input[row * numCols + col] = pixels[row * width + col];
+      }
+    }
+
+    if (config.numBits != 8) {
+      cut_bits(input.data(), (uint32_t) input.size(), input.data(), config.numBits, config.numBits, config.numBits);
+    }
+
+    vector<uint32_t> sampled;
+
+    for ( int row = 0; row < numRows; row += config.decFactor ) {
+      for ( int col = 0; col < numCols; col += config.decFactor ) {
+        sampled.push_back(input[row * numCols + col]);
+      }
+    }
+
+    vector<uint32_t> expected = bench_unique_pixels(sampled);
+
+    vector<uint32_t> outPixels(input.size());
+    int numColors = 0;
+
+    double t1 = bench_now_ms();
+
+    double *weights = calc_color_table(input.data(), (uint32_t) input.size(), outPixels.data(), numRows, numCols, config.decFactor, &numColors);
+
+    double t2 = bench_now_ms();
+
+    double weightSum = 0.0;
+
+    for ( int i = 0; i < numColors; i++ ) {
+      weightSum += weights[i];
+    }
+
+    delete [] weights;
+
+    outPixels.resize(numColors);
+    sort(begin(outPixels), end(outPixels));
+
+    const char *valid = (outPixels == expected && fabs(weightSum - 1.0) < 1.0e-6) ? "valid" : "INVALID";
+
+    printf("%s : %8d unique : %9.2f ms : %s\n", config.name, numColors, t2 - t1, valid);
+  }
+}
+
+// Time cut_bits followed by calc_color_table against the fused
+// calc_cut_color_table for each SIMD level, for 5, 6 and 7 bits per channel
+// with and without decimation. The colors and weights must be the same (in
+// the same order) as from the two pass version.
+
+static
+void bench_cut_color_table(const vector<uint32_t> & imagePixels, int width, int height)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    width = 4096;
+    height = 2160;
+    pixels = bench_synthetic_image(width, height);
+  }
+
+  const int numPixels = (int) pixels.size();
+
+  printf("cut_color_table: %d x %d pixels\n", width, height);
+
+  const char *levelNames[] = { "detect", "scalar", "sse2", "avx2" };
+
+  for ( int numBits = 5; numBits <= 7; numBits++ ) {
+    for ( int decFactor = 1; decFactor <= 2; decFactor++ ) {
+      vector<uint32_t> tmpPixels(numPixels);
+      int numColors = 0;
+
+      double t1 = bench_now_ms();
+
+      cut_bits(pixels.data(), numPixels, tmpPixels.data(), numBits, numBits, numBits);
+      double *weights = calc_color_table(tmpPixels.data(), numPixels, tmpPixels.data(), height, width, decFactor, &numColors);
+
+      double t2 = bench_now_ms();
+      double twoPassElapsed = t2 - t1;
+
+      vector<uint32_t> colors(tmpPixels.begin(), tmpPixels.begin() + numColors);
+
+      printf("bits %d : dec %d : two pass : %8d unique : %9.2f ms\n", numBits, decFactor, numColors, twoPassElapsed);
+
+      for ( int level = DIVQUANT_SIMD_SCALAR; level <= DIVQUANT_SIMD_AVX2; level++ ) {
+        if (DivQuantSimdLevel(level) != level) {
+          continue;
+        }
+
+        vector<uint32_t> outPixels(numPixels);
+        int numFused = 0;
+
+        t1 = bench_now_ms();
+
+        double *fusedWeights = calc_cut_color_table(pixels.data(), numPixels, outPixels.data(), height, width, decFactor, numBits, level, &numFused);
+
+        t2 = bench_now_ms();
+        double elapsed = t2 - t1;
+
+        bool valid = (numFused == numColors) && equal(colors.begin(), colors.end(), outPixels.begin());
+
+        for ( int i = 0; valid && i < numColors; i++ ) {
+          valid = (fusedWeights[i] == weights[i]);
+        }
+
+        delete [] fusedWeights;
+
+        printf("bits %d : dec %d : %-8s : %8d unique : %9.2f ms : speedup %5.2f : %s\n", numBits, decFactor, levelNames[level], numFused, elapsed, twoPassElapsed / elapsed, valid ? "same" : "DIFFERENT");
+      }
+
+      delete [] weights;
+    }
+  }
+}
+
+// Time calc_color_table_threads for an increasing number of threads. The
+// colors are counted in place, as quant_varpart_fast does, and the colors and
+// weights must be the same (in the same order) as from calc_color_table.
+
+static
+void bench_color_table_threads(const vector<uint32_t> & imagePixels, int width, int height)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    width = 4096;
+    height = 2160;
+    pixels = bench_synthetic_image(width, height);
+  }
+
+  printf("color_table_threads: %d x %d pixels, %d hardware threads\n", width, height, (int) thread::hardware_concurrency());
+
+  int threads[] = { 1, 2, 4, 8 };
+
+  for ( int decFactor = 1; decFactor <= 2; decFactor++ ) {
+    vector<uint32_t> serialPixels(pixels.size());
+    int serialColors = 0;
+
+    double *serialWeights = calc_color_table(pixels.data(), (uint32_t) pixels.size(), serialPixels.data(), height, width, decFactor, &serialColors);
+
+    double serialElapsed = 0.0;
+
+    for ( int numThreads : threads ) {
+      vector<uint32_t> inOutPixels(pixels);
+      int numColors = 0;
+
+      double t1 = bench_now_ms();
+
+      double *weights = calc_color_table_threads(inOutPixels.data(), (uint32_t) inOutPixels.size(), inOutPixels.data(), height, width, decFactor, numThreads, &numColors);
+
+      double t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      if (numThreads == 1) {
+        serialElapsed = elapsed;
+      }
+
+      bool same = (numColors == serialColors);
+
+      for ( int i = 0; same && i < numColors; i++ ) {
+        same = (inOutPixels[i] == serialPixels[i]) && (weights[i] == serialWeights[i]);
+      }
+
+      delete [] weights;
+
+      printf("dec %d : %d threads : %8d unique : %9.2f ms : speedup %5.2f : %s\n", decFactor, numThreads, numColors, elapsed, serialElapsed / elapsed, same ? "same" : "DIFFERENT");
+    }
+
+    delete [] serialWeights;
+  }
+}
+
+// Producer threads add the rows of an image to a Shared_Histogram at the same
+// time, each thread adds every Nth row as a decoder thread would. This is
+// timed for 1 to 32 threads for an image with many colors and for the same
+// image cut to 2 bits per channel (64 colors with no long runs), where every
+// thread updates the same few counts. The colors and weights must be the
+// same as from calc_color_table once sorted. The weighted colors are then
+// clustered with quant_varpart_weighted.
+
+static
+void bench_shared_histogram(const vector<uint32_t> & imagePixels, int width, int height)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    width = 4096;
+    height = 2160;
+    pixels = bench_synthetic_image(width, height);
+  }
+
+  printf("shared_histogram: %d x %d pixels, %d hardware threads\n", width, height, (int) thread::hardware_concurrency());
+
+  int threads[] = { 1, 2, 4, 8, 16, 32 };
+
+  for ( int fewColors = 0; fewColors < 2; fewColors++ ) {
+    vector<uint32_t> input(pixels);
+
+    if (fewColors) {
+      cut_bits(input.data(), (uint32_t) input.size(), input.data(), 2, 2, 2);
+    }
+
+    // Expected colors and weights in color order
+
+    vector<uint32_t> expectedPixels(input.size());
+    int expectedColors = 0;
+
+    double *expectedWeights = calc_color_table(input.data(), (uint32_t) input.size(), expectedPixels.data(), height, width, 1, &expectedColors);
+
+    vector<pair<uint32_t, double>> expected(expectedColors);
+
+    for ( int i = 0; i < expectedColors; i++ ) {
+      expected[i] = make_pair(expectedPixels[i], expectedWeights[i]);
+    }
+
+    sort(begin(expected), end(expected));
+
+    delete [] expectedWeights;
+
+    for ( int uniqueOnly = 0; uniqueOnly < 2; uniqueOnly++ ) {
+      for ( int numThreads : threads ) {
+        Shared_Histogram *histogram = shared_histogram_alloc(uniqueOnly);
+
+        vector<uint32_t> outPixels(input.size());
+        int numColors = 0;
+
+        double t1 = bench_now_ms();
+
+        vector<thread> producers;
+
+        for ( int ti = 0; ti < numThreads; ti++ ) {
+          producers.push_back(thread([&, ti]() {
+            for ( int row = ti; row < height; row += numThreads ) {
+              shared_histogram_add(histogram, &input[row * width], width);
+            }
+          }));
+        }
+
+        for ( thread & producer : producers ) {
+          producer.join();
+        }
+
+        double t2 = bench_now_ms();
+
+        double *weights = shared_histogram_color_table(histogram, outPixels.data(), &numColors);
+
+        double t3 = bench_now_ms();
+
+        shared_histogram_free(histogram);
+
+        bool valid = (numColors == expectedColors);
+
+        for ( int i = 0; valid && i < numColors; i++ ) {
+          valid = (outPixels[i] == expected[i].first) && (uniqueOnly || fabs(weights[i] - expected[i].second) < 1.0e-15);
+        }
+
+        if (weights != nullptr) {
+          delete [] weights;
+        }
+
+        printf("%s : %-6s : %2d threads : %8d unique : add %9.2f ms : table %7.2f ms : %s\n", fewColors ? "64 colors" : "image    ", uniqueOnly ? "unique" : "counts", numThreads, numColors, t2 - t1, t3 - t2, valid ? "valid" : "INVALID");
+      }
+    }
+  }
+
+  // Cluster the weighted colors
+
+  Shared_Histogram *histogram = shared_histogram_alloc(0);
+  shared_histogram_add(histogram, pixels.data(), (uint32_t) pixels.size());
+
+  vector<uint32_t> points(pixels.size());
+  int numPoints = 0;
+
+  double *weights = shared_histogram_color_table(histogram, points.data(), &numPoints);
+
+  shared_histogram_free(histogram);
+
+  Quant_Options options;
+  memset(&options, 0, sizeof(options));
+  options.inplace_partition = 1;
+
+  vector<uint32_t> colortable(256);
+  uint32_t numClusters = 256;
+
+  double t1 = bench_now_ms();
+
+  quant_varpart_weighted(numPoints, points.data(), weights, &numClusters, colortable.data(), 8, 10, &options);
+
+  double t2 = bench_now_ms();
+
+  delete [] weights;
+
+  vector<uint32_t> mapped(pixels.size());
+  map_colors_mps(pixels.data(), (uint32_t) pixels.size(), mapped.data(), colortable.data(), numClusters);
+
+  double mse = calc_combined_mean_sqr_error((uint32_t) pixels.size(), pixels.data(), mapped.data());
+
+  printf("quant_varpart_weighted : %d points : %d clusters : %9.2f ms : MSE %8.4f\n", numPoints, numClusters, t2 - t1, mse);
+}
+
+// Time the sorted unique pixels of an image found with an unordered_map and
+// a sort (as process_file did) and with unique_sorted_pixels, with and
+// without counts, for opaque pixels and for pixels with varied alpha.
+
+static
+void bench_unique_sorted_pixels(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  const int numPixels = (int) pixels.size();
+
+  printf("unique_pixels: %d pixels\n", numPixels);
+
+  for ( int varyAlpha = 0; varyAlpha < 2; varyAlpha++ ) {
+    vector<uint32_t> input(pixels);
+
+    if (varyAlpha) {
+      for ( int i = 0; i < numPixels; i += 7 ) {
+        input[i] = (input[i] & 0x00FFFFFF) | ((uint32_t) (i & 0x3) << 30);
+      }
+    }
+
+    const char *alphaName = varyAlpha ? "alpha " : "opaque";
+
+    double t1 = bench_now_ms();
+
+    unordered_map<uint32_t, uint32_t> uniquePixelMap;
+
+    for ( uint32_t pixel : input ) {
+      uniquePixelMap[pixel] = 0;
+    }
+
+    vector<uint32_t> expected;
+
+    for ( auto & entry : uniquePixelMap ) {
+      expected.push_back(entry.first);
+    }
+
+    uniquePixelMap = unordered_map<uint32_t, uint32_t>();
+
+    sort(begin(expected), end(expected));
+
+    double t2 = bench_now_ms();
+    double mapElapsed = t2 - t1;
+
+    printf("%s : unordered_map + sort : %8d unique : %9.2f ms\n", alphaName, (int) expected.size(), mapElapsed);
+
+    for ( int withCounts = 0; withCounts < 2; withCounts++ ) {
+      vector<uint32_t> outPixels(numPixels);
+      vector<uint32_t> outCounts(withCounts ? numPixels : 0);
+
+      t1 = bench_now_ms();
+
+      uint32_t numUnique = unique_sorted_pixels(numPixels, input.data(), outPixels.data(), withCounts ? outCounts.data() : NULL);
+
+      t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      outPixels.resize(numUnique);
+
+      bool valid = (outPixels == expected);
+
+      if (valid && withCounts) {
+        uint64_t total = 0;
+        for ( uint32_t i = 0; i < numUnique; i++ ) {
+          total += outCounts[i];
+        }
+        valid = (total == (uint64_t) numPixels) && (outCounts[0] == (uint32_t) count(begin(input), end(input), outPixels[0]));
+      }
+
+      printf("%s : unique_sorted_pixels %s : %8d unique : %9.2f ms : speedup %5.2f : %s\n", alphaName, withCounts ? "counts" : "      ", (int) numUnique, elapsed, mapElapsed / elapsed, valid ? "valid" : "INVALID");
+    }
+  }
+}
+
+// Cluster the weighted colors with double weights and with the uint32_t
+// pixel counts of each color, for 8 bits per channel and for 5 bits per
+// channel. The count sums are exact so the colortable can differ from the
+// double weights in the last bits of the means, the MSE should be the same.
+
+static
+void bench_integer_weights(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  const int numPixels = (int) pixels.size();
+
+  printf("integer_weights: %d pixels\n", numPixels);
+
+  int bits[] = { 8, 5 };
+
+  for ( int numBits : bits ) {
+    double doubleElapsed = 0.0;
+
+    for ( int counts = 0; counts < 2; counts++ ) {
+      Quant_Options options;
+      memset(&options, 0, sizeof(options));
+      options.inplace_partition = 1;
+      options.integer_weights = counts;
+
+      vector<uint32_t> tmpPixels(numPixels);
+      vector<uint32_t> colortable(256);
+      uint32_t numClusters = 256;
+
+      double t1 = bench_now_ms();
+
+      quant_varpart_fast(numPixels, pixels.data(), tmpPixels.data(), 1, numPixels, &numClusters, colortable.data(), numBits, 1, 10, 0, &options);
+
+      double t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      if (counts == 0) {
+        doubleElapsed = elapsed;
+      }
+
+      vector<uint32_t> mapped(numPixels);
+      map_colors_mps(pixels.data(), (uint32_t) numPixels, mapped.data(), colortable.data(), numClusters);
+
+      double mse = calc_combined_mean_sqr_error((uint32_t) numPixels, pixels.data(), mapped.data());
+
+      printf("bits %d : %-6s : %9.2f ms : speedup %5.2f : MSE %8.4f\n", numBits, counts ? "counts" : "double", elapsed, doubleElapsed / elapsed, mse);
+    }
+  }
+}
+
+// Cluster the colors of 4 and 5 bit per channel images with the points
+// stored in 32 bits and packed in 16 bits. The colors are counted once and
+// only quant_varpart_weighted is timed. The colortable must be the same for
+// both point types.
+
+static
+void bench_compact_points(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    // Pixels spread over the whole RGB cube, so every reduced color is used
+    pixels = bench_synthetic_unique_pixels(1 << 22);
+  }
+
+  const int numPixels = (int) pixels.size();
+
+  printf("compact_points: %d pixels\n", numPixels);
+
+  int bits[] = { 4, 5 };
+  int clusters[] = { 256, 1024 };
+
+  for ( int numBits : bits ) {
+    vector<uint32_t> colors(numPixels);
+    int numColors = 0;
+
+    double *weights = calc_cut_color_table(pixels.data(), numPixels, colors.data(), 1, numPixels, 1, numBits, DIVQUANT_SIMD_DETECT, &numColors);
+
+    for ( int numClusters : clusters ) {
+      vector<uint32_t> wideColortable;
+      double wideElapsed = 0.0;
+
+      for ( int compact = 0; compact < 2; compact++ ) {
+        Quant_Options options;
+        memset(&options, 0, sizeof(options));
+        options.inplace_partition = 1;
+        options.compact_points = compact;
+
+        vector<uint32_t> points(colors.begin(), colors.begin() + numColors);
+        vector<double> pointWeights(weights, weights + numColors);
+        vector<uint32_t> colortable(numClusters);
+        uint32_t numOut = numClusters;
+
+        double t1 = bench_now_ms();
+
+        quant_varpart_weighted(numColors, points.data(), pointWeights.data(), &numOut, colortable.data(), numBits, 20, &options);
+
+        double t2 = bench_now_ms();
+        double elapsed = t2 - t1;
+
+        if (compact == 0) {
+          wideElapsed = elapsed;
+          wideColortable = colortable;
+        }
+
+        const char *same = (colortable == wideColortable) ? "same" : "DIFFERENT";
+
+        printf("bits %d : %5d colors : K %4d : %-6s : %9.2f ms : speedup %5.2f : %s\n", numBits, numColors, numClusters, compact ? "16 bit" : "32 bit", elapsed, wideElapsed / elapsed, same);
+      }
+    }
+
+    delete [] weights;
+  }
+}
+
+// Cluster unique points without the inplace partition logic, so that each
+// split scans the membership of all the points, for more than 256 clusters
+// with 2 byte and 4 byte memberships. The colortable must be the same.
+
+static
+void bench_member16(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> points;
+
+  if (imagePixels.size() == 0) {
+    points = bench_synthetic_unique_pixels(1 << 17);
+  } else {
+    points = bench_unique_pixels(imagePixels);
+  }
+
+  const int numPoints = (int) points.size();
+
+  printf("member16: %d points\n", numPoints);
+
+  int clusters[] = { 512, 4096, 65536 };
+
+  for ( int numClusters : clusters ) {
+    vector<uint32_t> wideColortable;
+    double wideElapsed = 0.0;
+
+    for ( int wide = 1; wide >= 0; wide-- ) {
+      Quant_Options options;
+      memset(&options, 0, sizeof(options));
+      options.wide_member = wide;
+
+      vector<uint32_t> tmpPixels(numPoints);
+      vector<uint32_t> colortable(numClusters);
+      uint32_t numOut = numClusters;
+
+      double t1 = bench_now_ms();
+
+      quant_varpart_fast(numPoints, points.data(), tmpPixels.data(), 1, numPoints, &numOut, colortable.data(), 8, 1, 10, 1, &options);
+
+      double t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      if (wide) {
+        wideElapsed = elapsed;
+        wideColortable = colortable;
+      }
+
+      const int memberBytes = wide ? 4 : 2;
+      const char *same = (colortable == wideColortable) ? "same" : "DIFFERENT";
+
+      printf("K %5d : member %d bytes : %7d KB : %9.2f ms : speedup %5.2f : %s\n", numClusters, memberBytes, (numPoints * memberBytes) / 1024, elapsed, wideElapsed / elapsed, same);
+    }
+  }
+}
+
+// Cluster into 256 clusters with the local k-means iterations before the
+// last one run on every point and on samples of increasing size of the
+// clusters larger than twice the sample size. The sampled means are not the
+// same, so the MSE of each is reported along with the time.
+
+static
+void bench_lkm_sample(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("lkm_sample: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  int sampleSizes[] = { 0, 65536, 16384, 4096 };
+
+  for ( int weighted = 0; weighted < 2; weighted++ ) {
+    const vector<uint32_t> & input = weighted ? pixels : points;
+    const int numPixels = (int) input.size();
+
+    double fullElapsed = 0.0;
+
+    for ( int sampleSize : sampleSizes ) {
+      Quant_Options options;
+      memset(&options, 0, sizeof(options));
+      options.inplace_partition = 1;
+      options.lkm_sample_size = sampleSize;
+
+      vector<uint32_t> tmpPixels(numPixels);
+      vector<uint32_t> colortable(256);
+      uint32_t numClusters = 256;
+
+      double t1 = bench_now_ms();
+
+      quant_varpart_fast(numPixels, input.data(), tmpPixels.data(), 1, numPixels, &numClusters, colortable.data(), 8, 1, 10, weighted ? 0 : 1, &options);
+
+      double t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      if (sampleSize == 0) {
+        fullElapsed = elapsed;
+      }
+
+      vector<uint32_t> mapped(pixels.size());
+      map_colors_mps(pixels.data(), (uint32_t) pixels.size(), mapped.data(), colortable.data(), numClusters);
+
+      double mse = calc_combined_mean_sqr_error((uint32_t) pixels.size(), pixels.data(), mapped.data());
+
+      printf("%s : sample %6d : %9.2f ms : speedup %5.2f : MSE %8.4f\n", weighted ? "weighted" : "uniform ", sampleSize, elapsed, fullElapsed / elapsed, mse);
+    }
+  }
+}
+
+// Map the pixels of an image through palettes of increasing size with the
+// sum sorted search of map_colors_mps and with the inverse colormap cells,
+// for the full image and for its first 256 x 256 pixels. The outputs must be
+// the same.
+
+static
+void bench_map_cells(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("map_cells: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  int paletteSizes[] = { 16, 64, 256, 1024 };
+
+  for ( int paletteSize : paletteSizes ) {
+    Quant_Options options;
+    memset(&options, 0, sizeof(options));
+    options.inplace_partition = 1;
+
+    vector<uint32_t> tmpPixels(points.size());
+    vector<uint32_t> colortable(paletteSize);
+    uint32_t numClusters = paletteSize;
+
+    quant_varpart_fast((uint32_t) points.size(), points.data(), tmpPixels.data(), 1, (uint32_t) points.size(), &numClusters, colortable.data(), 8, 1, 10, 1, &options);
+
+    for ( int small = 0; small < 2; small++ ) {
+      const uint32_t numPixels = small ? (uint32_t) min((size_t) (256 * 256), pixels.size()) : (uint32_t) pixels.size();
+
+      vector<uint32_t> expected(numPixels);
+      vector<uint32_t> mapped(numPixels);
+
+      double t1 = bench_now_ms();
+
+      map_colors_mps(pixels.data(), numPixels, expected.data(), colortable.data(), numClusters);
+
+      double t2 = bench_now_ms();
+
+      Map_Options mapOptions;
+      memset(&mapOptions, 0, sizeof(mapOptions));
+      mapOptions.cell_cache = 1;
+
+      map_colors(pixels.data(), numPixels, mapped.data(), colortable.data(), numClusters, &mapOptions);
+
+      double t3 = bench_now_ms();
+
+      bool same = (mapped == expected);
+
+      printf("%4d colors : %8d pixels : mps %8.2f ms : cells %8.2f ms : speedup %5.2f : %s\n", numClusters, numPixels, t2 - t1, t3 - t2, (t2 - t1) / (t3 - t2), same ? "same" : "DIFFERENT");
+    }
+  }
+}
+
+// Map the pixels of an image through large palettes with the sum sorted
+// search of map_colors_mps, with the k-d tree and with the search map_colors
+// selects by itself. The outputs must be the same.
+
+static
+void bench_map_kd_tree(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("map_kd_tree: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  int paletteSizes[] = { 256, 1024, 4096, 16384 };
+
+  for ( int paletteSize : paletteSizes ) {
+    Quant_Options options;
+    memset(&options, 0, sizeof(options));
+    options.inplace_partition = 1;
+
+    vector<uint32_t> tmpPixels(points.size());
+    vector<uint32_t> colortable(paletteSize);
+    uint32_t numClusters = paletteSize;
+
+    quant_varpart_fast((uint32_t) points.size(), points.data(), tmpPixels.data(), 1, (uint32_t) points.size(), &numClusters, colortable.data(), 8, 1, 10, 1, &options);
+
+    const uint32_t numPixels = (uint32_t) pixels.size();
+
+    vector<uint32_t> expected(numPixels);
+    vector<uint32_t> mappedTree(numPixels);
+    vector<uint32_t> mappedAuto(numPixels);
+
+    double t1 = bench_now_ms();
+
+    map_colors_mps(pixels.data(), numPixels, expected.data(), colortable.data(), numClusters);
+
+    double t2 = bench_now_ms();
+
+    Map_Options mapOptions;
+    memset(&mapOptions, 0, sizeof(mapOptions));
+    mapOptions.kd_tree = 1;
+
+    map_colors(pixels.data(), numPixels, mappedTree.data(), colortable.data(), numClusters, &mapOptions);
+
+    double t3 = bench_now_ms();
+
+    map_colors(pixels.data(), numPixels, mappedAuto.data(), colortable.data(), numClusters, NULL);
+
+    double t4 = bench_now_ms();
+
+    bool same = (mappedTree == expected) && (mappedAuto == expected);
+
+    printf("%5d colors : mps %8.2f ms : kd tree %8.2f ms : speedup %5.2f : auto %8.2f ms : %s\n", numClusters, t2 - t1, t3 - t2, (t2 - t1) / (t3 - t2), t4 - t3, same ? "same" : "DIFFERENT");
+  }
+}
+
+// Map the pixels of an image through small palettes with the sum sorted
+// search of map_colors_mps and with the brute force SIMD search map_colors
+// selects for them. The outputs must be the same.
+
+static
+void bench_map_nearest(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("map_nearest: %d pixels, %d unique, SIMD level %d\n", (int) pixels.size(), (int) points.size(), DivQuantSimdLevel(DIVQUANT_SIMD_DETECT));
+
+  int paletteSizes[] = { 8, 16, 32, 64, 128, 256 };
+
+  for ( int paletteSize : paletteSizes ) {
+    Quant_Options options;
+    memset(&options, 0, sizeof(options));
+    options.inplace_partition = 1;
+
+    vector<uint32_t> tmpPixels(points.size());
+    vector<uint32_t> colortable(paletteSize);
+    uint32_t numClusters = paletteSize;
+
+    quant_varpart_fast((uint32_t) points.size(), points.data(), tmpPixels.data(), 1, (uint32_t) points.size(), &numClusters, colortable.data(), 8, 1, 10, 1, &options);
+
+    const uint32_t numPixels = (uint32_t) pixels.size();
+
+    vector<uint32_t> expected(numPixels);
+    vector<uint32_t> mapped(numPixels);
+
+    double t1 = bench_now_ms();
+
+    map_colors_mps(pixels.data(), numPixels, expected.data(), colortable.data(), numClusters);
+
+    double t2 = bench_now_ms();
+
+    map_colors(pixels.data(), numPixels, mapped.data(), colortable.data(), numClusters, NULL);
+
+    double t3 = bench_now_ms();
+
+    bool same = (mapped == expected);
+
+    printf("%3d colors : mps %8.2f ms : nearest %8.2f ms : speedup %5.2f : %s\n", numClusters, t2 - t1, t3 - t2, (t2 - t1) / (t3 - t2), same ? "same" : "DIFFERENT");
+  }
+}
+
+// Map the pixels of an image through a 256 color palette with the sum
+// sorted search of map_colors_mps and with the search map_colors selects,
+// with an increasing number of threads. The outputs must be the same.
+
+static
+void bench_map_threads(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("map_threads: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  Quant_Options options;
+  memset(&options, 0, sizeof(options));
+  options.inplace_partition = 1;
+
+  vector<uint32_t> tmpPixels(points.size());
+  vector<uint32_t> colortable(256);
+  uint32_t numClusters = 256;
+
+  quant_varpart_fast((uint32_t) points.size(), points.data(), tmpPixels.data(), 1, (uint32_t) points.size(), &numClusters, colortable.data(), 8, 1, 10, 1, &options);
+
+  const uint32_t numPixels = (uint32_t) pixels.size();
+
+  vector<uint32_t> expected(numPixels);
+  map_colors_mps(pixels.data(), numPixels, expected.data(), colortable.data(), numClusters);
+
+  int threadCounts[] = { 1, 2, 4, 8 };
+
+  for ( int mps = 1; mps >= 0; mps-- ) {
+    double singleElapsed = 0.0;
+
+    for ( int numThreads : threadCounts ) {
+      Map_Options mapOptions;
+      memset(&mapOptions, 0, sizeof(mapOptions));
+      mapOptions.num_threads = numThreads;
+
+      if (mps) {
+        mapOptions.kd_tree = -1;
+        mapOptions.simd = DIVQUANT_SIMD_SCALAR;
+      }
+
+      vector<uint32_t> mapped(numPixels);
+
+      double t1 = bench_now_ms();
+
+      map_colors(pixels.data(), numPixels, mapped.data(), colortable.data(), numClusters, &mapOptions);
+
+      double t2 = bench_now_ms();
+      double elapsed = t2 - t1;
+
+      if (numThreads == 1) {
+        singleElapsed = elapsed;
+      }
+
+      bool same = (mapped == expected);
+
+      printf("%s : %d threads : %8.2f ms : speedup %5.2f : %s\n", mps ? "mps " : "auto", numThreads, elapsed, singleElapsed / elapsed, same ? "same" : "DIFFERENT");
+    }
+  }
+}
+
+// Map the pixels of an image, of the image with half of its pixels replaced
+// by noise and of its unique colors through a 256 color palette, with the
+// search run on every pixel, with the memoized mapping of each unique color
+// and with the mode map_colors selects by itself. The outputs must be the
+// same.
+
+static
+void bench_map_memo(const vector<uint32_t> & imagePixels)
+{
+  vector<uint32_t> pixels(imagePixels);
+
+  if (pixels.size() == 0) {
+    pixels = bench_synthetic_image(4096, 2160);
+  }
+
+  vector<uint32_t> points = bench_unique_pixels(pixels);
+
+  printf("map_memo: %d pixels, %d unique\n", (int) pixels.size(), (int) points.size());
+
+  Quant_Options options;
+  memset(&options, 0, sizeof(options));
+  options.inplace_partition = 1;
+
+  vector<uint32_t> tmpPixels(points.size());
+  vector<uint32_t> colortable(256);
+  uint32_t numClusters = 256;
+
+  quant_varpart_fast((uint32_t) points.size(), points.data(), tmpPixels.data(), 1, (uint32_t) points.size(), &numClusters, colortable.data(), 8, 1, 10, 1, &options);
+
+  vector<uint32_t> noisy(pixels);
+  vector<uint32_t> noise = bench_synthetic_unique_pixels((int) min(noisy.size(), (size_t) (1 << 24)));
+
+  for ( size_t i = 0; i < noise.size(); i += 2 ) {
+    noisy[i] = 0xFF000000 | noise[i];
+  }
+
+  const char *inputNames[] = { "image", "noisy", "unique" };
+  const vector<uint32_t> *inputs[] = { &pixels, &noisy, &points };
+
+  for ( int in = 0; in < 3; in++ ) {
+    const vector<uint32_t> & input = *inputs[in];
+    const uint32_t numPixels = (uint32_t) input.size();
+
+    vector<uint32_t> expected(numPixels);
+    vector<uint32_t> mapped(numPixels);
+
+    double elapsed[3];
+    bool same = true;
+    int memoizeModes[] = { -1, 1, 0 };
+
+    for ( int mode = 0; mode < 3; mode++ ) {
+      Map_Options mapOptions;
+      memset(&mapOptions, 0, sizeof(mapOptions));
+      mapOptions.memoize = memoizeModes[mode];
+
+      double t1 = bench_now_ms();
+
+      map_colors(input.data(), numPixels, (mode == 0) ? expected.data() : mapped.data(), colortable.data(), numClusters, &mapOptions);
+
+      double t2 = bench_now_ms();
+
+      elapsed[mode] = t2 - t1;
+
+      if (mode > 0) {
+        same = same && (mapped == expected);
+      }
+    }
+
+    printf("%-6s : %8d pixels : search %8.2f ms : memo %8.2f ms : speedup %5.2f : auto %8.2f ms : %s\n", inputNames[in], numPixels, elapsed[0], elapsed[1], elapsed[0] / elapsed[1], elapsed[2], same ? "same" : "DIFFERENT");
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage DivQuantBench BENCH [PNG]\n");
+    fprintf(stderr, "BENCH: split_select split_threads split_tasks lkm lkm_fixed planar histogram_split lkm_converge lkm_band color_table cut_color_table color_table_threads shared_histogram unique_pixels integer_weights compact_points member16 lkm_sample map_cells map_kd_tree map_nearest map_threads map_memo\n");
+    exit(1);
+  }
+
+  const char *benchName = argv[1];
+
+  vector<uint32_t> imagePixels;
+  int imageWidth = 0;
+  int imageHeight = 0;
+
+  if (argc == 3) {
+    PngContext cxt;
+    read_png_file(argv[2], &cxt);
+
+    int numPixels = cxt.width * cxt.height;
+    imagePixels.resize(numPixels);
+    memcpy(imagePixels.data(), cxt.pixels, numPixels * sizeof(uint32_t));
+    imageWidth = cxt.width;
+    imageHeight = cxt.height;
+
+    printf("read %d pixels from image of dimensions %d x %d\n", numPixels, cxt.width, cxt.height);
+
+    PngContext_dealloc(&cxt);
+  }
+
+  if (strcmp(benchName, "split_select") == 0) {
+    bench_split_select(imagePixels);
+  } else if (strcmp(benchName, "split_threads") == 0) {
+    bench_split_threads(imagePixels);
+  } else if (strcmp(benchName, "split_tasks") == 0) {
+    bench_split_tasks(imagePixels);
+  } else if (strcmp(benchName, "lkm") == 0) {
+    bench_lkm(imagePixels);
+  } else if (strcmp(benchName, "lkm_fixed") == 0) {
+    bench_lkm_fixed(imagePixels);
+  } else if (strcmp(benchName, "planar") == 0) {
+    bench_planar(imagePixels);
+  } else if (strcmp(benchName, "histogram_split") == 0) {
+    bench_histogram_split(imagePixels);
+  } else if (strcmp(benchName, "lkm_converge") == 0) {
+    bench_lkm_converge(imagePixels);
+  } else if (strcmp(benchName, "lkm_band") == 0) {
+    bench_lkm_band(imagePixels);
+  } else if (strcmp(benchName, "color_table") == 0) {
+    bench_color_table(imagePixels, imageWidth, imageHeight);
+  } else if (strcmp(benchName, "cut_color_table") == 0) {
+    bench_cut_color_table(imagePixels, imageWidth, imageHeight);
+  } else if (strcmp(benchName, "color_table_threads") == 0) {
+    bench_color_table_threads(imagePixels, imageWidth, imageHeight);
+  } else if (strcmp(benchName, "shared_histogram") == 0) {
+    bench_shared_histogram(imagePixels, imageWidth, imageHeight);
+  } else if (strcmp(benchName, "unique_pixels") == 0) {
+    bench_unique_sorted_pixels(imagePixels);
+  } else if (strcmp(benchName, "integer_weights") == 0) {
+    bench_integer_weights(imagePixels);
+  } else if (strcmp(benchName, "compact_points") == 0) {
+    bench_compact_points(imagePixels);
+  } else if (strcmp(benchName, "member16") == 0) {
+    bench_member16(imagePixels);
+  } else if (strcmp(benchName, "lkm_sample") == 0) {
+    bench_lkm_sample(imagePixels);
+  } else if (strcmp(benchName, "map_cells") == 0) {
+    bench_map_cells(imagePixels);
+  } else if (strcmp(benchName, "map_kd_tree") == 0) {
+    bench_map_kd_tree(imagePixels);
+  } else if (strcmp(benchName, "map_nearest") == 0) {
+    bench_map_nearest(imagePixels);
+  } else if (strcmp(benchName, "map_threads") == 0) {
+    bench_map_threads(imagePixels);
+  } else if (strcmp(benchName, "map_memo") == 0) {
+    bench_map_memo(imagePixels);
+  } else {
+    fprintf(stderr, "unknown BENCH \"%s\"\n", benchName);
+    exit(1);
+  }
+
+  return 0;
+}
@@ -231,33 +231,18 @@ vector<uint32_t> generate_cluster_walk_on_center_dist(const vector<uint32_t> &cl
 
 void process_file(PngContext *cxt)
 {
-  // Input contains all pixels from image, dedup pixels using
-  // an unordered_map and then sort after the dedup.
-  
-  unordered_map<uint32_t, uint32_t> uniquePixelMap;
+  // Input contains all pixels from image, find the sorted unique pixels
+  // with a bitmap or a radix sort.
   
   int inputImageNumPixels = cxt->width * cxt->height;
   
   printf("read  %d pixels from input image\n", inputImageNumPixels);
   
-  for ( int i = 0; i < inputImageNumPixels; i++) {
-    uint32_t pixel = cxt->pixels[i];
-    uniquePixelMap[pixel] = 0;
-  }
-  
-  vector<uint32_t> allSortedUniquePixels;
-  
-  for ( auto it = begin(uniquePixelMap); it != end(uniquePixelMap); it++ ) {
-    uint32_t pixel = it->first;
-    allSortedUniquePixels.push_back(pixel);
-  }
-  
-  // Release possibly large amount of memory used for hashtable
-  uniquePixelMap = unordered_map<uint32_t, uint32_t>();
+  vector<uint32_t> allSortedUniquePixels(inputImageNumPixels);
   
-  // Sort pixels into int order (this can take some time for large N)
+  uint32_t numUniquePixels = unique_sorted_pixels(inputImageNumPixels, cxt->pixels, allSortedUniquePixels.data(), NULL);
   
-  sort(begin(allSortedUniquePixels), end(allSortedUniquePixels));
+  allSortedUniquePixels.resize(numUniquePixels);
   
 #if defined(DEBUG)
   checkForDuplicates(allSortedUniquePixels, 0);